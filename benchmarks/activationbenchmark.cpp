@@ -0,0 +1,179 @@
+#include "benchmarkenvironment.h"
+
+#include "latencystatistics.h"
+#include "usbgadgetmanagerservice.h"
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusPendingCallWatcher>
+
+#include <HemeraCore/Literals>
+#include <HemeraCore/Operation>
+#include <HemeraCore/USBGadgetManager>
+
+#include <iostream>
+
+/**
+ * Drives Activate/Deactivate cycles through D-Bus against an in-process USB Gadget Manager,
+ * and reports round-trip latency distributions and throughput for every mode.
+ */
+class ActivationBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    ActivationBenchmark(const QString &busAddress, const QList< uint > &modes, int cycles, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_client(QDBusConnection::connectToBus(busAddress, QStringLiteral("activation-benchmark-client")))
+        , m_modes(modes)
+        , m_cycles(cycles)
+        , m_cycle(0)
+        , m_failures(0)
+    {
+    }
+
+    void start() {
+        m_currentMode = m_modes.takeFirst();
+        m_modeTimer.start();
+        activate();
+    }
+
+Q_SIGNALS:
+    void finished(int failures);
+
+private:
+    QString series(const QString &operation) const {
+        return operation + QLatin1Char('/') + (m_currentMode == static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetP2P) ?
+                                               QStringLiteral("EthernetP2P") : QStringLiteral("EthernetTethering"));
+    }
+
+    void call(const QString &method, const QVariantList &arguments, const std::function<void()> &next) {
+        QDBusMessage message = QDBusMessage::createMethodCall(Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerService()),
+                                                              Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerPath()),
+                                                              QStringLiteral("com.ispirata.Hemera.USBGadgetManager"), method);
+        message.setArguments(arguments);
+
+        QElapsedTimer *timer = new QElapsedTimer;
+        timer->start();
+
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_client.asyncCall(message, 60 * 1000), this);
+        connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, method, timer, next] (QDBusPendingCallWatcher *w) {
+            m_statistics.record(series(method), timer->nsecsElapsed() / 1000);
+            delete timer;
+            if (w->isError()) {
+                std::cerr << qPrintable(method) << " failed: " << qPrintable(w->error().message()) << std::endl;
+                ++m_failures;
+            }
+            w->deleteLater();
+            next();
+        });
+    }
+
+    void activate() {
+        call(QStringLiteral("Activate"), QVariantList() << m_currentMode << QVariantMap(), [this] { deactivate(); });
+    }
+
+    void deactivate() {
+        call(QStringLiteral("Deactivate"), QVariantList(), [this] {
+            if (++m_cycle < m_cycles) {
+                activate();
+                return;
+            }
+
+            qint64 elapsed = m_modeTimer.elapsed();
+            std::cout << qPrintable(series(QStringLiteral("Cycle"))) << ": " << m_cycles << " cycles in " << elapsed << " ms, "
+                      << (m_cycles * 1000.0 / qMax(elapsed, qint64(1))) << " cycles/sec" << std::endl;
+
+            if (m_modes.isEmpty()) {
+                report();
+                Q_EMIT finished(m_failures);
+                return;
+            }
+
+            m_cycle = 0;
+            start();
+        });
+    }
+
+    void report() {
+        QVariantMap statistics = m_statistics.toVariantMap();
+        for (QVariantMap::const_iterator i = statistics.constBegin(); i != statistics.constEnd(); ++i) {
+            QVariantMap s = i.value().toMap();
+            std::cout << qPrintable(i.key()) << " (usec): count " << s.value(QStringLiteral("count")).toULongLong()
+                      << ", p50 " << s.value(QStringLiteral("p50")).toLongLong()
+                      << ", p95 " << s.value(QStringLiteral("p95")).toLongLong()
+                      << ", p99 " << s.value(QStringLiteral("p99")).toLongLong()
+                      << ", max " << s.value(QStringLiteral("max")).toLongLong() << std::endl;
+        }
+        std::cout << "Failures: " << m_failures << std::endl;
+    }
+
+    QDBusConnection m_client;
+    QList< uint > m_modes;
+    uint m_currentMode;
+    int m_cycles;
+    int m_cycle;
+    int m_failures;
+    QElapsedTimer m_modeTimer;
+    LatencyStatistics m_statistics { 1 << 16 };
+};
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Activate/Deactivate latency benchmark against a stand-in connman on a private bus. "
+                                                    "fake-connman delay options (--power-delay, --ipv4-delay...) are forwarded."));
+    parser.addHelpOption();
+    QCommandLineOption cycles(QStringLiteral("cycles"), QStringLiteral("Activate/Deactivate cycles for each mode."), QStringLiteral("n"), QStringLiteral("1000"));
+    QCommandLineOption mode(QStringLiteral("mode"), QStringLiteral("p2p, tethering or both."), QStringLiteral("mode"), QStringLiteral("both"));
+    parser.addOptions(QList< QCommandLineOption >() << cycles << mode);
+    for (const QString &delay : QStringList() << QStringLiteral("power-delay") << QStringLiteral("service-delay") << QStringLiteral("tethering-delay")
+                                              << QStringLiteral("ipv4-delay") << QStringLiteral("connect-delay") << QStringLiteral("job-delay")) {
+        parser.addOption(QCommandLineOption(delay, QStringLiteral("Forwarded to fake-connman."), QStringLiteral("ms")));
+    }
+    parser.process(app);
+
+    QList< uint > modes;
+    if (parser.value(mode) != QStringLiteral("tethering")) {
+        modes << static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetP2P);
+    }
+    if (parser.value(mode) != QStringLiteral("p2p")) {
+        modes << static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetTethering);
+    }
+
+    BenchmarkEnvironment environment;
+    QString errorMessage;
+    if (!environment.start(BenchmarkEnvironment::fakeConnmanArguments(app.arguments()), &errorMessage)) {
+        std::cerr << qPrintable(errorMessage) << std::endl;
+        return 1;
+    }
+
+    USBGadgetManagerService *service = new USBGadgetManagerService;
+    ActivationBenchmark benchmark(environment.busAddress(), modes, parser.value(cycles).toInt());
+
+    QObject::connect(&benchmark, &ActivationBenchmark::finished, [] (int failures) {
+        QCoreApplication::instance()->exit(failures > 0 ? 1 : 0);
+    });
+    QObject::connect(service->init(), &Hemera::Operation::finished, [&benchmark] (Hemera::Operation *op) {
+        if (op->isError()) {
+            std::cerr << "Could not initialize the USB Gadget Manager: " << qPrintable(op->errorMessage()) << std::endl;
+            QCoreApplication::instance()->exit(1);
+            return;
+        }
+        benchmark.start();
+    });
+
+    int ret = app.exec();
+
+    delete service;
+
+    return ret;
+}
+
+#include "activationbenchmark.moc"
@@ -0,0 +1,76 @@
+#include "benchmarkenvironment.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QThread>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusConnectionInterface>
+
+#ifndef FAKE_CONNMAN_EXECUTABLE
+#define FAKE_CONNMAN_EXECUTABLE "fake-connman"
+#endif
+
+BenchmarkEnvironment::BenchmarkEnvironment()
+{
+}
+
+BenchmarkEnvironment::~BenchmarkEnvironment()
+{
+    m_connman.terminate();
+    m_connman.waitForFinished(2000);
+    m_bus.terminate();
+    m_bus.waitForFinished(2000);
+}
+
+QStringList BenchmarkEnvironment::fakeConnmanArguments(const QStringList &arguments)
+{
+    static const QStringList delayOptions = QStringList() << QStringLiteral("--power-delay") << QStringLiteral("--service-delay")
+                                                          << QStringLiteral("--tethering-delay") << QStringLiteral("--ipv4-delay")
+                                                          << QStringLiteral("--connect-delay") << QStringLiteral("--job-delay");
+
+    QStringList forwarded;
+    for (int i = 0; i < arguments.size() - 1; ++i) {
+        if (delayOptions.contains(arguments.at(i))) {
+            forwarded << arguments.at(i) << arguments.at(i + 1);
+        }
+    }
+
+    return forwarded;
+}
+
+bool BenchmarkEnvironment::start(const QStringList &fakeConnmanArguments, QString *errorMessage)
+{
+    m_bus.start(QStringLiteral("dbus-daemon"), QStringList() << QStringLiteral("--session") << QStringLiteral("--nofork")
+                                                             << QStringLiteral("--print-address=1"));
+    if (!m_bus.waitForStarted() || !m_bus.waitForReadyRead(5000)) {
+        *errorMessage = QStringLiteral("Could not start a private D-Bus daemon.");
+        return false;
+    }
+    m_busAddress = QString::fromLatin1(m_bus.readLine().trimmed());
+    qputenv("DBUS_SYSTEM_BUS_ADDRESS", m_busAddress.toLatin1());
+    qputenv("GRAVITY_USB_GADGET_STATE_FILE", m_stateDirectory.path().toLocal8Bit() + "/state.json");
+
+    m_connman.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    m_connman.start(QStringLiteral(FAKE_CONNMAN_EXECUTABLE), fakeConnmanArguments);
+    if (!m_connman.waitForStarted()) {
+        *errorMessage = QStringLiteral("Could not start the stand-in connman.");
+        return false;
+    }
+
+    // Wait until it shows up on the bus.
+    QDBusConnection probe = QDBusConnection::connectToBus(m_busAddress, QStringLiteral("benchmark-environment-probe"));
+    QElapsedTimer timer;
+    timer.start();
+    while (!probe.interface()->isServiceRegistered(QStringLiteral("net.connman")).value() ||
+           !probe.interface()->isServiceRegistered(QStringLiteral("org.freedesktop.systemd1")).value()) {
+        if (timer.elapsed() > 5000 || m_connman.state() != QProcess::Running) {
+            QDBusConnection::disconnectFromBus(QStringLiteral("benchmark-environment-probe"));
+            *errorMessage = QStringLiteral("The stand-in connman did not show up on the bus.");
+            return false;
+        }
+        QThread::msleep(10);
+    }
+    QDBusConnection::disconnectFromBus(QStringLiteral("benchmark-environment-probe"));
+
+    return true;
+}
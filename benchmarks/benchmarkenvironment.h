@@ -0,0 +1,35 @@
+#ifndef BENCHMARKENVIRONMENT_H
+#define BENCHMARKENVIRONMENT_H
+
+#include <QtCore/QProcess>
+#include <QtCore/QStringList>
+#include <QtCore/QTemporaryDir>
+
+/**
+ * A private system bus with stand-ins for connman and systemd on it.
+ *
+ * Once started, QDBusConnection::systemBus() in this process points to the private bus, and the daemon keeps its
+ * state snapshot in a private directory.
+ */
+class BenchmarkEnvironment
+{
+public:
+    BenchmarkEnvironment();
+    ~BenchmarkEnvironment();
+
+    /// Must be called before anything in this process touches the system bus.
+    bool start(const QStringList &fakeConnmanArguments, QString *errorMessage);
+
+    inline QString busAddress() const { return m_busAddress; }
+
+    /// Forwards fake-connman delay options found in @p arguments.
+    static QStringList fakeConnmanArguments(const QStringList &arguments);
+
+private:
+    QProcess m_bus;
+    QProcess m_connman;
+    QString m_busAddress;
+    QTemporaryDir m_stateDirectory;
+};
+
+#endif // BENCHMARKENVIRONMENT_H
@@ -0,0 +1,232 @@
+#include "fakeconnman.h"
+
+#include <QtCore/QTimer>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMetaType>
+
+QDBusArgument &operator<<(QDBusArgument &argument, const ConnmanObject &object)
+{
+    argument.beginStructure();
+    argument << object.path << object.properties;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, ConnmanObject &object)
+{
+    argument.beginStructure();
+    argument >> object.path >> object.properties;
+    argument.endStructure();
+    return argument;
+}
+
+FakeConnmanManager::FakeConnmanManager(const FakeConnmanDelays &delays, QObject *parent)
+    : QObject(parent)
+    , m_delays(delays)
+    , m_technology(nullptr)
+    , m_service(nullptr)
+    , m_serviceAvailable(false)
+{
+    qDBusRegisterMetaType< ConnmanObject >();
+    qDBusRegisterMetaType< ConnmanObjectList >();
+
+    m_technology = new FakeConnmanTechnology(this);
+    m_service = new FakeConnmanService(this);
+}
+
+FakeConnmanManager::~FakeConnmanManager()
+{
+}
+
+bool FakeConnmanManager::registerOnBus(const QDBusConnection &connection)
+{
+    QDBusConnection bus = connection;
+    const QDBusConnection::RegisterOptions options = QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllSignals;
+
+    return bus.registerObject(QStringLiteral("/"), this, options) &&
+           bus.registerObject(FakeConnmanTechnology::path().path(), m_technology, options) &&
+           bus.registerObject(FakeConnmanService::path().path(), m_service, options) &&
+           bus.registerService(QStringLiteral("net.connman"));
+}
+
+void FakeConnmanManager::setServiceAvailable(bool available)
+{
+    if (m_serviceAvailable == available) {
+        return;
+    }
+
+    m_serviceAvailable = available;
+    if (available) {
+        Q_EMIT ServicesChanged(GetServices(), QList< QDBusObjectPath >());
+    } else {
+        m_service->reset();
+        Q_EMIT ServicesChanged(ConnmanObjectList(), QList< QDBusObjectPath >() << FakeConnmanService::path());
+    }
+}
+
+QVariantMap FakeConnmanManager::GetProperties()
+{
+    QVariantMap properties;
+    properties.insert(QStringLiteral("State"), m_serviceAvailable ? QStringLiteral("ready") : QStringLiteral("idle"));
+    properties.insert(QStringLiteral("OfflineMode"), false);
+    return properties;
+}
+
+ConnmanObjectList FakeConnmanManager::GetTechnologies()
+{
+    ConnmanObject technology;
+    technology.path = FakeConnmanTechnology::path();
+    technology.properties = m_technology->properties();
+    return ConnmanObjectList() << technology;
+}
+
+ConnmanObjectList FakeConnmanManager::GetServices()
+{
+    if (!m_serviceAvailable) {
+        return ConnmanObjectList();
+    }
+
+    ConnmanObject service;
+    service.path = FakeConnmanService::path();
+    service.properties = m_service->properties();
+    return ConnmanObjectList() << service;
+}
+
+///////////////////
+
+FakeConnmanTechnology::FakeConnmanTechnology(FakeConnmanManager *manager)
+    : QObject(manager)
+    , m_manager(manager)
+{
+    m_properties.insert(QStringLiteral("Name"), QStringLiteral("Gadget"));
+    m_properties.insert(QStringLiteral("Type"), QStringLiteral("gadget"));
+    m_properties.insert(QStringLiteral("Powered"), false);
+    m_properties.insert(QStringLiteral("Connected"), false);
+    m_properties.insert(QStringLiteral("Tethering"), false);
+}
+
+FakeConnmanTechnology::~FakeConnmanTechnology()
+{
+}
+
+QDBusObjectPath FakeConnmanTechnology::path()
+{
+    return QDBusObjectPath(QStringLiteral("/net/connman/technology/gadget"));
+}
+
+QVariantMap FakeConnmanTechnology::GetProperties()
+{
+    return m_properties;
+}
+
+void FakeConnmanTechnology::changeProperty(const QString &name, const QVariant &value)
+{
+    if (m_properties.value(name) == value) {
+        return;
+    }
+
+    m_properties.insert(name, value);
+    Q_EMIT PropertyChanged(name, QDBusVariant(value));
+}
+
+void FakeConnmanTechnology::SetProperty(const QString &name, const QDBusVariant &value)
+{
+    QVariant v = value.variant();
+
+    if (name == QStringLiteral("Powered")) {
+        QTimer::singleShot(m_manager->delays().power, this, [this, v] {
+            changeProperty(QStringLiteral("Powered"), v.toBool());
+            if (!v.toBool()) {
+                changeProperty(QStringLiteral("Tethering"), false);
+                m_manager->setServiceAvailable(false);
+                return;
+            }
+            QTimer::singleShot(m_manager->delays().service, m_manager, [this] {
+                if (m_properties.value(QStringLiteral("Powered")).toBool()) {
+                    m_manager->setServiceAvailable(true);
+                }
+            });
+        });
+    } else if (name == QStringLiteral("Tethering")) {
+        QTimer::singleShot(m_manager->delays().tethering, this, [this, v] {
+            changeProperty(QStringLiteral("Tethering"), v.toBool());
+        });
+    } else {
+        sendErrorReply(QStringLiteral("net.connman.Error.InvalidProperty"), QStringLiteral("Invalid property"));
+    }
+}
+
+///////////////////
+
+FakeConnmanService::FakeConnmanService(FakeConnmanManager *manager)
+    : QObject(manager)
+    , m_manager(manager)
+{
+    reset();
+}
+
+FakeConnmanService::~FakeConnmanService()
+{
+}
+
+QDBusObjectPath FakeConnmanService::path()
+{
+    return QDBusObjectPath(QStringLiteral("/net/connman/service/gadget_000000000000_usb"));
+}
+
+void FakeConnmanService::reset()
+{
+    QVariantMap ipv4Config;
+    ipv4Config.insert(QStringLiteral("Method"), QStringLiteral("dhcp"));
+
+    QVariantMap ethernet;
+    ethernet.insert(QStringLiteral("Interface"), QStringLiteral("usb0"));
+
+    m_properties.clear();
+    m_properties.insert(QStringLiteral("Name"), QStringLiteral("Wired"));
+    m_properties.insert(QStringLiteral("Type"), QStringLiteral("gadget"));
+    m_properties.insert(QStringLiteral("State"), QStringLiteral("idle"));
+    m_properties.insert(QStringLiteral("IPv4"), QVariantMap());
+    m_properties.insert(QStringLiteral("IPv4.Configuration"), ipv4Config);
+    m_properties.insert(QStringLiteral("Ethernet"), ethernet);
+}
+
+QVariantMap FakeConnmanService::GetProperties()
+{
+    return m_properties;
+}
+
+void FakeConnmanService::changeProperty(const QString &name, const QVariant &value)
+{
+    m_properties.insert(name, value);
+    Q_EMIT PropertyChanged(name, QDBusVariant(value));
+}
+
+void FakeConnmanService::SetProperty(const QString &name, const QDBusVariant &value)
+{
+    if (name != QStringLiteral("IPv4.Configuration")) {
+        sendErrorReply(QStringLiteral("net.connman.Error.InvalidProperty"), QStringLiteral("Invalid property"));
+        return;
+    }
+
+    QVariantMap ipv4Config = qdbus_cast< QVariantMap >(value.variant());
+    QTimer::singleShot(m_manager->delays().ipv4, this, [this, ipv4Config] {
+        changeProperty(QStringLiteral("IPv4.Configuration"), ipv4Config);
+        changeProperty(QStringLiteral("IPv4"), ipv4Config);
+    });
+}
+
+void FakeConnmanService::Connect()
+{
+    QTimer::singleShot(m_manager->delays().connect, this, [this] {
+        changeProperty(QStringLiteral("State"), QStringLiteral("ready"));
+    });
+}
+
+void FakeConnmanService::Disconnect()
+{
+    QTimer::singleShot(m_manager->delays().connect, this, [this] {
+        changeProperty(QStringLiteral("State"), QStringLiteral("idle"));
+    });
+}
@@ -0,0 +1,131 @@
+#ifndef FAKECONNMAN_H
+#define FAKECONNMAN_H
+
+#include <QtCore/QObject>
+#include <QtCore/QVariantMap>
+
+#include <QtDBus/QDBusArgument>
+#include <QtDBus/QDBusContext>
+#include <QtDBus/QDBusObjectPath>
+#include <QtDBus/QDBusVariant>
+
+struct ConnmanObject {
+    QDBusObjectPath path;
+    QVariantMap properties;
+};
+typedef QList< ConnmanObject > ConnmanObjectList;
+
+Q_DECLARE_METATYPE(ConnmanObject)
+Q_DECLARE_METATYPE(ConnmanObjectList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const ConnmanObject &object);
+const QDBusArgument &operator>>(const QDBusArgument &argument, ConnmanObject &object);
+
+/// How long the stand-in takes before applying each kind of change, in milliseconds.
+struct FakeConnmanDelays {
+    FakeConnmanDelays() : power(0), service(0), tethering(0), ipv4(0), connect(0) {}
+
+    int power;
+    int service;
+    int tethering;
+    int ipv4;
+    int connect;
+};
+
+class FakeConnmanService;
+class FakeConnmanTechnology;
+
+/**
+ * A stand-in for connman, implementing just what the USB Gadget Manager uses: the Manager,
+ * the gadget technology and a single gadget service, which shows up once the technology is powered.
+ */
+class FakeConnmanManager : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "net.connman.Manager")
+
+public:
+    explicit FakeConnmanManager(const FakeConnmanDelays &delays, QObject *parent = nullptr);
+    virtual ~FakeConnmanManager();
+
+    bool registerOnBus(const QDBusConnection &connection);
+
+    inline FakeConnmanDelays delays() const { return m_delays; }
+
+    void setServiceAvailable(bool available);
+
+public Q_SLOTS:
+    QVariantMap GetProperties();
+    ConnmanObjectList GetTechnologies();
+    ConnmanObjectList GetServices();
+
+Q_SIGNALS:
+    void PropertyChanged(const QString &name, const QDBusVariant &value);
+    void TechnologyAdded(const QDBusObjectPath &path, const QVariantMap &properties);
+    void TechnologyRemoved(const QDBusObjectPath &path);
+    void ServicesChanged(const ConnmanObjectList &changed, const QList< QDBusObjectPath > &removed);
+
+private:
+    FakeConnmanDelays m_delays;
+    FakeConnmanTechnology *m_technology;
+    FakeConnmanService *m_service;
+    bool m_serviceAvailable;
+};
+
+class FakeConnmanTechnology : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "net.connman.Technology")
+
+public:
+    explicit FakeConnmanTechnology(FakeConnmanManager *manager);
+    virtual ~FakeConnmanTechnology();
+
+    static QDBusObjectPath path();
+    inline QVariantMap properties() const { return m_properties; }
+
+public Q_SLOTS:
+    QVariantMap GetProperties();
+    void SetProperty(const QString &name, const QDBusVariant &value);
+
+Q_SIGNALS:
+    void PropertyChanged(const QString &name, const QDBusVariant &value);
+
+private:
+    void changeProperty(const QString &name, const QVariant &value);
+
+    FakeConnmanManager *m_manager;
+    QVariantMap m_properties;
+};
+
+class FakeConnmanService : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "net.connman.Service")
+
+public:
+    explicit FakeConnmanService(FakeConnmanManager *manager);
+    virtual ~FakeConnmanService();
+
+    static QDBusObjectPath path();
+    inline QVariantMap properties() const { return m_properties; }
+
+    void reset();
+
+public Q_SLOTS:
+    QVariantMap GetProperties();
+    void SetProperty(const QString &name, const QDBusVariant &value);
+    void Connect();
+    void Disconnect();
+
+Q_SIGNALS:
+    void PropertyChanged(const QString &name, const QDBusVariant &value);
+
+private:
+    void changeProperty(const QString &name, const QVariant &value);
+
+    FakeConnmanManager *m_manager;
+    QVariantMap m_properties;
+};
+
+#endif // FAKECONNMAN_H
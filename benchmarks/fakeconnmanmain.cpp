@@ -0,0 +1,48 @@
+#include "fakeconnman.h"
+#include "fakesystemd.h"
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+
+#include <QtDBus/QDBusConnection>
+
+#include <iostream>
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Stand-in connman and systemd for the USB Gadget Manager benchmarks. Runs on the system bus."));
+    parser.addHelpOption();
+
+    QCommandLineOption power(QStringLiteral("power-delay"), QStringLiteral("Delay before powering changes, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption service(QStringLiteral("service-delay"), QStringLiteral("Delay before the service appears after powering, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption tethering(QStringLiteral("tethering-delay"), QStringLiteral("Delay before tethering changes, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption ipv4(QStringLiteral("ipv4-delay"), QStringLiteral("Delay before IPv4 configuration changes, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption connect(QStringLiteral("connect-delay"), QStringLiteral("Delay before (dis)connections complete, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption job(QStringLiteral("job-delay"), QStringLiteral("Delay before systemd jobs complete, in ms."), QStringLiteral("ms"), QStringLiteral("0"));
+    parser.addOptions(QList< QCommandLineOption >() << power << service << tethering << ipv4 << connect << job);
+    parser.process(app);
+
+    FakeConnmanDelays delays;
+    delays.power = parser.value(power).toInt();
+    delays.service = parser.value(service).toInt();
+    delays.tethering = parser.value(tethering).toInt();
+    delays.ipv4 = parser.value(ipv4).toInt();
+    delays.connect = parser.value(connect).toInt();
+
+    FakeConnmanManager manager(delays);
+    if (!manager.registerOnBus(QDBusConnection::systemBus())) {
+        std::cerr << "Could not register the stand-in connman on the bus." << std::endl;
+        return 1;
+    }
+
+    FakeSystemdManager systemd(parser.value(job).toInt());
+    if (!systemd.registerOnBus(QDBusConnection::systemBus())) {
+        std::cerr << "Could not register the stand-in systemd on the bus." << std::endl;
+        return 1;
+    }
+
+    return app.exec();
+}
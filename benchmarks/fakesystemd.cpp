@@ -0,0 +1,59 @@
+#include "fakesystemd.h"
+
+#include <QtCore/QTimer>
+
+#include <QtDBus/QDBusConnection>
+
+FakeSystemdManager::FakeSystemdManager(int jobDelay, QObject *parent)
+    : QObject(parent)
+    , m_jobDelay(jobDelay)
+    , m_lastJob(0)
+{
+}
+
+FakeSystemdManager::~FakeSystemdManager()
+{
+}
+
+bool FakeSystemdManager::registerOnBus(const QDBusConnection &connection)
+{
+    QDBusConnection bus = connection;
+    return bus.registerObject(QStringLiteral("/org/freedesktop/systemd1"), this,
+                              QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllSignals) &&
+           bus.registerService(QStringLiteral("org.freedesktop.systemd1"));
+}
+
+void FakeSystemdManager::Subscribe()
+{
+}
+
+QDBusObjectPath FakeSystemdManager::StartUnit(const QString &name, const QString &mode)
+{
+    Q_UNUSED(mode)
+    return queueJob(name);
+}
+
+QDBusObjectPath FakeSystemdManager::StopUnit(const QString &name, const QString &mode)
+{
+    Q_UNUSED(mode)
+    return queueJob(name);
+}
+
+QDBusObjectPath FakeSystemdManager::RestartUnit(const QString &name, const QString &mode)
+{
+    Q_UNUSED(mode)
+    return queueJob(name);
+}
+
+QDBusObjectPath FakeSystemdManager::queueJob(const QString &unit)
+{
+    uint id = ++m_lastJob;
+    QDBusObjectPath job(QStringLiteral("/org/freedesktop/systemd1/job/%1").arg(id));
+
+    // Never before the reply: it is queued after it in any case.
+    QTimer::singleShot(m_jobDelay, this, [this, id, job, unit] {
+        Q_EMIT JobRemoved(id, job, unit, QStringLiteral("done"));
+    });
+
+    return job;
+}
@@ -0,0 +1,39 @@
+#ifndef FAKESYSTEMD_H
+#define FAKESYSTEMD_H
+
+#include <QtCore/QObject>
+
+#include <QtDBus/QDBusObjectPath>
+
+/**
+ * A stand-in for the systemd Manager: units are started and stopped instantly (or after a delay),
+ * and every job is reported through JobRemoved like systemd would.
+ */
+class FakeSystemdManager : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.systemd1.Manager")
+
+public:
+    explicit FakeSystemdManager(int jobDelay, QObject *parent = nullptr);
+    virtual ~FakeSystemdManager();
+
+    bool registerOnBus(const QDBusConnection &connection);
+
+public Q_SLOTS:
+    void Subscribe();
+    QDBusObjectPath StartUnit(const QString &name, const QString &mode);
+    QDBusObjectPath StopUnit(const QString &name, const QString &mode);
+    QDBusObjectPath RestartUnit(const QString &name, const QString &mode);
+
+Q_SIGNALS:
+    void JobRemoved(uint id, const QDBusObjectPath &job, const QString &unit, const QString &result);
+
+private:
+    QDBusObjectPath queueJob(const QString &unit);
+
+    int m_jobDelay;
+    uint m_lastJob;
+};
+
+#endif // FAKESYSTEMD_H
@@ -0,0 +1,429 @@
+#include "gadgetmodes.h"
+#include "kernelmodules.h"
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QProcess>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QSysInfo>
+#include <QtCore/QThread>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMessage>
+
+#include <HemeraCore/Literals>
+
+#include <iostream>
+
+#define DUMMY_HCD_MODULE "dummy_hcd"
+#define DUMMY_UDC "dummy_udc.0"
+/* The host controller paired with DUMMY_UDC */
+#define DUMMY_HCD "dummy_hcd.0"
+
+#define GADGET_NAMESPACE "ugm-bench-gadget"
+#define HOST_NAMESPACE "ugm-bench-host"
+#define GADGET_ADDRESS "10.203.0.1"
+#define HOST_ADDRESS "10.203.0.2"
+
+/* 60 seconds */
+constexpr int callTimeout() { return 60 * 1000; }
+/* 10 seconds */
+constexpr int linkTimeout() { return 10 * 1000; }
+
+/**
+ * Measures what the USB link itself can do, on a single machine.
+ *
+ * dummy_hcd provides both a UDC and a host controller: the gadget the daemon activates on the former is enumerated
+ * by the latter. Each end of the link is then moved to its own network namespace, so that traffic between them has
+ * to go through USB rather than being short-circuited by the local routing table.
+ *
+ * Needs root, a running USB Gadget Manager on the system bus, iproute2, ping and iperf3.
+ */
+class LoopbackBenchmark
+{
+public:
+    struct Case {
+        QString function;
+        uint qmult;
+        uint mtu;
+    };
+
+    LoopbackBenchmark(const QString &backend, int duration, int pings)
+        : m_backend(backend)
+        , m_duration(duration)
+        , m_pings(pings)
+    {
+    }
+
+    QJsonObject run(const Case &c) {
+        QJsonObject result;
+        result.insert(QStringLiteral("function"), c.function);
+        result.insert(QStringLiteral("backend"), m_backend);
+        result.insert(QStringLiteral("qmult"), static_cast<double>(c.qmult));
+        result.insert(QStringLiteral("mtu"), static_cast<double>(c.mtu));
+
+        QString errorMessage;
+        QString gadgetInterface;
+        QString hostInterface;
+        if (!activate(c, &result, &errorMessage) || !findInterfaces(&gadgetInterface, &hostInterface, &errorMessage) ||
+            !isolate(c, gadgetInterface, hostInterface, &errorMessage) || !measure(&result, &errorMessage)) {
+            result.insert(QStringLiteral("error"), errorMessage);
+        }
+
+        teardown();
+        return result;
+    }
+
+private:
+    static bool execute(const QStringList &command, QByteArray *output, QString *errorMessage, int timeout = callTimeout()) {
+        QProcess process;
+        process.start(command.first(), command.mid(1));
+        if (!process.waitForFinished(timeout) || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+            *errorMessage = QStringLiteral("%1 failed: %2").arg(command.join(QLatin1Char(' ')),
+                                                                QString::fromLocal8Bit(process.readAllStandardError()).trimmed());
+            process.kill();
+            process.waitForFinished();
+            return false;
+        }
+
+        if (output) {
+            *output = process.readAllStandardOutput();
+        }
+        return true;
+    }
+
+    static QStringList inNamespace(const QString &ns, const QStringList &command) {
+        return QStringList() << QStringLiteral("ip") << QStringLiteral("netns") << QStringLiteral("exec") << ns << command;
+    }
+
+    static QDBusMessage call(const QString &method, const QVariantList &arguments) {
+        QDBusMessage message = QDBusMessage::createMethodCall(Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerService()),
+                                                              Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerPath()),
+                                                              QStringLiteral("com.ispirata.Hemera.USBGadgetManager"), method);
+        message.setArguments(arguments);
+        return QDBusConnection::systemBus().call(message, QDBus::Block, callTimeout());
+    }
+
+    static QStringList ip(const QString &ns, const QStringList &arguments) {
+        return QStringList() << QStringLiteral("ip") << QStringLiteral("-n") << ns << arguments;
+    }
+
+    /// NCM has a mode of its own, the other functions run P2P.
+    static uint modeFor(const QString &function) {
+        return static_cast<uint>(function == QStringLiteral("ncm") ? GadgetModes::EthernetNCM : Hemera::USBGadgetManager::Mode::EthernetP2P);
+    }
+
+    bool activate(const Case &c, QJsonObject *result, QString *errorMessage) {
+        uint mode = modeFor(c.function);
+
+        // The daemon picks up the UDC through udev: give it a moment if it's just been loaded.
+        QElapsedTimer timer;
+        timer.start();
+        while (!(call(QStringLiteral("GetState"), QVariantList()).arguments().value(0).toMap()
+                     .value(QStringLiteral("availableModes")).toUInt() & mode)) {
+            if (timer.elapsed() > linkTimeout()) {
+                *errorMessage = QStringLiteral("The USB Gadget Manager does not offer mode %1.").arg(GadgetModes::name(mode));
+                return false;
+            }
+            QThread::msleep(100);
+        }
+
+        QVariantMap arguments;
+        arguments.insert(QStringLiteral("backend"), m_backend);
+        arguments.insert(QStringLiteral("function"), c.function);
+        arguments.insert(QStringLiteral("dhcpServer"), QStringLiteral("embedded"));
+        if (m_backend == QStringLiteral("configfs")) {
+            arguments.insert(QStringLiteral("udc"), QStringLiteral(DUMMY_UDC));
+        }
+        if (c.qmult > 0) {
+            arguments.insert(QStringLiteral("qmult"), c.qmult);
+        }
+        if (c.mtu > 0) {
+            arguments.insert(QStringLiteral("mtu"), c.mtu);
+        }
+
+        timer.restart();
+        QDBusMessage reply = call(QStringLiteral("Activate"), QVariantList() << mode << arguments);
+        if (reply.type() == QDBusMessage::ErrorMessage) {
+            *errorMessage = QStringLiteral("Activate failed: %1").arg(reply.errorMessage());
+            return false;
+        }
+        result->insert(QStringLiteral("activationUsec"), static_cast<double>(timer.nsecsElapsed() / 1000));
+
+        return true;
+    }
+
+    /// The gadget end sits below the UDC, the host end is claimed by a CDC or RNDIS host driver.
+    bool findInterfaces(QString *gadgetInterface, QString *hostInterface, QString *errorMessage) {
+        static const QStringList hostDrivers = QStringList() << QStringLiteral("cdc_ether") << QStringLiteral("cdc_ncm")
+                                                             << QStringLiteral("rndis_host");
+
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < linkTimeout()) {
+            for (const QString &interface : QDir(QStringLiteral("/sys/class/net")).entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System)) {
+                QString device = QFileInfo(QStringLiteral("/sys/class/net/%1/device").arg(interface)).canonicalFilePath();
+                QString driver = QFileInfo(QStringLiteral("/sys/class/net/%1/device/driver").arg(interface)).canonicalFilePath();
+                // Other USB NICs may be around, with the same drivers: ours is the one enumerated on the dummy host controller.
+                if (hostDrivers.contains(QFileInfo(driver).fileName()) && device.contains(QStringLiteral("/" DUMMY_HCD "/"))) {
+                    *hostInterface = interface;
+                } else if (device.contains(QStringLiteral("/" DUMMY_UDC "/"))) {
+                    *gadgetInterface = interface;
+                }
+            }
+
+            if (!gadgetInterface->isEmpty() && !hostInterface->isEmpty()) {
+                return true;
+            }
+            QThread::msleep(100);
+        }
+
+        *errorMessage = QStringLiteral("The link did not come up: gadget interface \"%1\", host interface \"%2\".")
+                            .arg(*gadgetInterface, *hostInterface);
+        return false;
+    }
+
+    bool isolate(const Case &c, const QString &gadgetInterface, const QString &hostInterface, QString *errorMessage) {
+        struct End {
+            QString ns;
+            QString interface;
+            QString address;
+        };
+
+        for (const End &end : { End { QStringLiteral(GADGET_NAMESPACE), gadgetInterface, QStringLiteral(GADGET_ADDRESS "/30") },
+                                End { QStringLiteral(HOST_NAMESPACE), hostInterface, QStringLiteral(HOST_ADDRESS "/30") } }) {
+            QList< QStringList > commands;
+            commands << (QStringList() << QStringLiteral("ip") << QStringLiteral("netns") << QStringLiteral("add") << end.ns)
+                     << (QStringList() << QStringLiteral("ip") << QStringLiteral("link") << QStringLiteral("set") << QStringLiteral("dev")
+                                       << end.interface << QStringLiteral("netns") << end.ns)
+                     << ip(end.ns, QStringList() << QStringLiteral("link") << QStringLiteral("set") << QStringLiteral("lo") << QStringLiteral("up"))
+                     << ip(end.ns, QStringList() << QStringLiteral("addr") << QStringLiteral("add") << end.address
+                                                 << QStringLiteral("dev") << end.interface)
+                     << ip(end.ns, QStringList() << QStringLiteral("link") << QStringLiteral("set") << end.interface << QStringLiteral("up"));
+
+            for (const QStringList &command : commands) {
+                if (!execute(command, nullptr, errorMessage)) {
+                    return false;
+                }
+            }
+        }
+
+        // The daemon set the gadget end only.
+        if (c.mtu > 0 && !execute(ip(QStringLiteral(HOST_NAMESPACE), QStringList() << QStringLiteral("link") << QStringLiteral("set") << hostInterface
+                                                                                   << QStringLiteral("mtu") << QString::number(c.mtu)),
+                                  nullptr, errorMessage)) {
+            return false;
+        }
+
+        // Wait for the first packet to make it through.
+        return execute(inNamespace(QStringLiteral(HOST_NAMESPACE), QStringList() << QStringLiteral("ping") << QStringLiteral("-c") << QStringLiteral("1")
+                                                                                 << QStringLiteral("-w") << QString::number(linkTimeout() / 1000)
+                                                                                 << QStringLiteral(GADGET_ADDRESS)),
+                       nullptr, errorMessage);
+    }
+
+    bool measure(QJsonObject *result, QString *errorMessage) {
+        // Latency
+        QByteArray output;
+        if (!execute(inNamespace(QStringLiteral(HOST_NAMESPACE), QStringList() << QStringLiteral("ping") << QStringLiteral("-q")
+                                                                               << QStringLiteral("-i") << QStringLiteral("0.01")
+                                                                               << QStringLiteral("-c") << QString::number(m_pings)
+                                                                               << QStringLiteral(GADGET_ADDRESS)),
+                     &output, errorMessage)) {
+            return false;
+        }
+
+        QRegularExpressionMatch rtt = QRegularExpression(QStringLiteral("= ([\\d.]+)/([\\d.]+)/([\\d.]+)/([\\d.]+) ms"))
+                                          .match(QString::fromLatin1(output));
+        if (!rtt.hasMatch()) {
+            *errorMessage = QStringLiteral("Could not parse ping output: %1").arg(QString::fromLatin1(output));
+            return false;
+        }
+
+        QJsonObject ping;
+        ping.insert(QStringLiteral("count"), m_pings);
+        ping.insert(QStringLiteral("minMs"), rtt.captured(1).toDouble());
+        ping.insert(QStringLiteral("avgMs"), rtt.captured(2).toDouble());
+        ping.insert(QStringLiteral("maxMs"), rtt.captured(3).toDouble());
+        ping.insert(QStringLiteral("mdevMs"), rtt.captured(4).toDouble());
+        result->insert(QStringLiteral("ping"), ping);
+
+        // Throughput, both ways for TCP as the gadget's RX and TX paths differ.
+        QJsonObject upstream;
+        QJsonObject downstream;
+        QJsonObject udp;
+        if (!iperf(QStringList(), &upstream, errorMessage) ||
+            !iperf(QStringList() << QStringLiteral("-R"), &downstream, errorMessage) ||
+            !iperf(QStringList() << QStringLiteral("-u") << QStringLiteral("-b") << QStringLiteral("0"), &udp, errorMessage)) {
+            return false;
+        }
+
+        QJsonObject tcp;
+        tcp.insert(QStringLiteral("hostToGadgetBitsPerSecond"), upstream.value(QStringLiteral("sum_received")).toObject()
+                                                                        .value(QStringLiteral("bits_per_second")));
+        tcp.insert(QStringLiteral("hostToGadgetRetransmits"), upstream.value(QStringLiteral("sum_sent")).toObject()
+                                                                      .value(QStringLiteral("retransmits")));
+        tcp.insert(QStringLiteral("gadgetToHostBitsPerSecond"), downstream.value(QStringLiteral("sum_received")).toObject()
+                                                                          .value(QStringLiteral("bits_per_second")));
+        result->insert(QStringLiteral("tcp"), tcp);
+
+        QJsonObject udpSum = udp.value(QStringLiteral("sum")).toObject();
+        QJsonObject udpResult;
+        udpResult.insert(QStringLiteral("bitsPerSecond"), udpSum.value(QStringLiteral("bits_per_second")));
+        udpResult.insert(QStringLiteral("jitterMs"), udpSum.value(QStringLiteral("jitter_ms")));
+        udpResult.insert(QStringLiteral("lostPercent"), udpSum.value(QStringLiteral("lost_percent")));
+        result->insert(QStringLiteral("udp"), udpResult);
+
+        return true;
+    }
+
+    /// Runs an iperf3 client in the host namespace against a one-off server in the gadget one, and returns its "end" section.
+    bool iperf(const QStringList &arguments, QJsonObject *end, QString *errorMessage) {
+        QProcess server;
+        QStringList serverCommand = inNamespace(QStringLiteral(GADGET_NAMESPACE), QStringList() << QStringLiteral("iperf3") << QStringLiteral("-s")
+                                                                                                << QStringLiteral("-1") << QStringLiteral("-B")
+                                                                                                << QStringLiteral(GADGET_ADDRESS));
+        server.start(serverCommand.first(), serverCommand.mid(1));
+        while (!server.readAllStandardOutput().contains("Server listening")) {
+            if (!server.waitForReadyRead(linkTimeout())) {
+                *errorMessage = QStringLiteral("The iperf3 server did not start: %1").arg(QString::fromLocal8Bit(server.readAllStandardError()));
+                server.kill();
+                server.waitForFinished();
+                return false;
+            }
+        }
+
+        QByteArray output;
+        bool ok = execute(inNamespace(QStringLiteral(HOST_NAMESPACE), QStringList() << QStringLiteral("iperf3") << QStringLiteral("-J")
+                                                                                    << QStringLiteral("-c") << QStringLiteral(GADGET_ADDRESS)
+                                                                                    << QStringLiteral("-t") << QString::number(m_duration)
+                                                                                    << arguments),
+                          &output, errorMessage, callTimeout() + m_duration * 1000);
+
+        if (!server.waitForFinished(linkTimeout())) {
+            server.kill();
+            server.waitForFinished();
+        }
+
+        if (!ok) {
+            return false;
+        }
+
+        *end = QJsonDocument::fromJson(output).object().value(QStringLiteral("end")).toObject();
+        return true;
+    }
+
+    void teardown() {
+        // Physical interfaces go back to the initial namespace with their namespace, and the daemon finds its gadget again.
+        QString errorMessage;
+        for (const QString &ns : QStringList() << QStringLiteral(GADGET_NAMESPACE) << QStringLiteral(HOST_NAMESPACE)) {
+            execute(QStringList() << QStringLiteral("ip") << QStringLiteral("netns") << QStringLiteral("del") << ns, nullptr, &errorMessage);
+        }
+
+        QDBusMessage reply = call(QStringLiteral("Deactivate"), QVariantList());
+        if (reply.type() == QDBusMessage::ErrorMessage) {
+            std::cerr << "Deactivate failed: " << qPrintable(reply.errorMessage()) << std::endl;
+        }
+    }
+
+    QString m_backend;
+    int m_duration;
+    int m_pings;
+};
+
+static QList< uint > parseList(const QString &value)
+{
+    QList< uint > list;
+    for (const QString &item : value.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        list << item.toUInt();
+    }
+    return list;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("USB link throughput and latency benchmark over a dummy_hcd loopback, "
+                                                    "against the USB Gadget Manager running on the system bus. Results are printed as JSON."));
+    parser.addHelpOption();
+    QCommandLineOption functions(QStringLiteral("functions"), QStringLiteral("Comma separated USB functions to try."),
+                                 QStringLiteral("ecm,ncm,rndis"), QStringLiteral("ecm,ncm,rndis"));
+    QCommandLineOption qmults(QStringLiteral("qmult"), QStringLiteral("Comma separated qmult values to try, 0 for the kernel default."),
+                              QStringLiteral("n,..."), QStringLiteral("0"));
+    QCommandLineOption mtus(QStringLiteral("mtu"), QStringLiteral("Comma separated MTUs to try, 0 for the kernel default."),
+                            QStringLiteral("n,..."), QStringLiteral("0"));
+    QCommandLineOption backend(QStringLiteral("backend"), QStringLiteral("legacy or configfs."), QStringLiteral("backend"), QStringLiteral("configfs"));
+    QCommandLineOption duration(QStringLiteral("duration"), QStringLiteral("Seconds every iperf3 run lasts."), QStringLiteral("s"), QStringLiteral("10"));
+    QCommandLineOption pings(QStringLiteral("pings"), QStringLiteral("Pings for the latency measurement."), QStringLiteral("n"), QStringLiteral("1000"));
+    QCommandLineOption output(QStringLiteral("output"), QStringLiteral("Write results to a file rather than to stdout."), QStringLiteral("file"));
+    parser.addOptions(QList< QCommandLineOption >() << functions << qmults << mtus << backend << duration << pings << output);
+    parser.process(app);
+
+    QList< LoopbackBenchmark::Case > cases;
+    for (const QString &function : parser.value(functions).split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        if (function != QStringLiteral("ecm") && function != QStringLiteral("ncm") && function != QStringLiteral("rndis")) {
+            std::cerr << "Unknown function " << qPrintable(function) << std::endl;
+            return 1;
+        }
+        for (uint qmult : parseList(parser.value(qmults))) {
+            for (uint mtu : parseList(parser.value(mtus))) {
+                cases << LoopbackBenchmark::Case { function, qmult, mtu };
+            }
+        }
+    }
+
+    // Both ends of the link, on this very machine.
+    QString errorMessage;
+    bool loadedDummyHCD = !KernelModules::isLoaded(QStringLiteral(DUMMY_HCD_MODULE));
+    if (loadedDummyHCD && !KernelModules::load(QStringLiteral(DUMMY_HCD_MODULE), &errorMessage)) {
+        std::cerr << qPrintable(errorMessage) << std::endl;
+        return 1;
+    }
+
+    LoopbackBenchmark benchmark(parser.value(backend), parser.value(duration).toInt(), parser.value(pings).toInt());
+    QJsonArray results;
+    int failures = 0;
+    for (const LoopbackBenchmark::Case &c : cases) {
+        QJsonObject result = benchmark.run(c);
+        if (result.contains(QStringLiteral("error"))) {
+            std::cerr << qPrintable(result.value(QStringLiteral("error")).toString()) << std::endl;
+            ++failures;
+        }
+        results.append(result);
+    }
+
+    if (loadedDummyHCD && !KernelModules::unload(QStringLiteral(DUMMY_HCD_MODULE), &errorMessage)) {
+        std::cerr << qPrintable(errorMessage) << std::endl;
+    }
+
+    QJsonObject report;
+    report.insert(QStringLiteral("benchmark"), QStringLiteral("loopback"));
+    report.insert(QStringLiteral("version"), QStringLiteral(GRAVITY_USB_GADGET_MANAGER_VERSION));
+    report.insert(QStringLiteral("kernel"), QSysInfo::kernelVersion());
+    report.insert(QStringLiteral("timestamp"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    report.insert(QStringLiteral("results"), results);
+
+    QFile file;
+    if (parser.isSet(output)) {
+        file.setFileName(parser.value(output));
+        if (!file.open(QIODevice::WriteOnly)) {
+            std::cerr << "Could not write to " << qPrintable(parser.value(output)) << ": " << qPrintable(file.errorString()) << std::endl;
+            return 1;
+        }
+    } else {
+        file.open(stdout, QIODevice::WriteOnly);
+    }
+    file.write(QJsonDocument(report).toJson());
+
+    return failures > 0 ? 1 : 0;
+}
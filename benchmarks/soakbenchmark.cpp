@@ -0,0 +1,314 @@
+#include "benchmarkenvironment.h"
+
+#include "usbgadgetmanagerservice.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QTimer>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusPendingCallWatcher>
+
+#include <HemeraCore/Literals>
+#include <HemeraCore/Operation>
+#include <HemeraCore/USBGadgetManager>
+
+#include <unistd.h>
+
+#include <iostream>
+
+// QtCore's hooks for debugging tools: every QObject goes through them, whoever owns it and whatever thread it lives in.
+QT_BEGIN_NAMESPACE
+extern quintptr Q_CORE_EXPORT qtHookData[];
+QT_END_NAMESPACE
+
+/* Slots in qtHookData, as in QtCore's qhooks_p.h */
+constexpr int addQObjectHook() { return 3; }
+constexpr int removeQObjectHook() { return 4; }
+
+namespace {
+
+typedef void (*QObjectHook)(QObject *object);
+
+QAtomicInt liveObjects;
+QObjectHook previousAddHook = nullptr;
+QObjectHook previousRemoveHook = nullptr;
+
+void onQObjectAdded(QObject *object)
+{
+    liveObjects.ref();
+    if (previousAddHook) {
+        previousAddHook(object);
+    }
+}
+
+void onQObjectRemoved(QObject *object)
+{
+    liveObjects.deref();
+    if (previousRemoveHook) {
+        previousRemoveHook(object);
+    }
+}
+
+/// Before anything else is created: objects which were there already would only ever count on their way out.
+void installObjectCounter()
+{
+    previousAddHook = reinterpret_cast<QObjectHook>(qtHookData[addQObjectHook()]);
+    previousRemoveHook = reinterpret_cast<QObjectHook>(qtHookData[removeQObjectHook()]);
+    qtHookData[addQObjectHook()] = reinterpret_cast<quintptr>(&onQObjectAdded);
+    qtHookData[removeQObjectHook()] = reinterpret_cast<quintptr>(&onQObjectRemoved);
+}
+
+}
+
+/**
+ * Cycles Activate/Deactivate through D-Bus against an in-process USB Gadget Manager for as long as it takes to make a
+ * leak show, sampling resident memory, live QObjects and open descriptors along the way. QObjects are counted process-wide,
+ * including those Qt creates for itself.
+ *
+ * The baseline is taken once warm-up cycles have filled caches and statistics windows: from there on, a daemon which
+ * cleans up after itself stays flat.
+ */
+class SoakBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Sample {
+        Sample() : cycle(0), elapsed(0), residentKiB(0), objects(0), descriptors(0) {}
+
+        int cycle;
+        qint64 elapsed;
+        qint64 residentKiB;
+        int objects;
+        int descriptors;
+    };
+
+    struct Limits {
+        qint64 residentKiB;
+        int objects;
+        int descriptors;
+    };
+
+    SoakBenchmark(const QString &busAddress, const QList< uint > &modes,
+                  int cycles, int warmup, int sampleEvery, const Limits &limits, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_client(QDBusConnection::connectToBus(busAddress, QStringLiteral("soak-benchmark-client")))
+        , m_modes(modes)
+        , m_cycles(cycles)
+        , m_warmup(warmup)
+        , m_sampleEvery(qMax(sampleEvery, 1))
+        , m_limits(limits)
+        , m_cycle(0)
+        , m_failures(0)
+    {
+    }
+
+    void start() {
+        m_timer.start();
+        activate();
+    }
+
+Q_SIGNALS:
+    void finished(bool passed);
+
+private:
+    static qint64 residentKiB() {
+        // statm is in pages: size, then resident.
+        QFile statm(QStringLiteral("/proc/self/statm"));
+        if (!statm.open(QIODevice::ReadOnly)) {
+            return -1;
+        }
+        QList< QByteArray > fields = statm.readAll().split(' ');
+        return fields.size() < 2 ? -1 : fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE) / 1024;
+    }
+
+    static int openDescriptors() {
+        // Listing takes a descriptor of its own, every time: it cancels out.
+        return QDir(QStringLiteral("/proc/self/fd")).entryList(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot).size();
+    }
+
+    Sample sample() const {
+        Sample s;
+        s.cycle = m_cycle;
+        s.elapsed = m_timer.elapsed();
+        s.residentKiB = residentKiB();
+        s.objects = liveObjects.load();
+        s.descriptors = openDescriptors();
+        return s;
+    }
+
+    static void print(const char *label, const Sample &s) {
+        std::cout << label << " cycle " << s.cycle << ": " << s.elapsed << " ms, RSS " << s.residentKiB << " KiB, "
+                  << s.objects << " objects, " << s.descriptors << " fds" << std::endl;
+    }
+
+    void call(const QString &method, const QVariantList &arguments, const std::function<void()> &next) {
+        QDBusMessage message = QDBusMessage::createMethodCall(Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerService()),
+                                                              Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerPath()),
+                                                              QStringLiteral("com.ispirata.Hemera.USBGadgetManager"), method);
+        message.setArguments(arguments);
+
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_client.asyncCall(message, 60 * 1000), this);
+        connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, method, next] (QDBusPendingCallWatcher *w) {
+            if (w->isError()) {
+                std::cerr << "Cycle " << m_cycle << ": " << qPrintable(method) << " failed: " << qPrintable(w->error().message()) << std::endl;
+                ++m_failures;
+            }
+            w->deleteLater();
+            next();
+        });
+    }
+
+    void activate() {
+        call(QStringLiteral("Activate"), QVariantList() << m_modes.at(m_cycle % m_modes.size()) << QVariantMap(), [this] { deactivate(); });
+    }
+
+    void deactivate() {
+        call(QStringLiteral("Deactivate"), QVariantList(), [this] {
+            ++m_cycle;
+            // Let finished operations and watchers go first, or every sample counts the last cycle's.
+            QTimer::singleShot(0, this, [this] { nextCycle(); });
+        });
+    }
+
+    void nextCycle() {
+        if (m_cycle == m_warmup) {
+            m_baseline = sample();
+            m_peak = m_baseline;
+            print("Baseline", m_baseline);
+        } else if (m_cycle > m_warmup && (m_cycle % m_sampleEvery == 0 || m_cycle == m_cycles)) {
+            Sample s = sample();
+            m_peak.residentKiB = qMax(m_peak.residentKiB, s.residentKiB);
+            m_peak.objects = qMax(m_peak.objects, s.objects);
+            m_peak.descriptors = qMax(m_peak.descriptors, s.descriptors);
+            print("Sample", s);
+            m_last = s;
+        }
+
+        if (m_cycle < m_cycles) {
+            activate();
+            return;
+        }
+
+        Q_EMIT finished(report());
+    }
+
+    bool report() const {
+        qint64 residentGrowth = m_last.residentKiB - m_baseline.residentKiB;
+        int objectGrowth = m_last.objects - m_baseline.objects;
+        int descriptorGrowth = m_last.descriptors - m_baseline.descriptors;
+
+        std::cout << m_cycles << " cycles in " << m_last.elapsed << " ms, "
+                  << (m_cycles * 1000.0 / qMax(m_last.elapsed, qint64(1))) << " cycles/sec" << std::endl
+                  << "Growth since baseline: RSS " << residentGrowth << " KiB (peak " << m_peak.residentKiB << " KiB), "
+                  << objectGrowth << " objects (peak " << m_peak.objects << "), "
+                  << descriptorGrowth << " fds (peak " << m_peak.descriptors << ")" << std::endl
+                  << "Failures: " << m_failures << std::endl;
+
+        bool passed = m_failures == 0;
+        if (residentGrowth > m_limits.residentKiB) {
+            std::cerr << "RSS grew by " << residentGrowth << " KiB, over the " << m_limits.residentKiB << " KiB limit." << std::endl;
+            passed = false;
+        }
+        if (objectGrowth > m_limits.objects) {
+            std::cerr << "Live QObjects grew by " << objectGrowth << ", over the limit of " << m_limits.objects << "." << std::endl;
+            passed = false;
+        }
+        if (descriptorGrowth > m_limits.descriptors) {
+            std::cerr << "Open descriptors grew by " << descriptorGrowth << ", over the limit of " << m_limits.descriptors << "." << std::endl;
+            passed = false;
+        }
+        return passed;
+    }
+
+    QDBusConnection m_client;
+    QList< uint > m_modes;
+    int m_cycles;
+    int m_warmup;
+    int m_sampleEvery;
+    Limits m_limits;
+    int m_cycle;
+    int m_failures;
+    QElapsedTimer m_timer;
+    Sample m_baseline;
+    Sample m_last;
+    Sample m_peak;
+};
+
+int main(int argc, char **argv)
+{
+    installObjectCounter();
+
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Activate/Deactivate soak test against a stand-in connman on a private bus: fails if memory, "
+                                                    "QObjects or descriptors keep growing. fake-connman delay options (--power-delay, "
+                                                    "--ipv4-delay...) are forwarded."));
+    parser.addHelpOption();
+    QCommandLineOption cycles(QStringLiteral("cycles"), QStringLiteral("Activate/Deactivate cycles, alternating modes."), QStringLiteral("n"), QStringLiteral("200000"));
+    QCommandLineOption warmup(QStringLiteral("warmup"), QStringLiteral("Cycles before the baseline is taken."), QStringLiteral("n"), QStringLiteral("2000"));
+    QCommandLineOption sampleEvery(QStringLiteral("sample-every"), QStringLiteral("Cycles between samples."), QStringLiteral("n"), QStringLiteral("5000"));
+    QCommandLineOption mode(QStringLiteral("mode"), QStringLiteral("p2p, tethering or both."), QStringLiteral("mode"), QStringLiteral("both"));
+    QCommandLineOption maxResident(QStringLiteral("max-rss-growth"), QStringLiteral("Allowed resident memory growth, in KiB."), QStringLiteral("KiB"), QStringLiteral("2048"));
+    QCommandLineOption maxObjects(QStringLiteral("max-object-growth"), QStringLiteral("Allowed growth in live QObjects."), QStringLiteral("n"), QStringLiteral("0"));
+    QCommandLineOption maxDescriptors(QStringLiteral("max-fd-growth"), QStringLiteral("Allowed growth in open descriptors."), QStringLiteral("n"), QStringLiteral("0"));
+    parser.addOptions(QList< QCommandLineOption >() << cycles << warmup << sampleEvery << mode << maxResident << maxObjects << maxDescriptors);
+    for (const QString &delay : QStringList() << QStringLiteral("power-delay") << QStringLiteral("service-delay") << QStringLiteral("tethering-delay")
+                                              << QStringLiteral("ipv4-delay") << QStringLiteral("connect-delay") << QStringLiteral("job-delay")) {
+        parser.addOption(QCommandLineOption(delay, QStringLiteral("Forwarded to fake-connman."), QStringLiteral("ms")));
+    }
+    parser.process(app);
+
+    QList< uint > modes;
+    if (parser.value(mode) != QStringLiteral("tethering")) {
+        modes << static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetP2P);
+    }
+    if (parser.value(mode) != QStringLiteral("p2p")) {
+        modes << static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetTethering);
+    }
+
+    int cycleCount = parser.value(cycles).toInt();
+    int warmupCount = qBound(0, parser.value(warmup).toInt(), cycleCount - 1);
+
+    SoakBenchmark::Limits limits;
+    limits.residentKiB = parser.value(maxResident).toLongLong();
+    limits.objects = parser.value(maxObjects).toInt();
+    limits.descriptors = parser.value(maxDescriptors).toInt();
+
+    BenchmarkEnvironment environment;
+    QString errorMessage;
+    if (!environment.start(BenchmarkEnvironment::fakeConnmanArguments(app.arguments()), &errorMessage)) {
+        std::cerr << qPrintable(errorMessage) << std::endl;
+        return 1;
+    }
+
+    USBGadgetManagerService *service = new USBGadgetManagerService;
+    SoakBenchmark benchmark(environment.busAddress(), modes, cycleCount, warmupCount, parser.value(sampleEvery).toInt(), limits);
+
+    QObject::connect(&benchmark, &SoakBenchmark::finished, [] (bool passed) {
+        QCoreApplication::instance()->exit(passed ? 0 : 1);
+    });
+    QObject::connect(service->init(), &Hemera::Operation::finished, [&benchmark] (Hemera::Operation *op) {
+        if (op->isError()) {
+            std::cerr << "Could not initialize the USB Gadget Manager: " << qPrintable(op->errorMessage()) << std::endl;
+            QCoreApplication::instance()->exit(1);
+            return;
+        }
+        benchmark.start();
+    });
+
+    int ret = app.exec();
+
+    delete service;
+
+    return ret;
+}
+
+#include "soakbenchmark.moc"
@@ -0,0 +1,15 @@
+#include "gadgetcapabilities.h"
+
+// Benchmarks run against stand-ins: pretend the hardware has everything.
+GadgetCapabilities::Hardware GadgetCapabilities::probeHardware()
+{
+    Hardware hardware;
+
+    hardware.udcs << QStringLiteral("dummy_udc.0");
+    hardware.legacyModules << QStringLiteral("g_ether") << QStringLiteral("g_ncm");
+    hardware.configFS = true;
+    hardware.functions << QStringLiteral("ecm") << QStringLiteral("ncm") << QStringLiteral("rndis") << QStringLiteral("mass_storage") << QStringLiteral("ffs");
+    hardware.dnsmasq = true;
+
+    return hardware;
+}
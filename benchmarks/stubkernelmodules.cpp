@@ -0,0 +1,48 @@
+#include "kernelmodules.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+
+// Benchmarks never touch the real kernel: modules, and the parameters they were loaded with, are just tracked in memory.
+static QHash< QString, QString > s_loadedModules;
+
+bool KernelModules::isLoaded(const QString &module)
+{
+    return s_loadedModules.contains(module);
+}
+
+bool KernelModules::isAvailable(const QString &module)
+{
+    Q_UNUSED(module)
+    return true;
+}
+
+QByteArray KernelModules::parameter(const QString &module, const QString &name)
+{
+    for (const QString &parameter : s_loadedModules.value(module).split(QLatin1Char(' '), QString::SkipEmptyParts)) {
+        if (parameter.startsWith(name + QLatin1Char('='))) {
+            return parameter.mid(name.size() + 1).toLatin1();
+        }
+    }
+
+    return QByteArray();
+}
+
+bool KernelModules::load(const QString &module, QString *errorMessage)
+{
+    return load(module, QString(), errorMessage);
+}
+
+bool KernelModules::load(const QString &module, const QString &parameters, QString *errorMessage)
+{
+    Q_UNUSED(errorMessage)
+    s_loadedModules.insert(module, parameters);
+    return true;
+}
+
+bool KernelModules::unload(const QString &module, QString *errorMessage)
+{
+    Q_UNUSED(errorMessage)
+    s_loadedModules.remove(module);
+    return true;
+}
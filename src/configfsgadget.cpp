@@ -0,0 +1,304 @@
+#include "configfsgadget.h"
+
+#include "kernelmodules.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+#include <sys/mount.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define CONFIGFS_MOUNT_POINT "/sys/kernel/config"
+#define CONFIGFS_GADGET_ROOT CONFIGFS_MOUNT_POINT "/usb_gadget"
+#define UDC_CLASS_PATH "/sys/class/udc"
+
+// Linux Foundation Multifunction Composite Gadget
+#define GADGET_VENDOR_ID "0x1d6b"
+#define GADGET_PRODUCT_ID "0x0104"
+
+#define GADGET_CONFIGURATION "c.1"
+
+ConfigFSGadget::ConfigFSGadget(const QString &name)
+    : m_name(name)
+{
+}
+
+bool ConfigFSGadget::isSupported()
+{
+    return QDir(QStringLiteral(CONFIGFS_GADGET_ROOT)).exists() || KernelModules::isAvailable(QStringLiteral("libcomposite"));
+}
+
+QStringList ConfigFSGadget::availableUDCs()
+{
+    return QDir(QStringLiteral(UDC_CLASS_PATH)).entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System, QDir::Name);
+}
+
+QString ConfigFSGadget::path() const
+{
+    return QStringLiteral(CONFIGFS_GADGET_ROOT "/%1").arg(m_name);
+}
+
+bool ConfigFSGadget::writeAttribute(const QString &path, const QByteArray &value, QString *errorMessage) const
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(value) != value.size()) {
+        *errorMessage = QStringLiteral("Could not write %1: %2").arg(path, file.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+bool ConfigFSGadget::makeDirectory(const QString &path, QString *errorMessage) const
+{
+    if (!QDir().mkpath(path)) {
+        *errorMessage = QStringLiteral("Could not create %1.").arg(path);
+        return false;
+    }
+
+    return true;
+}
+
+bool ConfigFSGadget::prepare(QString *errorMessage)
+{
+    if (!QDir(QStringLiteral(CONFIGFS_GADGET_ROOT)).exists()) {
+        if (!KernelModules::isLoaded(QStringLiteral("libcomposite")) &&
+            !KernelModules::load(QStringLiteral("libcomposite"), errorMessage)) {
+            return false;
+        }
+
+        // libcomposite creates usb_gadget only once ConfigFS is there.
+        if (!QDir(QStringLiteral(CONFIGFS_GADGET_ROOT)).exists() &&
+            ::mount("none", CONFIGFS_MOUNT_POINT, "configfs", 0, nullptr) != 0 && errno != EBUSY) {
+            *errorMessage = QStringLiteral("Could not mount ConfigFS: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+
+        if (!QDir(QStringLiteral(CONFIGFS_GADGET_ROOT)).exists()) {
+            *errorMessage = QStringLiteral("USB Gadget ConfigFS is not available on this system.");
+            return false;
+        }
+    }
+
+    // Already there? Nothing to do.
+    if (QDir(path()).exists()) {
+        return true;
+    }
+
+    if (!makeDirectory(path(), errorMessage) ||
+        !writeAttribute(path() + QStringLiteral("/idVendor"), GADGET_VENDOR_ID, errorMessage) ||
+        !writeAttribute(path() + QStringLiteral("/idProduct"), GADGET_PRODUCT_ID, errorMessage)) {
+        return false;
+    }
+
+    QString strings = path() + QStringLiteral("/strings/0x409");
+    QByteArray serial;
+    {
+        QFile machineId(QStringLiteral("/etc/machine-id"));
+        if (machineId.open(QIODevice::ReadOnly)) {
+            serial = machineId.readAll().trimmed();
+        }
+    }
+
+    if (!makeDirectory(strings, errorMessage) ||
+        !writeAttribute(strings + QStringLiteral("/manufacturer"), "Ispirata", errorMessage) ||
+        !writeAttribute(strings + QStringLiteral("/product"), "Hemera USB Gadget", errorMessage) ||
+        (!serial.isEmpty() && !writeAttribute(strings + QStringLiteral("/serialnumber"), serial, errorMessage))) {
+        return false;
+    }
+
+    QString configuration = path() + QStringLiteral("/configs/" GADGET_CONFIGURATION);
+    if (!makeDirectory(configuration + QStringLiteral("/strings/0x409"), errorMessage) ||
+        !writeAttribute(configuration + QStringLiteral("/strings/0x409/configuration"), "Hemera", errorMessage)) {
+        return false;
+    }
+
+    return true;
+}
+
+QStringList ConfigFSGadget::functions() const
+{
+    // Linked functions are symlinks in the configuration.
+    QStringList linked;
+    for (const QFileInfo &entry : QDir(path() + QStringLiteral("/configs/" GADGET_CONFIGURATION)).entryInfoList(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot, QDir::Name)) {
+        if (entry.isSymLink()) {
+            linked.append(entry.fileName());
+        }
+    }
+
+    return linked;
+}
+
+QByteArray ConfigFSGadget::functionAttribute(const Function &function, const QString &attribute) const
+{
+    QFile file(path() + QStringLiteral("/functions/%1/%2").arg(function.name(), attribute));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    return file.readAll().trimmed();
+}
+
+bool ConfigFSGadget::setFunctionAttribute(const Function &function, const QString &attribute, const QByteArray &value, QString *errorMessage)
+{
+    return writeAttribute(path() + QStringLiteral("/functions/%1/%2").arg(function.name(), attribute), value, errorMessage);
+}
+
+bool ConfigFSGadget::setFunctions(const QList< Function > &functions, QString *errorMessage)
+{
+    if (!boundUDC().isEmpty()) {
+        *errorMessage = QStringLiteral("Functions can't be changed while the gadget is bound.");
+        return false;
+    }
+
+    QStringList wanted;
+    for (const Function &function : functions) {
+        wanted.append(function.name());
+    }
+
+    QString configuration = path() + QStringLiteral("/configs/" GADGET_CONFIGURATION "/");
+
+    // Drop what we don't need anymore. Functions we keep stay, together with their network interfaces.
+    for (const QString &linked : ConfigFSGadget::functions()) {
+        if (wanted.contains(linked)) {
+            continue;
+        }
+        if (!QFile::remove(configuration + linked)) {
+            *errorMessage = QStringLiteral("Could not unlink function %1.").arg(linked);
+            return false;
+        }
+        QDir().rmdir(path() + QStringLiteral("/functions/") + linked);
+    }
+
+    QStringList linked = ConfigFSGadget::functions();
+    for (const Function &function : functions) {
+        QString functionPath = path() + QStringLiteral("/functions/") + function.name();
+        if (!QDir(functionPath).exists() && !makeDirectory(functionPath, errorMessage)) {
+            return false;
+        }
+
+        QMap< QString, QByteArray > changed;
+        for (QMap< QString, QByteArray >::const_iterator i = function.attributes.constBegin(); i != function.attributes.constEnd(); ++i) {
+            if (functionAttribute(function, i.key()) != i.value()) {
+                changed.insert(i.key(), i.value());
+            }
+        }
+
+        // A linked function is in use, and most refuse attribute changes with EBUSY meanwhile: it comes out while they happen.
+        // Its directory, and with it any network interface, stays.
+        if (!changed.isEmpty() && linked.contains(function.name())) {
+            if (!QFile::remove(configuration + function.name())) {
+                *errorMessage = QStringLiteral("Could not unlink function %1.").arg(function.name());
+                return false;
+            }
+            linked.removeOne(function.name());
+        }
+
+        for (QMap< QString, QByteArray >::const_iterator i = changed.constBegin(); i != changed.constEnd(); ++i) {
+            if (!writeAttribute(functionPath + QLatin1Char('/') + i.key(), i.value(), errorMessage)) {
+                return false;
+            }
+        }
+
+        if (!linked.contains(function.name()) && !QFile::link(functionPath, configuration + function.name())) {
+            *errorMessage = QStringLiteral("Could not link function %1.").arg(function.name());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ConfigFSGadget::hasFunctions(const QList< Function > &functions) const
+{
+    QStringList wanted;
+    for (const Function &function : functions) {
+        wanted.append(function.name());
+        for (QMap< QString, QByteArray >::const_iterator i = function.attributes.constBegin(); i != function.attributes.constEnd(); ++i) {
+            if (functionAttribute(function, i.key()) != i.value()) {
+                return false;
+            }
+        }
+    }
+    wanted.sort();
+
+    return wanted == ConfigFSGadget::functions();
+}
+
+bool ConfigFSGadget::configure(const QList< Function > &functions, const QString &udc, QString *errorMessage)
+{
+    if (!hasFunctions(functions)) {
+        if (!unbind(errorMessage) || !setFunctions(functions, errorMessage)) {
+            return false;
+        }
+    }
+
+    return bind(udc, errorMessage);
+}
+
+QString ConfigFSGadget::boundUDC() const
+{
+    QFile file(path() + QStringLiteral("/UDC"));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString();
+    }
+
+    return QString::fromLatin1(file.readAll().trimmed());
+}
+
+bool ConfigFSGadget::bind(const QString &udc, QString *errorMessage)
+{
+    QString target = udc;
+    if (target.isEmpty()) {
+        QStringList udcs = availableUDCs();
+        if (udcs.isEmpty()) {
+            *errorMessage = QStringLiteral("No USB Device Controller is available on this system.");
+            return false;
+        }
+        target = udcs.first();
+    }
+
+    QString bound = boundUDC();
+    if (bound == target) {
+        return true;
+    } else if (!bound.isEmpty() && !unbind(errorMessage)) {
+        return false;
+    }
+
+    return writeAttribute(path() + QStringLiteral("/UDC"), target.toLatin1(), errorMessage);
+}
+
+bool ConfigFSGadget::unbind(QString *errorMessage)
+{
+    if (boundUDC().isEmpty()) {
+        return true;
+    }
+
+    return writeAttribute(path() + QStringLiteral("/UDC"), "\n", errorMessage);
+}
+
+bool ConfigFSGadget::teardown(QString *errorMessage)
+{
+    if (!QDir(path()).exists()) {
+        return true;
+    }
+
+    if (!unbind(errorMessage) || !setFunctions(QList< Function >(), errorMessage)) {
+        return false;
+    }
+
+    // ConfigFS wants its directories removed bottom-up.
+    QDir().rmdir(path() + QStringLiteral("/configs/" GADGET_CONFIGURATION "/strings/0x409"));
+    QDir().rmdir(path() + QStringLiteral("/configs/" GADGET_CONFIGURATION));
+    QDir().rmdir(path() + QStringLiteral("/strings/0x409"));
+
+    if (!QDir().rmdir(path())) {
+        *errorMessage = QStringLiteral("Could not remove gadget %1.").arg(m_name);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef CONFIGFSGADGET_H
+#define CONFIGFSGADGET_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+/**
+ * A composite gadget built through ConfigFS and libcomposite.
+ *
+ * The gadget lives under /sys/kernel/config/usb_gadget and is composed of functions (ecm, ncm, rndis, acm, mass_storage...).
+ * Switching the function set only requires unbinding and rebinding the UDC: no kernel module is ever reloaded.
+ * The object itself is stateless, everything is read back from ConfigFS.
+ */
+class ConfigFSGadget
+{
+public:
+    struct Function {
+        Function() {}
+        Function(const QString &type, const QString &instance) : type(type), instance(instance) {}
+
+        inline QString name() const { return type + QLatin1Char('.') + instance; }
+        inline bool operator==(const Function &other) const { return name() == other.name() && attributes == other.attributes; }
+
+        QString type;
+        QString instance;
+        // Written before the function gets linked, in key order.
+        QMap< QString, QByteArray > attributes;
+    };
+
+    explicit ConfigFSGadget(const QString &name = QStringLiteral("hemera"));
+
+    static bool isSupported();
+    static QStringList availableUDCs();
+
+    QString path() const;
+
+    /// Loads libcomposite, mounts ConfigFS if needed and creates the gadget skeleton.
+    bool prepare(QString *errorMessage);
+
+    /// Replaces the linked functions. The gadget must be unbound.
+    bool setFunctions(const QList< Function > &functions, QString *errorMessage);
+    QStringList functions() const;
+
+    QByteArray functionAttribute(const Function &function, const QString &attribute) const;
+    /// For attributes which have to be written after the others, or while the gadget is bound.
+    bool setFunctionAttribute(const Function &function, const QString &attribute, const QByteArray &value, QString *errorMessage);
+
+    /// Whether exactly @p functions, with their attributes, are linked right now.
+    bool hasFunctions(const QList< Function > &functions) const;
+    /// Sets up @p functions and binds to @p udc. The UDC is unbound only if the function set actually changes.
+    bool configure(const QList< Function > &functions, const QString &udc, QString *errorMessage);
+
+    /// Binds to @p udc, or to the first available UDC if empty.
+    bool bind(const QString &udc, QString *errorMessage);
+    bool unbind(QString *errorMessage);
+    QString boundUDC() const;
+
+    /// Removes the gadget altogether.
+    bool teardown(QString *errorMessage);
+
+private:
+    bool writeAttribute(const QString &path, const QByteArray &value, QString *errorMessage) const;
+    bool makeDirectory(const QString &path, QString *errorMessage) const;
+
+    QString m_name;
+};
+
+#endif // CONFIGFSGADGET_H
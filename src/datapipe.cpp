@@ -0,0 +1,471 @@
+#include "datapipe.h"
+
+#include <HemeraCore/Literals>
+
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QSocketNotifier>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include <sys/eventfd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DATA_PIPE_MOUNT_ROOT "/run/gravity-usb-gadget-manager/functionfs"
+#define DATA_PIPE_INTERFACE_NAME "Hemera Data Pipe"
+
+/* Writes in flight on the IN endpoint */
+constexpr int sendQueueDepth() { return 4; }
+/* 64 KiB, a whole number of packets at any speed */
+constexpr int sendChunk() { return 64 * 1024; }
+
+// glibc has no wrappers for the kernel AIO interface, and libaio would be a dependency for five syscalls.
+static inline int io_setup(unsigned int events, aio_context_t *context)
+{
+    return syscall(__NR_io_setup, events, context);
+}
+
+static inline int io_destroy(aio_context_t context)
+{
+    return syscall(__NR_io_destroy, context);
+}
+
+static inline int io_submit(aio_context_t context, long count, struct iocb **controls)
+{
+    return syscall(__NR_io_submit, context, count, controls);
+}
+
+static inline int io_getevents(aio_context_t context, long minimum, long maximum, struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, context, minimum, maximum, events, timeout);
+}
+
+// One vendor specific interface with a bulk IN and a bulk OUT endpoint, at full, high and super speed.
+struct EndpointPair {
+    struct usb_interface_descriptor interface;
+    struct usb_endpoint_descriptor_no_audio in;
+    struct usb_endpoint_descriptor_no_audio out;
+} __attribute__((packed));
+
+struct SuperSpeedEndpointPair {
+    struct usb_interface_descriptor interface;
+    struct usb_endpoint_descriptor_no_audio in;
+    struct usb_ss_ep_comp_descriptor inCompanion;
+    struct usb_endpoint_descriptor_no_audio out;
+    struct usb_ss_ep_comp_descriptor outCompanion;
+} __attribute__((packed));
+
+struct Descriptors {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fsCount;
+    __le32 hsCount;
+    __le32 ssCount;
+    EndpointPair fs;
+    EndpointPair hs;
+    SuperSpeedEndpointPair ss;
+} __attribute__((packed));
+
+struct Strings {
+    struct usb_functionfs_strings_head header;
+    __le16 language;
+    char interfaceName[sizeof(DATA_PIPE_INTERFACE_NAME)];
+} __attribute__((packed));
+
+static void fillInterface(struct usb_interface_descriptor *interface)
+{
+    interface->bLength = sizeof(*interface);
+    interface->bDescriptorType = USB_DT_INTERFACE;
+    interface->bNumEndpoints = 2;
+    interface->bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+    interface->iInterface = 1;
+}
+
+static void fillEndpoint(struct usb_endpoint_descriptor_no_audio *endpoint, quint8 address, quint16 maxPacketSize)
+{
+    endpoint->bLength = sizeof(*endpoint);
+    endpoint->bDescriptorType = USB_DT_ENDPOINT;
+    endpoint->bEndpointAddress = address;
+    endpoint->bmAttributes = USB_ENDPOINT_XFER_BULK;
+    endpoint->wMaxPacketSize = htole16(maxPacketSize);
+}
+
+static void fillPair(EndpointPair *pair, quint16 maxPacketSize)
+{
+    fillInterface(&pair->interface);
+    fillEndpoint(&pair->in, 1 | USB_DIR_IN, maxPacketSize);
+    fillEndpoint(&pair->out, 2 | USB_DIR_OUT, maxPacketSize);
+}
+
+DataPipe::DataPipe(QObject *parent)
+    : QObject(parent)
+    , m_ep0(-1)
+    , m_in(-1)
+    , m_out(-1)
+    , m_ep0Notifier(nullptr)
+    , m_enabled(false)
+    , m_aio(0)
+    , m_eventFd(-1)
+    , m_aioNotifier(nullptr)
+    , m_source(-1)
+    , m_sourceOffset(0)
+    , m_sourceSize(0)
+{
+}
+
+DataPipe::~DataPipe()
+{
+    stop();
+}
+
+QString DataPipe::instanceName(const QString &gadget)
+{
+    return gadget.isEmpty() ? QStringLiteral("hemera") : gadget;
+}
+
+QString DataPipe::mountPoint(const QString &instance)
+{
+    return QStringLiteral(DATA_PIPE_MOUNT_ROOT "/%1").arg(instance);
+}
+
+void DataPipe::unmount(const QString &instance)
+{
+    // Either may well fail, when there's nothing to clean up.
+    QByteArray path = QFile::encodeName(mountPoint(instance));
+    ::umount2(path.constData(), MNT_DETACH);
+    ::rmdir(path.constData());
+}
+
+bool DataPipe::start(const QString &instance, QString *errorMessage)
+{
+    if (isRunning()) {
+        return true;
+    }
+
+    // Whatever is there was left by somebody who's gone.
+    unmount(instance);
+
+    QString path = mountPoint(instance);
+    if (!QDir().mkpath(path)) {
+        *errorMessage = QStringLiteral("Could not create %1.").arg(path);
+        return false;
+    }
+    if (::mount(instance.toLatin1().constData(), QFile::encodeName(path).constData(), "functionfs", 0, nullptr) != 0) {
+        *errorMessage = QStringLiteral("Could not mount FunctionFS on %1: %2").arg(path, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    m_instance = instance;
+
+    m_ep0 = ::open(QFile::encodeName(path + QStringLiteral("/ep0")).constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_ep0 < 0) {
+        *errorMessage = QStringLiteral("Could not open the FunctionFS control endpoint: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        stop();
+        return false;
+    }
+
+    Descriptors descriptors;
+    memset(&descriptors, 0, sizeof(descriptors));
+    descriptors.header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    descriptors.header.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC);
+    descriptors.header.length = htole32(sizeof(descriptors));
+    descriptors.fsCount = htole32(3);
+    descriptors.hsCount = htole32(3);
+    descriptors.ssCount = htole32(5);
+    fillPair(&descriptors.fs, 64);
+    fillPair(&descriptors.hs, 512);
+    fillInterface(&descriptors.ss.interface);
+    fillEndpoint(&descriptors.ss.in, 1 | USB_DIR_IN, 1024);
+    fillEndpoint(&descriptors.ss.out, 2 | USB_DIR_OUT, 1024);
+    for (struct usb_ss_ep_comp_descriptor *companion : { &descriptors.ss.inCompanion, &descriptors.ss.outCompanion }) {
+        companion->bLength = sizeof(*companion);
+        companion->bDescriptorType = USB_DT_SS_ENDPOINT_COMP;
+    }
+
+    Strings strings;
+    memset(&strings, 0, sizeof(strings));
+    strings.header.magic = htole32(FUNCTIONFS_STRINGS_MAGIC);
+    strings.header.length = htole32(sizeof(strings));
+    strings.header.str_count = htole32(1);
+    strings.header.lang_count = htole32(1);
+    strings.language = htole16(0x0409);
+    memcpy(strings.interfaceName, DATA_PIPE_INTERFACE_NAME, sizeof(strings.interfaceName));
+
+    if (::write(m_ep0, &descriptors, sizeof(descriptors)) != static_cast<ssize_t>(sizeof(descriptors)) ||
+        ::write(m_ep0, &strings, sizeof(strings)) != static_cast<ssize_t>(sizeof(strings))) {
+        *errorMessage = QStringLiteral("Could not write the FunctionFS descriptors: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        stop();
+        return false;
+    }
+
+    // Endpoint files show up once the descriptors are in, in their order. Ours never block: until the host enables the
+    // function, FunctionFS would put our whole event loop to sleep.
+    m_in = ::open(QFile::encodeName(path + QStringLiteral("/ep1")).constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    m_out = ::open(QFile::encodeName(path + QStringLiteral("/ep2")).constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_in < 0 || m_out < 0) {
+        *errorMessage = QStringLiteral("Could not open the FunctionFS bulk endpoints: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        stop();
+        return false;
+    }
+
+    m_eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventFd < 0 || io_setup(sendQueueDepth(), &m_aio) < 0) {
+        *errorMessage = QStringLiteral("Could not set up asynchronous I/O: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        stop();
+        return false;
+    }
+
+    m_ep0Notifier = new QSocketNotifier(m_ep0, QSocketNotifier::Read);
+    connect(m_ep0Notifier, &QSocketNotifier::activated, this, &DataPipe::readEvents);
+    m_aioNotifier = new QSocketNotifier(m_eventFd, QSocketNotifier::Read);
+    connect(m_aioNotifier, &QSocketNotifier::activated, this, &DataPipe::reapCompletions);
+
+    m_slots.resize(sendQueueDepth());
+    return true;
+}
+
+void DataPipe::stop()
+{
+    // Tearing the context down waits for whatever is in flight.
+    if (m_aio) {
+        io_destroy(m_aio);
+        m_aio = 0;
+    }
+    finishSend(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), QStringLiteral("The data pipe was closed."));
+
+    delete m_aioNotifier;
+    m_aioNotifier = nullptr;
+    delete m_ep0Notifier;
+    m_ep0Notifier = nullptr;
+
+    for (int *fd : { &m_eventFd, &m_in, &m_out, &m_ep0 }) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    m_slots.clear();
+
+    if (!m_instance.isEmpty()) {
+        unmount(m_instance);
+        m_instance.clear();
+    }
+
+    if (m_enabled) {
+        m_enabled = false;
+        Q_EMIT enabledChanged();
+    }
+}
+
+void DataPipe::readEvents()
+{
+    struct usb_functionfs_event events[4];
+    ssize_t size = ::read(m_ep0, events, sizeof(events));
+    if (size < 0) {
+        return;
+    }
+
+    bool enabled = m_enabled;
+    for (int i = 0; i < static_cast<int>(size / sizeof(events[0])); ++i) {
+        switch (events[i].type) {
+            case FUNCTIONFS_ENABLE:
+                enabled = true;
+                break;
+            case FUNCTIONFS_DISABLE:
+            case FUNCTIONFS_UNBIND:
+                enabled = false;
+                break;
+            case FUNCTIONFS_SETUP:
+                // We have no control requests: stall. Reading stalls requests towards the host, writing the others.
+                if (events[i].u.setup.bRequestType & USB_DIR_IN) {
+                    ssize_t ignored = ::read(m_ep0, nullptr, 0);
+                    Q_UNUSED(ignored);
+                } else {
+                    ssize_t ignored = ::write(m_ep0, nullptr, 0);
+                    Q_UNUSED(ignored);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (enabled != m_enabled) {
+        qDebug() << "The host" << (enabled ? "enabled" : "disabled") << "the data pipe.";
+        m_enabled = enabled;
+        Q_EMIT enabledChanged();
+
+        // Whatever is in flight fails on its own, nothing more gets queued.
+        if (!m_enabled && m_source >= 0) {
+            submitWrites();
+        }
+    }
+}
+
+bool DataPipe::openEndpoints(int *in, int *out, QString *errorMessage)
+{
+    if (!isRunning()) {
+        *errorMessage = QStringLiteral("The data pipe is not active.");
+        return false;
+    }
+
+    // Files of their own rather than duplicates: clients may block on theirs as they please, ours stay non-blocking.
+    QString path = mountPoint(m_instance);
+    *in = ::open(QFile::encodeName(path + QStringLiteral("/ep1")).constData(), O_RDWR | O_CLOEXEC);
+    *out = ::open(QFile::encodeName(path + QStringLiteral("/ep2")).constData(), O_RDWR | O_CLOEXEC);
+    if (*in < 0 || *out < 0) {
+        *errorMessage = QStringLiteral("Could not hand out the data pipe endpoints: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        for (int fd : { *in, *out }) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool DataPipe::send(int fd, const Completion &completion, QString *errorMessage)
+{
+    struct stat status;
+    if (!isRunning()) {
+        *errorMessage = QStringLiteral("The data pipe is not active.");
+        return false;
+    } else if (!m_enabled) {
+        *errorMessage = QStringLiteral("The host has not enabled the data pipe yet.");
+        return false;
+    } else if (m_source >= 0) {
+        *errorMessage = QStringLiteral("The data pipe is already sending a file.");
+        return false;
+    } else if (::fstat(fd, &status) < 0 || !S_ISREG(status.st_mode)) {
+        *errorMessage = QStringLiteral("Only regular files can be sent through the data pipe.");
+        return false;
+    }
+
+    m_source = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (m_source < 0) {
+        *errorMessage = QStringLiteral("Could not take the file over: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    ::posix_fadvise(m_source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    m_sourceOffset = 0;
+    m_sourceSize = status.st_size;
+    m_sendError.clear();
+    m_sendCompletion = completion;
+
+    submitWrites();
+    return true;
+}
+
+void DataPipe::submitWrites()
+{
+    if (!m_enabled && m_sendError.isEmpty()) {
+        m_sendError = QStringLiteral("The host disabled the data pipe.");
+    }
+
+    for (int i = 0; i < m_slots.size() && m_sendError.isEmpty() && m_sourceOffset < m_sourceSize; ++i) {
+        Slot &slot = m_slots[i];
+        if (slot.busy) {
+            continue;
+        }
+
+        if (slot.buffer.isEmpty()) {
+            slot.buffer.resize(sendChunk());
+        }
+        ssize_t size = ::pread(m_source, slot.buffer.data(), qMin< quint64 >(slot.buffer.size(), m_sourceSize - m_sourceOffset), m_sourceOffset);
+        if (size < 0 && errno == EINTR) {
+            --i;
+            continue;
+        } else if (size <= 0) {
+            // Shrunk under us: what's there is all there is.
+            if (size < 0) {
+                m_sendError = QStringLiteral("Could not read the file: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+            }
+            m_sourceSize = m_sourceOffset;
+            break;
+        }
+
+        memset(&slot.control, 0, sizeof(slot.control));
+        slot.control.aio_data = i;
+        slot.control.aio_lio_opcode = IOCB_CMD_PWRITE;
+        slot.control.aio_fildes = m_in;
+        slot.control.aio_buf = reinterpret_cast<quintptr>(slot.buffer.constData());
+        slot.control.aio_nbytes = size;
+        slot.control.aio_flags = IOCB_FLAG_RESFD;
+        slot.control.aio_resfd = m_eventFd;
+
+        struct iocb *control = &slot.control;
+        if (io_submit(m_aio, 1, &control) != 1) {
+            m_sendError = QStringLiteral("Could not queue a write on the data pipe: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+            break;
+        }
+        slot.busy = true;
+        m_sourceOffset += size;
+    }
+
+    // Done once nothing is in flight anymore.
+    for (const Slot &slot : m_slots) {
+        if (slot.busy) {
+            return;
+        }
+    }
+    if (!m_sendError.isEmpty()) {
+        finishSend(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), m_sendError);
+    } else if (m_sourceOffset >= m_sourceSize) {
+        finishSend(QString(), QString());
+    }
+}
+
+void DataPipe::reapCompletions()
+{
+    quint64 count;
+    ssize_t ignored = ::read(m_eventFd, &count, sizeof(count));
+    Q_UNUSED(ignored);
+
+    struct io_event events[sendQueueDepth()];
+    struct timespec now = { 0, 0 };
+    int reaped = io_getevents(m_aio, 0, sendQueueDepth(), events, &now);
+    for (int i = 0; i < reaped; ++i) {
+        Slot &slot = m_slots[static_cast<int>(events[i].data)];
+        slot.busy = false;
+
+        // A short write is the host going away halfway, just like an error.
+        if (events[i].res < 0 || static_cast<quint64>(events[i].res) != slot.control.aio_nbytes) {
+            if (m_sendError.isEmpty()) {
+                m_sendError = events[i].res < 0 ? QStringLiteral("Could not write to the host: %1").arg(QString::fromLocal8Bit(strerror(static_cast<int>(-events[i].res))))
+                                                : QStringLiteral("The host stopped reading.");
+            }
+        }
+    }
+
+    if (m_source >= 0) {
+        submitWrites();
+    }
+}
+
+void DataPipe::finishSend(const QString &errorName, const QString &errorMessage)
+{
+    if (m_source < 0) {
+        return;
+    }
+
+    ::close(m_source);
+    m_source = -1;
+    for (Slot &slot : m_slots) {
+        slot.busy = false;
+    }
+
+    Completion completion = m_sendCompletion;
+    m_sendCompletion = nullptr;
+    completion(errorName, errorMessage);
+}
@@ -0,0 +1,91 @@
+#ifndef DATAPIPE_H
+#define DATAPIPE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QObject>
+#include <QtCore/QVector>
+
+#include <linux/aio_abi.h>
+
+#include <functional>
+
+class QSocketNotifier;
+
+/**
+ * A raw bulk channel to the host, through a FunctionFS function: one IN and one OUT bulk endpoint.
+ *
+ * The pipe serves ep0 and owns the endpoints. Local clients get the endpoints themselves and do their own I/O, so that
+ * data never goes through us. For clients which would rather hand over a file, sending it to the host is done here, with
+ * Linux AIO: writes are queued on the IN endpoint a few at a time, and their completions come in through an eventfd
+ * watched by the event loop.
+ */
+class DataPipe : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(DataPipe)
+
+public:
+    /// Called once, with an empty error name on success.
+    typedef std::function<void(const QString &errorName, const QString &errorMessage)> Completion;
+
+    explicit DataPipe(QObject *parent = nullptr);
+    virtual ~DataPipe();
+
+    /// The FunctionFS instance for the ConfigFS gadget @p gadget, as in ffs.<instance>. Empty is the main gadget.
+    static QString instanceName(const QString &gadget);
+    static QString mountPoint(const QString &instance);
+    /// Unmounts whatever a previous process left behind for @p instance.
+    static void unmount(const QString &instance);
+
+    /// Mounts the FunctionFS @p instance and writes the descriptors. The function must exist, the gadget can be bound afterwards.
+    bool start(const QString &instance, QString *errorMessage);
+    void stop();
+
+    inline bool isRunning() const { return m_ep0 >= 0; }
+    /// Whether the host has configured the function: endpoints move data only then.
+    inline bool isEnabled() const { return m_enabled; }
+
+    /// New descriptors for the IN and OUT endpoints, owned by the caller.
+    bool openEndpoints(int *in, int *out, QString *errorMessage);
+    /// Streams the regular file @p fd to the host. One at a time.
+    bool send(int fd, const Completion &completion, QString *errorMessage);
+    inline bool isSending() const { return m_source >= 0; }
+
+Q_SIGNALS:
+    void enabledChanged();
+
+private Q_SLOTS:
+    void readEvents();
+    void reapCompletions();
+
+private:
+    void submitWrites();
+    void finishSend(const QString &errorName, const QString &errorMessage);
+
+    QString m_instance;
+    int m_ep0;
+    int m_in;
+    int m_out;
+    QSocketNotifier *m_ep0Notifier;
+    bool m_enabled;
+
+    aio_context_t m_aio;
+    int m_eventFd;
+    QSocketNotifier *m_aioNotifier;
+
+    struct Slot {
+        Slot() : busy(false) {}
+
+        QByteArray buffer;
+        struct iocb control;
+        bool busy;
+    };
+    QVector< Slot > m_slots;
+    int m_source;
+    quint64 m_sourceOffset;
+    quint64 m_sourceSize;
+    QString m_sendError;
+    Completion m_sendCompletion;
+};
+
+#endif // DATAPIPE_H
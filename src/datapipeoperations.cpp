@@ -0,0 +1,84 @@
+#include "datapipeoperations.h"
+
+#include "datapipe.h"
+#include "gadgetmodes.h"
+
+#include <HemeraCore/Literals>
+
+ActivateDataPipeGadget::ActivateDataPipeGadget(const Options &options, QObject *parent)
+    : EthernetGadgetOperation(GadgetModes::DataPipe, options, parent)
+{
+    m_plan << Stage::ConfiguringGadget;
+}
+
+ActivateDataPipeGadget::~ActivateDataPipeGadget()
+{
+}
+
+void ActivateDataPipeGadget::startImpl()
+{
+    setStage(Stage::ConfiguringGadget);
+
+    if (!m_options.dataPipe) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                             QStringLiteral("DataPipe needs a pipe to serve the function."));
+        return;
+    }
+
+    // The instance name ties the function to its mount.
+    ConfigFSGadget::Function function(QStringLiteral("ffs"), DataPipe::instanceName(m_options.gadget));
+
+    QString errorMessage;
+    ConfigFSGadget gadget = configFSGadget(m_options);
+    if (!gadget.prepare(&errorMessage) || !gadget.unbind(&errorMessage) ||
+        !gadget.setFunctions(QList< ConfigFSGadget::Function >(), &errorMessage) ||
+        !gadget.setFunctions(QList< ConfigFSGadget::Function >() << function, &errorMessage) ||
+        !m_options.dataPipe->start(function.instance, &errorMessage) ||
+        !gadget.bind(m_options.udc, &errorMessage)) {
+        m_options.dataPipe->stop();
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+        return;
+    }
+
+    setStage(Stage::Completed);
+    setFinished();
+}
+
+///////////////////
+
+DeactivateDataPipeGadget::DeactivateDataPipeGadget(const Options &options, QObject *parent)
+    : EthernetGadgetOperation(GadgetModes::DataPipe, options, parent)
+{
+    m_plan << Stage::UnbindingGadget;
+}
+
+DeactivateDataPipeGadget::~DeactivateDataPipeGadget()
+{
+}
+
+void DeactivateDataPipeGadget::startImpl()
+{
+    setStage(Stage::UnbindingGadget);
+
+    // The function can't go while FunctionFS is mounted for it, and clients' endpoints die with the mount.
+    QString errorMessage;
+    ConfigFSGadget gadget = configFSGadget(m_options);
+    if (!gadget.unbind(&errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+        return;
+    }
+
+    if (m_options.dataPipe) {
+        m_options.dataPipe->stop();
+    } else {
+        DataPipe::unmount(DataPipe::instanceName(m_options.gadget));
+    }
+
+    if (!gadget.setFunctions(QList< ConfigFSGadget::Function >(), &errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+        return;
+    }
+
+    setStage(Stage::Completed);
+    setFinished();
+}
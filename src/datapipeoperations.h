@@ -0,0 +1,35 @@
+#ifndef DATAPIPEOPERATIONS_H
+#define DATAPIPEOPERATIONS_H
+
+#include "ethernetgadgetoperations.h"
+
+/**
+ * Puts a FunctionFS function on the ConfigFS gadget, and has the service's DataPipe serve it.
+ *
+ * The function needs its descriptors before the gadget can bind, so the pipe starts in between.
+ */
+class ActivateDataPipeGadget : public EthernetGadgetOperation
+{
+    Q_OBJECT
+
+public:
+    explicit ActivateDataPipeGadget(const Options &options = Options(), QObject *parent = nullptr);
+    virtual ~ActivateDataPipeGadget();
+
+protected:
+    virtual void startImpl();
+};
+
+class DeactivateDataPipeGadget : public EthernetGadgetOperation
+{
+    Q_OBJECT
+
+public:
+    explicit DeactivateDataPipeGadget(const Options &options = Options(), QObject *parent = nullptr);
+    virtual ~DeactivateDataPipeGadget();
+
+protected:
+    virtual void startImpl();
+};
+
+#endif // DATAPIPEOPERATIONS_H
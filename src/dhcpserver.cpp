@@ -0,0 +1,359 @@
+#include "dhcpserver.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QtEndian>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+
+// BOOTP fixed header, followed by the magic cookie and the options.
+#define DHCP_HEADER_SIZE 236
+#define DHCP_OPTIONS_OFFSET (DHCP_HEADER_SIZE + 4)
+#define DHCP_MAGIC_COOKIE 0x63825363
+
+#define BOOTP_REQUEST 1
+#define BOOTP_REPLY 2
+
+enum MessageType : quint8 {
+    Discover = 1,
+    Offer = 2,
+    Request = 3,
+    Decline = 4,
+    Ack = 5,
+    Nak = 6,
+    Release = 7,
+    Inform = 8
+};
+
+enum Option : quint8 {
+    Pad = 0,
+    SubnetMask = 1,
+    RequestedAddress = 50,
+    LeaseTime = 51,
+    MessageTypeOption = 53,
+    ServerIdentifier = 54,
+    RenewalTime = 58,
+    RebindingTime = 59,
+    End = 255
+};
+
+/* 12 hours, as we used to configure dnsmasq */
+constexpr quint32 leaseTime() { return 12 * 60 * 60; }
+/* How long an offered address stays set aside, waiting for the client to request it */
+constexpr qint64 offerTime() { return 60; }
+
+static inline quint32 readAddress(const QByteArray &packet, int offset)
+{
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(packet.constData() + offset));
+}
+
+static inline void appendAddress(QByteArray &packet, quint32 address)
+{
+    uchar buffer[4];
+    qToBigEndian<quint32>(address, buffer);
+    packet.append(reinterpret_cast<const char*>(buffer), 4);
+}
+
+static inline void appendOption(QByteArray &packet, quint8 option, quint32 value)
+{
+    packet.append(static_cast<char>(option));
+    packet.append(static_cast<char>(4));
+    appendAddress(packet, value);
+}
+
+static QHash< quint8, QByteArray > parseOptions(const QByteArray &packet)
+{
+    QHash< quint8, QByteArray > options;
+
+    int i = DHCP_OPTIONS_OFFSET;
+    while (i < packet.size()) {
+        quint8 option = static_cast<quint8>(packet.at(i));
+        if (option == Pad) {
+            ++i;
+            continue;
+        } else if (option == End || i + 1 >= packet.size()) {
+            break;
+        }
+
+        int length = static_cast<quint8>(packet.at(i + 1));
+        if (i + 2 + length > packet.size()) {
+            break;
+        }
+        options.insert(option, packet.mid(i + 2, length));
+        i += 2 + length;
+    }
+
+    return options;
+}
+
+DHCPServer::DHCPServer(QObject *parent)
+    : QObject(parent)
+    , m_socket(-1)
+    , m_notifier(nullptr)
+    , m_serverAddress(0)
+    , m_netmask(0)
+    , m_rangeStart(0)
+    , m_rangeEnd(0)
+{
+}
+
+DHCPServer::~DHCPServer()
+{
+    stop();
+}
+
+bool DHCPServer::start(const QString &interface, const QHostAddress &serverAddress, const QHostAddress &netmask,
+                       const QHostAddress &rangeStart, const QHostAddress &rangeEnd, QString *errorMessage)
+{
+    stop();
+
+    m_socket = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_socket < 0) {
+        *errorMessage = QStringLiteral("Could not create the DHCP socket: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    int on = 1;
+    QByteArray device = interface.toLatin1();
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(DHCP_SERVER_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // Clients have no address yet: we listen and broadcast on the gadget interface only.
+    if (::setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        ::setsockopt(m_socket, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0 ||
+        ::setsockopt(m_socket, SOL_SOCKET, SO_BINDTODEVICE, device.constData(), device.size() + 1) < 0 ||
+        ::bind(m_socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        *errorMessage = QStringLiteral("Could not bind the DHCP socket on %1: %2").arg(interface, QString::fromLocal8Bit(strerror(errno)));
+        ::close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    m_interface = interface;
+    m_serverAddress = serverAddress.toIPv4Address();
+    m_netmask = netmask.toIPv4Address();
+    m_rangeStart = rangeStart.toIPv4Address();
+    m_rangeEnd = rangeEnd.toIPv4Address();
+    m_leases.clear();
+    m_declined.clear();
+
+    m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &DHCPServer::readPendingDatagrams);
+
+    return true;
+}
+
+void DHCPServer::stop()
+{
+    if (m_socket < 0) {
+        return;
+    }
+
+    delete m_notifier;
+    m_notifier = nullptr;
+    ::close(m_socket);
+    m_socket = -1;
+    m_leases.clear();
+    m_declined.clear();
+}
+
+quint32 DHCPServer::allocate(const QByteArray &hardwareAddress, quint32 requested)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+
+    // Whatever expired is gone, but the client's own lease: it might get that address back.
+    for (QHash< QByteArray, Lease >::iterator i = m_leases.begin(); i != m_leases.end();) {
+        if (i.value().expiry <= now && i.key() != hardwareAddress) {
+            i = m_leases.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    for (QHash< quint32, qint64 >::iterator i = m_declined.begin(); i != m_declined.end();) {
+        if (i.value() <= now) {
+            i = m_declined.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    auto isFree = [this, &hardwareAddress, now] (quint32 address) -> bool {
+        if (address < m_rangeStart || address > m_rangeEnd || m_declined.contains(address)) {
+            return false;
+        }
+        for (QHash< QByteArray, Lease >::const_iterator i = m_leases.constBegin(); i != m_leases.constEnd(); ++i) {
+            if (i.key() != hardwareAddress && i.value().address == address && i.value().expiry > now) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Clients get their address back, unless somebody else got it once it expired.
+    QHash< QByteArray, Lease >::const_iterator existing = m_leases.constFind(hardwareAddress);
+    if (existing != m_leases.constEnd() && (existing.value().expiry > now || isFree(existing.value().address))) {
+        return existing.value().address;
+    }
+
+    if (isFree(requested)) {
+        return requested;
+    }
+    for (quint32 address = m_rangeStart; address <= m_rangeEnd; ++address) {
+        if (isFree(address)) {
+            return address;
+        }
+    }
+
+    return 0;
+}
+
+void DHCPServer::readPendingDatagrams()
+{
+    QByteArray packet(1500, 0);
+
+    for (;;) {
+        ssize_t size = ::recv(m_socket, packet.data(), packet.size(), 0);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                qWarning() << "DHCP server could not read from" << m_interface << strerror(errno);
+            }
+            return;
+        }
+
+        QByteArray request = packet.left(size);
+        if (request.size() < DHCP_OPTIONS_OFFSET || static_cast<quint8>(request.at(0)) != BOOTP_REQUEST ||
+            readAddress(request, DHCP_HEADER_SIZE) != DHCP_MAGIC_COOKIE || readAddress(request, 24) != 0) {
+            // Not a DHCP request, or relayed: we only serve the point-to-point link.
+            continue;
+        }
+
+        QHash< quint8, QByteArray > options = parseOptions(request);
+        QByteArray messageType = options.value(MessageTypeOption);
+        if (messageType.size() != 1) {
+            continue;
+        }
+
+        int hardwareAddressLength = qMin(static_cast<int>(static_cast<quint8>(request.at(2))), 16);
+        QByteArray hardwareAddress = request.mid(28, hardwareAddressLength);
+        quint32 clientAddress = readAddress(request, 12);
+        QByteArray serverIdentifier = options.value(ServerIdentifier);
+        QByteArray requestedOption = options.value(RequestedAddress);
+        quint32 requested = requestedOption.size() == 4 ? readAddress(requestedOption, 0) : clientAddress;
+        qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+
+        switch (static_cast<quint8>(messageType.at(0))) {
+            case Discover: {
+                quint32 address = allocate(hardwareAddress, requested);
+                if (address == 0) {
+                    break;
+                }
+                // Set the address aside until the client requests it, or another client could be offered it meanwhile.
+                QHash< QByteArray, Lease >::const_iterator existing = m_leases.constFind(hardwareAddress);
+                if (existing == m_leases.constEnd() || existing.value().address != address || existing.value().expiry <= now) {
+                    Lease reservation;
+                    reservation.address = address;
+                    reservation.expiry = now + offerTime();
+                    m_leases.insert(hardwareAddress, reservation);
+                }
+                reply(request, Offer, 0, address);
+                break;
+            }
+            case Request: {
+                // Meant for another server?
+                if (serverIdentifier.size() == 4 && readAddress(serverIdentifier, 0) != m_serverAddress) {
+                    break;
+                }
+                quint32 address = allocate(hardwareAddress, requested);
+                if (address == 0 || address != requested) {
+                    reply(request, Nak, 0, 0);
+                    break;
+                }
+                Lease lease;
+                lease.address = address;
+                lease.expiry = now + leaseTime();
+                m_leases.insert(hardwareAddress, lease);
+                reply(request, Ack, clientAddress, address);
+                break;
+            }
+            case Decline:
+                // Somebody else on the link has the address: offering it again would only have it declined again.
+                if (serverIdentifier.size() != 4 || readAddress(serverIdentifier, 0) != m_serverAddress) {
+                    break;
+                }
+                if (requested >= m_rangeStart && requested <= m_rangeEnd) {
+                    m_declined.insert(requested, now + leaseTime());
+                }
+                m_leases.remove(hardwareAddress);
+                break;
+            case Release:
+                if (serverIdentifier.size() != 4 || readAddress(serverIdentifier, 0) != m_serverAddress) {
+                    break;
+                }
+                m_leases.remove(hardwareAddress);
+                break;
+            case Inform:
+                reply(request, Ack, clientAddress, 0);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void DHCPServer::reply(const QByteArray &request, quint8 messageType, quint32 clientAddress, quint32 yourAddress)
+{
+    QByteArray packet(DHCP_HEADER_SIZE, 0);
+    packet[0] = static_cast<char>(BOOTP_REPLY);
+    // htype, hlen, xid, secs, flags.
+    packet.replace(1, 11, request.mid(1, 11));
+    packet[3] = 0;
+    packet.replace(12, 4, request.mid(12, 4));
+    {
+        uchar buffer[4];
+        qToBigEndian<quint32>(yourAddress, buffer);
+        packet.replace(16, 4, QByteArray(reinterpret_cast<const char*>(buffer), 4));
+    }
+    // chaddr
+    packet.replace(28, 16, request.mid(28, 16));
+
+    appendAddress(packet, DHCP_MAGIC_COOKIE);
+
+    packet.append(static_cast<char>(MessageTypeOption));
+    packet.append(static_cast<char>(1));
+    packet.append(static_cast<char>(messageType));
+    appendOption(packet, ServerIdentifier, m_serverAddress);
+
+    if (messageType != Nak) {
+        appendOption(packet, SubnetMask, m_netmask);
+        if (yourAddress != 0) {
+            appendOption(packet, LeaseTime, leaseTime());
+            appendOption(packet, RenewalTime, leaseTime() / 2);
+            appendOption(packet, RebindingTime, (leaseTime() * 7) / 8);
+        }
+    }
+    packet.append(static_cast<char>(End));
+
+    // Clients which already have an address get it unicast, everybody else gets a broadcast on the link.
+    struct sockaddr_in destination;
+    memset(&destination, 0, sizeof(destination));
+    destination.sin_family = AF_INET;
+    destination.sin_port = htons(DHCP_CLIENT_PORT);
+    destination.sin_addr.s_addr = htonl(clientAddress != 0 && messageType != Nak ? clientAddress : INADDR_BROADCAST);
+
+    if (::sendto(m_socket, packet.constData(), packet.size(), 0, reinterpret_cast<struct sockaddr*>(&destination), sizeof(destination)) < 0) {
+        qWarning() << "DHCP server could not reply on" << m_interface << strerror(errno);
+    }
+}
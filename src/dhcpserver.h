@@ -0,0 +1,60 @@
+#ifndef DHCPSERVER_H
+#define DHCPSERVER_H
+
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+
+#include <QtNetwork/QHostAddress>
+
+class QSocketNotifier;
+
+/**
+ * A minimal DHCPv4 server, driven by the event loop.
+ *
+ * It is meant for the point-to-point gadget link only: it serves a tiny range on a single interface, with no router
+ * and no DNS options, just like the transient dnsmasq configuration it replaces.
+ */
+class DHCPServer : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(DHCPServer)
+
+public:
+    explicit DHCPServer(QObject *parent = nullptr);
+    virtual ~DHCPServer();
+
+    bool start(const QString &interface, const QHostAddress &serverAddress, const QHostAddress &netmask,
+               const QHostAddress &rangeStart, const QHostAddress &rangeEnd, QString *errorMessage);
+    void stop();
+
+    inline bool isRunning() const { return m_socket >= 0; }
+    inline QString interface() const { return m_interface; }
+    inline QHostAddress serverAddress() const { return QHostAddress(m_serverAddress); }
+
+private Q_SLOTS:
+    void readPendingDatagrams();
+
+private:
+    struct Lease {
+        quint32 address;
+        qint64 expiry;
+    };
+
+    quint32 allocate(const QByteArray &hardwareAddress, quint32 requested);
+    void reply(const QByteArray &request, quint8 messageType, quint32 clientAddress, quint32 yourAddress);
+
+    int m_socket;
+    QSocketNotifier *m_notifier;
+
+    QString m_interface;
+    quint32 m_serverAddress;
+    quint32 m_netmask;
+    quint32 m_rangeStart;
+    quint32 m_rangeEnd;
+
+    QHash< QByteArray, Lease > m_leases;
+    /// Addresses clients declined, as somebody else on the link uses them, and until when they're left out.
+    QHash< quint32, qint64 > m_declined;
+};
+
+#endif // DHCPSERVER_H
@@ -1,8 +1,18 @@
 #include "ethernetgadgetoperations.h"
 
+#include "configfsgadget.h"
+#include "dhcpserver.h"
+#include "gadgetmodes.h"
+#include "kernelmodules.h"
+#include "systemdunitoperation.h"
+#include "tracebuffer.h"
+
 #include <HemeraCore/Literals>
 
-#include <QtCore/QProcess>
+#include <QtCore/QFile>
+#include <QtCore/QMetaMethod>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QStringList>
 #include <QtCore/QTimer>
 
 #include <QtDBus/QDBusConnection>
@@ -14,350 +24,1020 @@
 // connman
 #include <connman-qt5/networkmanager.h>
 
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
 #define ETHERNET_GADGET_MODULE "g_ether"
+#define NCM_GADGET_MODULE "g_ncm"
+#define ETHERNET_GADGET_INTERFACE "usb0"
+#define DHCP_SERVICE_UNIT "dnsmasq-usb-gadget.service"
+// Written when we start dnsmasq, removed once it's stopped: while it's there, dnsmasq might be running on our behalf.
+#define DNSMASQ_CONFIGURATION "/tmp/dnsmasq-volatile.conf"
+// Written by gadget-mac-address.service, we share it with the ConfigFS gadget so the host sees the same device.
+#define ETHERNET_GADGET_MODULE_OPTIONS "/etc/modprobe.d/g_ether.conf"
 
-NetworkTechnology *getTechnologyReady(const QString &name)
+/* 5 seconds */
+constexpr int stageTimeout() { return 5 * 1000; }
+/* A handful per layer at most: more means something keeps undoing our steps */
+constexpr int maxReconcileRounds() { return 32; }
+
+EthernetGadgetOperation::EthernetGadgetOperation(Hemera::USBGadgetManager::Mode mode, const Options &options, QObject* parent)
+    : Operation(parent)
+    , m_mode(mode)
+    , m_options(options)
+    , m_interfaceName(QStringLiteral(ETHERNET_GADGET_INTERFACE))
+    , m_linkMonitor(nullptr)
+    , m_stage(Stage::Idle)
+    , m_planPosition(-1)
+    , m_cancelRequested(false)
+    , m_stageStart(-1)
+    , m_elapsed(0)
+    , m_stageTimer(new QTimer(this))
 {
-    NetworkManager *manager = NetworkManagerFactory::createInstance();
+    m_stageTimer->setSingleShot(true);
+    connect(m_stageTimer, &QTimer::timeout, this, &EthernetGadgetOperation::onStageTimeout);
 
-    NetworkTechnology *technology = manager->getTechnology(name);
+    // Whatever the outcome, account for the stage we were in. This runs before any external handler.
+    connect(this, &Hemera::Operation::finished, this, [this] { closeStage(); });
+}
 
-    // Signal might come in more than one time.
-    while (!technology) {
-        // Wait for it to come up
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        QObject::connect(manager, &NetworkManager::technologiesChanged, &e, &QEventLoop::quit);
-        QObject::connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (!t.isActive()) {
-            return nullptr;
-        }
-        technology = manager->getTechnology(name);
+EthernetGadgetOperation::~EthernetGadgetOperation()
+{
+    disarmStage();
+}
+
+QString EthernetGadgetOperation::stageName(Stage stage)
+{
+    switch (stage) {
+        case Stage::Idle:
+            return QStringLiteral("Idle");
+        case Stage::LoadingModule:
+            return QStringLiteral("LoadingModule");
+        case Stage::BuildingImage:
+            return QStringLiteral("BuildingImage");
+        case Stage::ConfiguringGadget:
+            return QStringLiteral("ConfiguringGadget");
+        case Stage::WaitingForTechnology:
+            return QStringLiteral("WaitingForTechnology");
+        case Stage::WaitingForTechnologyProperties:
+            return QStringLiteral("WaitingForTechnologyProperties");
+        case Stage::PoweringTechnology:
+            return QStringLiteral("PoweringTechnology");
+        case Stage::WaitingForService:
+            return QStringLiteral("WaitingForService");
+        case Stage::ConfiguringIPv4:
+            return QStringLiteral("ConfiguringIPv4");
+        case Stage::Connecting:
+            return QStringLiteral("Connecting");
+        case Stage::EnablingTethering:
+            return QStringLiteral("EnablingTethering");
+        case Stage::StartingDHCP:
+            return QStringLiteral("StartingDHCP");
+        case Stage::StoppingDHCP:
+            return QStringLiteral("StoppingDHCP");
+        case Stage::Disconnecting:
+            return QStringLiteral("Disconnecting");
+        case Stage::DisablingTethering:
+            return QStringLiteral("DisablingTethering");
+        case Stage::PoweringDownTechnology:
+            return QStringLiteral("PoweringDownTechnology");
+        case Stage::UnbindingGadget:
+            return QStringLiteral("UnbindingGadget");
+        case Stage::UnloadingModule:
+            return QStringLiteral("UnloadingModule");
+        case Stage::Completed:
+            return QStringLiteral("Completed");
     }
 
-    // We have it.
-    if (technology->name().isEmpty()) {
-        // We have to wait for them to come up
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        QObject::connect(technology, &NetworkTechnology::propertiesReady, &e, &QEventLoop::quit);
-        QObject::connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (!t.isActive()) {
-            return nullptr;
-        }
+    return QString();
+}
+
+EthernetGadgetOperation::Backend EthernetGadgetOperation::backendFromName(const QString &name, bool *ok)
+{
+    if (ok) {
+        *ok = true;
     }
 
-    // Power it up.
-    if (!technology->powered()) {
-        technology->setPowered(true);
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        QObject::connect(technology, &NetworkTechnology::poweredChanged, &e, &QEventLoop::quit);
-        QObject::connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        // There's a bug here in how libconnman-qt manages properties, for any reason. So, check the timer.
-        if (!technology->powered() && !t.isActive()) {
-            return nullptr;
-        }
+    if (name.isEmpty() || name == QStringLiteral("legacy")) {
+        return Backend::LegacyModule;
+    } else if (name == QStringLiteral("configfs")) {
+        return Backend::ConfigFS;
     }
 
-    return technology;
+    if (ok) {
+        *ok = false;
+    }
+    return Backend::LegacyModule;
 }
 
-ActivateEthernetGadget::ActivateEthernetGadget(Hemera::USBGadgetManager::Mode mode, QObject* parent)
-    : Operation(parent)
-    , m_mode(mode)
+QString EthernetGadgetOperation::backendName(Backend backend)
 {
+    switch (backend) {
+        case Backend::LegacyModule:
+            return QStringLiteral("legacy");
+        case Backend::ConfigFS:
+            return QStringLiteral("configfs");
+    }
+
+    return QString();
 }
 
-ActivateEthernetGadget::~ActivateEthernetGadget()
+EthernetGadgetOperation::Function EthernetGadgetOperation::functionFromName(const QString &name, bool *ok)
 {
+    if (ok) {
+        *ok = true;
+    }
+
+    if (name.isEmpty() || name == QStringLiteral("ecm")) {
+        return Function::ECM;
+    } else if (name == QStringLiteral("ncm")) {
+        return Function::NCM;
+    } else if (name == QStringLiteral("rndis")) {
+        return Function::RNDIS;
+    }
+
+    if (ok) {
+        *ok = false;
+    }
+    return Function::ECM;
 }
 
-void ActivateEthernetGadget::startImpl()
+QString EthernetGadgetOperation::functionName(Function function)
 {
-    // We start by configuring kernel modules
-    configureKernelModules();
+    // These are ConfigFS function types as well.
+    switch (function) {
+        case Function::ECM:
+            return QStringLiteral("ecm");
+        case Function::NCM:
+            return QStringLiteral("ncm");
+        case Function::RNDIS:
+            return QStringLiteral("rndis");
+    }
+
+    return QString();
 }
 
-void ActivateEthernetGadget::configureKernelModules()
+QString EthernetGadgetOperation::legacyModule(Function function)
 {
-    // Is the module already loaded?
-    QProcess process;
-    process.execute(QStringLiteral("/sbin/lsmod"));
-    process.waitForFinished(2000);
-    if (process.readAllStandardOutput().contains(ETHERNET_GADGET_MODULE)) {
-        // Ready for connman
-        QTimer::singleShot(0, this, SLOT(configureConnman()));
-        return;
+    // g_ether carries RNDIS next to ECM: the host picks.
+    return function == Function::NCM ? QStringLiteral(NCM_GADGET_MODULE) : QStringLiteral(ETHERNET_GADGET_MODULE);
+}
+
+EthernetGadgetOperation::Network EthernetGadgetOperation::networkFromName(const QString &name, bool *ok)
+{
+    if (ok) {
+        *ok = true;
     }
 
-    // Load it.
-    QProcess loadProcess;
-    loadProcess.execute(QStringLiteral("/sbin/modprobe"), QStringList() << QLatin1String(ETHERNET_GADGET_MODULE));
-    loadProcess.waitForFinished();
-    if (loadProcess.exitCode() != 0) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                             QLatin1String(loadProcess.readAllStandardError()));
-        return;
+    if (name.isEmpty() || name == QStringLiteral("connman")) {
+        return Network::Connman;
+    } else if (name == QStringLiteral("rtnetlink")) {
+        return Network::RtNetlink;
     }
 
-    // Good to go. Let's handle connman now.
-    QTimer::singleShot(0, this, SLOT(configureConnman()));
+    if (ok) {
+        *ok = false;
+    }
+    return Network::Connman;
 }
 
-void ActivateEthernetGadget::configureConnman()
+QString EthernetGadgetOperation::networkName(Network network)
 {
-    // First of all, get our technology
-    NetworkTechnology *gadgetTechnology = getTechnologyReady(QStringLiteral("gadget"));
-    if (!gadgetTechnology) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                             QLatin1String("Could not retrieve gadget on the Network Manager"));
-        return;
+    switch (network) {
+        case Network::Connman:
+            return QStringLiteral("connman");
+        case Network::RtNetlink:
+            return QStringLiteral("rtnetlink");
     }
 
-    // Ok, now. Let's configure
-    if (m_mode == Hemera::USBGadgetManager::Mode::EthernetP2P) {
-        // We have to generate a random IP.
-        m_randomRangeP2P1 = qrand() % 255;
-        m_randomRangeP2P2 = (qrand()  % 255) & 248;
-
-        NetworkManager *manager = NetworkManagerFactory::createInstance();
-        QVector< NetworkService* > services = manager->getServices(QStringLiteral("gadget"));
-        if (services.size() <= 0) {
-            // Some grace time before we die. The service might be on its way
-            QEventLoop e;
-            QTimer t;
-            t.setSingleShot(true);
-            t.start(5000);
-            QObject::connect(manager, &NetworkManager::servicesChanged, &e, &QEventLoop::quit);
-            QObject::connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-            e.exec();
-            services = manager->getServices(QStringLiteral("gadget"));
-            if (services.size() <= 0) {
-                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                     QLatin1String("No networking services found for the Gadget."));
-                return;
+    return QString();
+}
+
+bool EthernetGadgetOperation::startP2PLeases(DHCPServer *server, const QString &interfaceName, const QHostAddress &address,
+                                             QString *errorMessage)
+{
+    // A /29: the device, then up to three hosts.
+    quint32 device = address.toIPv4Address();
+    return server->start(interfaceName, address, QHostAddress(QStringLiteral("255.255.255.248")),
+                         QHostAddress(device + 1), QHostAddress(device + 3), errorMessage);
+}
+
+static bool setInterfaceMTU(const QString &interfaceName, uint mtu, QString *errorMessage)
+{
+    if (mtu == 0) {
+        return true;
+    }
+
+    int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *errorMessage = QStringLiteral("Could not create a socket to configure %1: %2").arg(interfaceName, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    struct ifreq request;
+    memset(&request, 0, sizeof(request));
+    strncpy(request.ifr_name, interfaceName.toLatin1().constData(), IFNAMSIZ - 1);
+    request.ifr_mtu = static_cast<int>(mtu);
+
+    int result = ::ioctl(fd, SIOCSIFMTU, &request);
+    int error = errno;
+    ::close(fd);
+
+    if (result < 0) {
+        *errorMessage = QStringLiteral("Could not set MTU %1 on %2: %3").arg(mtu).arg(interfaceName, QString::fromLocal8Bit(strerror(error)));
+        return false;
+    }
+
+    return true;
+}
+
+ConfigFSGadget EthernetGadgetOperation::configFSGadget(const Options &options)
+{
+    return options.gadget.isEmpty() ? ConfigFSGadget() : ConfigFSGadget(options.gadget);
+}
+
+static ConfigFSGadget::Function configFSFunction(const EthernetGadgetOperation::Options &options)
+{
+    return ConfigFSGadget::Function(EthernetGadgetOperation::functionName(options.function), QStringLiteral(ETHERNET_GADGET_INTERFACE));
+}
+
+bool EthernetGadgetOperation::prepareGadget(const Options &options, QString *interfaceName, QString *errorMessage)
+{
+    QString module = legacyModule(options.function);
+    QStringList legacyModules = QStringList() << QStringLiteral(ETHERNET_GADGET_MODULE) << QStringLiteral(NCM_GADGET_MODULE);
+
+    if (options.backend == Backend::LegacyModule) {
+        // Only one legacy gadget can hold the UDC, and module parameters apply only at load time.
+        for (const QString &loaded : legacyModules) {
+            if (!KernelModules::isLoaded(loaded)) {
+                continue;
             }
-        }
-        NetworkService *service = services.first();
-
-        {
-            QVariantMap ipv4Config;
-            ipv4Config.insert(QStringLiteral("Method"), QStringLiteral("manual"));
-            ipv4Config.insert(QStringLiteral("Address"), QStringLiteral("169.254.%1.%2").arg(m_randomRangeP2P1).arg(m_randomRangeP2P2 + 1));
-            ipv4Config.insert(QStringLiteral("Netmask"), QStringLiteral("255.255.255.248"));
-            service->setIpv4Config(ipv4Config);
-
-            // Wait for config to change
-            QEventLoop e;
-            QTimer t;
-            t.setSingleShot(true);
-            t.start(5000);
-            connect(service, &NetworkService::ipv4ConfigChanged, &e, &QEventLoop::quit);
-            connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-            e.exec();
-            if (service->ipv4Config().value(QStringLiteral("Method")) != QStringLiteral("manual")) {
-                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                    QLatin1String("Could not configure IPv4 for Gadget."));
-                return;
+            if (loaded == module && (!options.qmult || KernelModules::parameter(loaded, QStringLiteral("qmult")) == QByteArray::number(options.qmult))) {
+                continue;
+            }
+            if (!KernelModules::unload(loaded, errorMessage)) {
+                return false;
             }
         }
 
+        // Is the module already loaded? If not, load it.
+        if (!KernelModules::isLoaded(module) &&
+            !KernelModules::load(module, options.qmult ? QStringLiteral("qmult=%1").arg(options.qmult) : QString(), errorMessage)) {
+            return false;
+        }
 
-        // We have to try and connect.
-        service->requestConnect();
+        return setInterfaceMTU(QStringLiteral(ETHERNET_GADGET_INTERFACE), options.mtu, errorMessage);
+    }
 
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        connect(service, &NetworkService::connectedChanged, &e, &QEventLoop::quit);
-        connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (!service->connected()) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                 QLatin1String("Could not connect Gadget to static network route."));
-            return;
+    // The legacy gadget would be holding the UDC. Additional UDCs are never its own.
+    for (const QString &loaded : legacyModules) {
+        if (options.gadget.isEmpty() && KernelModules::isLoaded(loaded) && !KernelModules::unload(loaded, errorMessage)) {
+            return false;
         }
-    } else {
-        // That's way easier.
-        gadgetTechnology->setTethering(true);
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        connect(gadgetTechnology, &NetworkTechnology::tetheringChanged, &e, &QEventLoop::quit);
-        connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (!gadgetTechnology->tethering()) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                 QLatin1String("Could not set up Tethering on the Gadget."));
-            return;
+    }
+
+    ConfigFSGadget::Function function = configFSFunction(options);
+    // The host knows the main gadget by its MAC address. Additional ones get random addresses, not to clash with it.
+    if (options.gadget.isEmpty()) {
+        QFile moduleOptions(QStringLiteral(ETHERNET_GADGET_MODULE_OPTIONS));
+        if (moduleOptions.open(QIODevice::ReadOnly | QIODevice::Text)) {
+            QRegularExpressionMatch match = QRegularExpression(QStringLiteral("host_addr=([0-9a-fA-F:]{17})"))
+                                                .match(QString::fromLatin1(moduleOptions.readAll()));
+            if (match.hasMatch()) {
+                function.attributes.insert(QStringLiteral("host_addr"), match.captured(1).toLower().toLatin1());
+            }
         }
     }
+    if (options.qmult) {
+        function.attributes.insert(QStringLiteral("qmult"), QByteArray::number(options.qmult));
+    }
+
+    // Switching between Ethernet modes leaves the gadget alone: we only rebind.
+    ConfigFSGadget gadget = configFSGadget(options);
+    if (!gadget.prepare(errorMessage) || !gadget.configure(QList< ConfigFSGadget::Function >() << function, options.udc, errorMessage)) {
+        return false;
+    }
+
+    QString ifname = QString::fromLatin1(gadget.functionAttribute(function, QStringLiteral("ifname")));
+    if (ifname.isEmpty()) {
+        ifname = QStringLiteral(ETHERNET_GADGET_INTERFACE);
+    }
+    if (interfaceName) {
+        *interfaceName = ifname;
+    }
 
-    // Yo
-    configureDHCP();
+    return setInterfaceMTU(ifname, options.mtu, errorMessage);
 }
 
-void ActivateEthernetGadget::configureDHCP()
+void EthernetGadgetOperation::setStage(Stage stage)
 {
-    if (m_mode == Hemera::USBGadgetManager::Mode::EthernetTethering) {
-        // Connman already did this for us.
-        setFinished();
+    if (m_stage == stage) {
         return;
     }
 
-    QString configurationFilePayload = QStringLiteral(
-"port=0\n"
-"interface=%1\n"
-"bind-interfaces\n"
-"dhcp-range=169.254.%2.%3,169.254.%2.%4,255.255.255.248,12h\n"
-"dhcp-option=3\n"
-"dhcp-option=6\n"
-    ).arg(QStringLiteral("usb0")).arg(m_randomRangeP2P1).arg(m_randomRangeP2P2 + 2).arg(m_randomRangeP2P2 + 4);
+    closeStage();
 
-    {
-        QFile configFile(QStringLiteral("/tmp/dnsmasq-volatile.conf"));
-        if (!configFile.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                    QLatin1String("Could not write configuration gadget for P2P connection."));
-            return;
+    if (!m_operationTimer.isValid()) {
+        m_operationTimer.start();
+    }
+    m_stage = stage;
+    m_stageStart = m_operationTimer.nsecsElapsed();
+
+    // Stages may show up more than once in a plan: look ahead only.
+    int position = m_plan.indexOf(stage, qMax(m_planPosition, 0));
+    if (position >= 0) {
+        m_planPosition = position;
+    }
+
+    Q_EMIT stageChanged(stage);
+}
+
+uint EthernetGadgetOperation::progress() const
+{
+    if (m_stage == Stage::Completed) {
+        return 100;
+    } else if (m_planPosition < 0 || m_plan.isEmpty()) {
+        return 0;
+    }
+
+    return static_cast<uint>(m_planPosition * 100 / m_plan.size());
+}
+
+qint64 EthernetGadgetOperation::elapsedSoFar() const
+{
+    if (isFinished() || !m_operationTimer.isValid()) {
+        return m_elapsed;
+    }
+
+    return m_operationTimer.nsecsElapsed() / 1000;
+}
+
+void EthernetGadgetOperation::closeStage()
+{
+    if (m_stageStart < 0) {
+        return;
+    }
+
+    qint64 now = m_operationTimer.nsecsElapsed();
+    if (m_stage != Stage::Idle && m_stage != Stage::Completed) {
+        qint64 duration = (now - m_stageStart) / 1000;
+        m_stageTimings.append(qMakePair(m_stage, duration));
+        if (TraceBuffer::isEnabled()) {
+            TraceBuffer::complete(TraceBuffer::operationTrack(m_options.udc), "stage", stageName(m_stage),
+                                  TraceBuffer::now() - duration, duration, GadgetModes::name(static_cast<uint>(m_mode)));
         }
-        configFile.write(configurationFilePayload.toLatin1());
-        configFile.flush();
-        configFile.close();
     }
+    m_elapsed = now / 1000;
+    m_stageStart = -1;
+}
 
-    // We can now start our service
-    QProcess process;
-    process.start(QStringLiteral("systemctl start dnsmasq-usb-gadget.service"));
-    process.waitForFinished();
+void EthernetGadgetOperation::failStage(const QString &errorName, const QString &errorMessage)
+{
+    disarmStage();
+    setFinishedWithError(errorName, errorMessage);
+}
 
-    if (process.exitCode() != 0) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                             QLatin1String(process.readAllStandardError()));
+void EthernetGadgetOperation::cancel()
+{
+    if (isFinished() || m_cancelRequested) {
         return;
     }
 
-    // Whew.
-    setFinished();
+    m_cancelRequested = true;
+
+    // A pending transition is a stage boundary: whatever was requested can still complete on its own.
+    if (m_stageCondition) {
+        failCanceled();
+    }
+}
+
+void EthernetGadgetOperation::failCanceled()
+{
+    failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+              QStringLiteral("The operation was canceled during stage %1.").arg(stageName(m_stage)));
+}
+
+bool EthernetGadgetOperation::startLinkMonitor(QString *errorMessage)
+{
+    if (!m_linkMonitor) {
+        m_linkMonitor = new RtNetlinkMonitor(this);
+    }
+
+    return m_linkMonitor->start(errorMessage);
 }
 
+void EthernetGadgetOperation::armStage(const QMetaObject::Connection &connection, const std::function<bool()> &condition,
+                                       const std::function<void()> &onReady, const std::function<void()> &onTimeout)
+{
+    // Only one transition can be pending at any given time.
+    disarmStage();
+
+    if (m_cancelRequested) {
+        QObject::disconnect(connection);
+        failCanceled();
+        return;
+    }
+
+    m_stageConnection = connection;
+    m_stageCondition = condition;
+    m_stageReady = onReady;
+    m_stageTimeout = onTimeout;
 
+    m_stageTimer->start(stageTimeout());
+}
+
+void EthernetGadgetOperation::disarmStage()
+{
+    QObject::disconnect(m_stageConnection);
+    m_stageTimer->stop();
+
+    m_stageCondition = nullptr;
+    m_stageReady = nullptr;
+    m_stageTimeout = nullptr;
+}
+
+void EthernetGadgetOperation::checkStage()
+{
+    // Which signal woke us up, and when: late ones are what slow activations are made of.
+    if (TraceBuffer::isEnabled() && sender()) {
+        TraceBuffer::instant(TraceBuffer::operationTrack(m_options.udc), "signal",
+                             QString::fromLatin1(sender()->metaObject()->className()) + QStringLiteral("::") +
+                                 QString::fromLatin1(sender()->metaObject()->method(senderSignalIndex()).name()),
+                             stageName(m_stage));
+    }
+
+    // Signals might come in more than one time, and not all of them mean we're there.
+    if (!m_stageCondition || !m_stageCondition()) {
+        return;
+    }
+
+    std::function<void()> next = m_stageReady;
+    disarmStage();
+    next();
+}
+
+void EthernetGadgetOperation::onStageTimeout()
+{
+    if (!m_stageCondition) {
+        return;
+    }
+
+    if (TraceBuffer::isEnabled()) {
+        TraceBuffer::instant(TraceBuffer::operationTrack(m_options.udc), "timeout", QStringLiteral("StageTimeout"), stageName(m_stage));
+    }
+
+    // Give the condition a last chance: some properties change without notifying.
+    std::function<void()> next = m_stageCondition() ? m_stageReady : m_stageTimeout;
+    disarmStage();
+    next();
+}
 
 ///////////////////
 
-DeactivateEthernetGadget::DeactivateEthernetGadget(Hemera::USBGadgetManager::Mode mode, QObject* parent)
-    : Operation(parent)
-    , m_mode(mode)
+ReconcileEthernetGadget::ReconcileEthernetGadget(Hemera::USBGadgetManager::Mode mode, Target target, const Options &options,
+                                                 QObject *parent)
+    : EthernetGadgetOperation(mode, options, parent)
+    , m_target(target)
+    , m_rounds(0)
+    , m_gadgetReady(false)
+    , m_technologyKnown(false)
+    , m_dnsmasqStarted(false)
+    , m_manager(nullptr)
+    , m_randomRangeP2P1(0)
+    , m_randomRangeP2P2(0)
+{
+    m_plan = plan(mode, target, options);
+}
+
+ReconcileEthernetGadget::~ReconcileEthernetGadget()
 {
 }
 
-DeactivateEthernetGadget::~DeactivateEthernetGadget()
+EthernetGadgetOperation::StagePlan ReconcileEthernetGadget::plan(Hemera::USBGadgetManager::Mode mode, Target target, const Options &options)
 {
+    StagePlan plan;
+
+    if (target == Target::Prepared) {
+        plan << (options.backend == Backend::ConfigFS ? Stage::ConfiguringGadget : Stage::LoadingModule);
+        return plan;
+    } else if (target == Target::Active) {
+        plan << (options.backend == Backend::ConfigFS ? Stage::ConfiguringGadget : Stage::LoadingModule);
+        if (options.network == Network::RtNetlink) {
+            plan << Stage::ConfiguringIPv4 << Stage::Connecting << Stage::StartingDHCP;
+            return plan;
+        }
+
+        plan << Stage::WaitingForTechnology << Stage::WaitingForTechnologyProperties << Stage::PoweringTechnology;
+        if (GadgetModes::isPointToPoint(mode)) {
+            plan << Stage::DisablingTethering << Stage::WaitingForService << Stage::ConfiguringIPv4 << Stage::Connecting << Stage::StartingDHCP;
+        } else {
+            plan << Stage::StoppingDHCP << Stage::Disconnecting << Stage::EnablingTethering;
+        }
+        return plan;
+    }
+
+    plan << Stage::StoppingDHCP;
+    if (options.network == Network::RtNetlink) {
+        plan << Stage::Disconnecting;
+    } else {
+        plan << Stage::WaitingForTechnology << Stage::WaitingForTechnologyProperties << Stage::DisablingTethering << Stage::Disconnecting
+             << Stage::PoweringDownTechnology;
+    }
+    plan << (options.backend == Backend::ConfigFS ? Stage::UnbindingGadget : Stage::UnloadingModule);
+
+    return plan;
 }
 
-void DeactivateEthernetGadget::startImpl()
+void ReconcileEthernetGadget::startImpl()
 {
-    // Bring down dnsmasq
-    QProcess unloadProcess;
-    unloadProcess.start(QStringLiteral("systemctl stop dnsmasq-usb-gadget.service"));
-    unloadProcess.waitForFinished();
+    // The kernel named the interface when the gadget was bound: ask it. Bringing the gadget up tells as well.
+    if (m_options.backend == Backend::ConfigFS) {
+        QString ifname = QString::fromLatin1(configFSGadget(m_options).functionAttribute(configFSFunction(m_options), QStringLiteral("ifname")));
+        if (!ifname.isEmpty()) {
+            m_interfaceName = ifname;
+        }
+    }
+
+    reconcile();
+}
 
-    if (unloadProcess.exitCode() != 0) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                             QLatin1String(unloadProcess.readAllStandardError()));
+void ReconcileEthernetGadget::reconcile()
+{
+    // Every round is a stage boundary.
+    if (isCancelRequested()) {
+        failCanceled();
+        return;
+    } else if (++m_rounds > maxReconcileRounds()) {
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                  QStringLiteral("The USB Gadget does not settle during stage %1: something keeps undoing it.").arg(stageName(stage())));
         return;
     }
 
-    // First of all, get our technology
-    NetworkTechnology *gadgetTechnology = getTechnologyReady(QStringLiteral("gadget"));
-    if (!gadgetTechnology) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                             QLatin1String("Could not retrieve gadget on the Network Manager"));
+    if (m_target == Target::Inactive) {
+        reconcileInactive();
+    } else {
+        reconcileActive();
+    }
+}
+
+void ReconcileEthernetGadget::reconcileActive()
+{
+    // Preparing the gadget checks every piece of it, and touches only those which are off.
+    if (!m_gadgetReady) {
+        setStage(m_options.backend == Backend::ConfigFS ? Stage::ConfiguringGadget : Stage::LoadingModule);
+
+        QString errorMessage;
+        if (!prepareGadget(m_options, &m_interfaceName, &errorMessage)) {
+            failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+            return;
+        }
+        m_gadgetReady = true;
+    }
+    if (m_target == Target::Prepared) {
+        setStage(Stage::Completed);
+        setFinished();
         return;
     }
 
-    if (m_mode == Hemera::USBGadgetManager::Mode::EthernetP2P) {
-        NetworkManager *manager = NetworkManagerFactory::createInstance();
-        QVector< NetworkService* > services = manager->getServices(QStringLiteral("gadget"));
-        if (services.size() <= 0) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                 QLatin1String("No networking services found for the Gadget. The cable is likely unplugged."));
+    if (m_options.network == Network::RtNetlink) {
+        QString errorMessage;
+        int index = RtNetlink::interfaceIndex(m_interfaceName);
+        if (index == 0) {
+            failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                      QStringLiteral("The Gadget interface %1 is not there.").arg(m_interfaceName));
+            return;
+        }
+
+        // An address we might have picked ourselves is as good as a new one, and keeps leases valid.
+        QList< QPair< QHostAddress, int > > addresses;
+        if (m_p2pAddress.isNull() && m_rtnetlink.localAddresses(index, &addresses, &errorMessage) && addresses.size() == 1 &&
+            addresses.first().second == 29) {
+            adoptP2PAddress(addresses.first().first);
+        }
+
+        uint flags = 0;
+        if (m_p2pAddress.isNull() || !m_rtnetlink.hasAddress(index, m_p2pAddress, &errorMessage)) {
+            configureAddress();
+            return;
+        } else if (!m_rtnetlink.linkFlags(index, &flags, &errorMessage) || !(flags & IFF_UP)) {
+            setLinkUp(true);
             return;
         }
-        NetworkService *service = services.first();
-
-        // We have to disconnect.
-        service->requestDisconnect();
-
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        connect(service, &NetworkService::connectedChanged, &e, &QEventLoop::quit);
-        connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (service->connected()) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                 QLatin1String("Could not disconnect Gadget from static network route."));
+    } else if (!m_technologyKnown || !m_technology) {
+        acquireTechnology();
+        return;
+    } else if (!m_technology->powered()) {
+        setPowered(true);
+        return;
+    } else if (GadgetModes::isPointToPoint(m_mode)) {
+        if (m_technology->tethering()) {
+            setTethering(false);
+            return;
+        } else if (!m_service) {
+            findService();
+            return;
+        }
+
+        QVariantMap ipv4Config = m_service->ipv4Config();
+        if (ipv4Config.value(QStringLiteral("Method")).toString() != QStringLiteral("manual") ||
+            ipv4Config.value(QStringLiteral("Netmask")).toString() != QStringLiteral("255.255.255.248") ||
+            !adoptP2PAddress(QHostAddress(ipv4Config.value(QStringLiteral("Address")).toString()))) {
+            configureIPv4();
+            return;
+        } else if (!m_service->connected()) {
+            setConnected(true);
             return;
         }
     } else {
-        // Shut down tethering
-        gadgetTechnology->setTethering(false);
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        connect(gadgetTechnology, &NetworkTechnology::tetheringChanged, &e, &QEventLoop::quit);
-        connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (gadgetTechnology->tethering()) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                 QLatin1String("Could not bring down Tethering on the Gadget."));
+        // Tethering takes the technology as a whole: the P2P side goes first.
+        if (!reconcileLeases(false)) {
+            return;
+        } else if (!m_technology->tethering()) {
+            QVector< NetworkService* > services = m_manager->getServices(QStringLiteral("gadget"));
+            if (!services.isEmpty() && services.first()->connected()) {
+                m_service = services.first();
+                setConnected(false);
+                return;
+            }
+
+            setTethering(true);
             return;
         }
+
+        // Connman serves leases on its own.
+        setStage(Stage::Completed);
+        setFinished();
+        return;
+    }
+
+    if (!reconcileLeases(true)) {
+        return;
     }
 
-    // Power it down.
-    if (gadgetTechnology->powered()) {
-        gadgetTechnology->setPowered(false);
-        QEventLoop e;
-        QTimer t;
-        t.setSingleShot(true);
-        t.start(5000);
-        connect(gadgetTechnology, &NetworkTechnology::poweredChanged, &e, &QEventLoop::quit);
-        connect(&t, &QTimer::timeout, &e, &QEventLoop::quit);
-        e.exec();
-        if (gadgetTechnology->powered()) {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
-                                 QLatin1String("Could not power down Gadget on the Network Manager"));
+    // Whew.
+    setStage(Stage::Completed);
+    setFinished();
+}
+
+void ReconcileEthernetGadget::reconcileInactive()
+{
+    if (!reconcileLeases(false)) {
+        return;
+    }
+
+    if (m_options.network == Network::RtNetlink) {
+        // No interface, nothing to tear down: the gadget went away with it.
+        uint flags = 0;
+        QString errorMessage;
+        int index = RtNetlink::interfaceIndex(m_interfaceName);
+        if (index != 0 && m_rtnetlink.linkFlags(index, &flags, &errorMessage) && (flags & IFF_UP)) {
+            setLinkUp(false);
+            return;
+        }
+    } else if (!m_technologyKnown) {
+        acquireTechnology();
+        return;
+    } else if (m_technology) {
+        // Whatever connman has goes, whichever mode it belongs to: either might have been halfway up.
+        QVector< NetworkService* > services = m_manager->getServices(QStringLiteral("gadget"));
+        if (m_technology->tethering()) {
+            setTethering(false);
+            return;
+        } else if (!services.isEmpty() && services.first()->connected()) {
+            m_service = services.first();
+            setConnected(false);
+            return;
+        } else if (m_technology->powered()) {
+            setPowered(false);
             return;
         }
     }
 
-    // Now, remove the module safely.
-    QProcess process;
-    process.execute(QStringLiteral("/sbin/rmmod"), QStringList() << QLatin1String(ETHERNET_GADGET_MODULE));
-    process.waitForFinished();
-    if (process.exitCode() != 0) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                             QLatin1String(process.readAllStandardError()));
-        return;
+    QString errorMessage;
+    if (m_options.backend == Backend::ConfigFS) {
+        // Just unbind: functions stay in place, so that the next activation is a plain rebind.
+        ConfigFSGadget gadget = configFSGadget(m_options);
+        if (!gadget.boundUDC().isEmpty()) {
+            setStage(Stage::UnbindingGadget);
+            if (!gadget.unbind(&errorMessage)) {
+                failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+                return;
+            }
+        }
+    } else {
+        QString module = legacyModule(m_options.function);
+        if (KernelModules::isLoaded(module)) {
+            setStage(Stage::UnloadingModule);
+            if (!KernelModules::unload(module, &errorMessage)) {
+                failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+                return;
+            }
+        }
     }
 
     // We're done.
+    setStage(Stage::Completed);
     setFinished();
 }
 
+bool ReconcileEthernetGadget::reconcileLeases(bool wanted)
+{
+    DHCPServer *server = m_options.dhcpServer;
+
+    // Only one of them serves the link. Our dnsmasq configuration tells whether we ever started it.
+    if (QFile::exists(QStringLiteral(DNSMASQ_CONFIGURATION)) && (!wanted || server)) {
+        setStage(Stage::StoppingDHCP);
+        runDnsmasq(SystemdUnitOperation::Action::Stop, true);
+        return false;
+    }
+    if (server && server->isRunning() && (!wanted || server->interface() != m_interfaceName || server->serverAddress() != m_p2pAddress)) {
+        setStage(wanted ? Stage::StartingDHCP : Stage::StoppingDHCP);
+        server->stop();
+    }
+
+    if (!wanted) {
+        return true;
+    } else if (server) {
+        // Serve leases ourselves: same range and options we would give to dnsmasq.
+        QString errorMessage;
+        if (!server->isRunning()) {
+            setStage(Stage::StartingDHCP);
+            if (!startP2PLeases(server, m_interfaceName, m_p2pAddress, &errorMessage)) {
+                failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // dnsmasq reads its configuration when it starts: a new one takes a restart. Starting a running unit is a no-op to systemd.
+    QByteArray configuration = dnsmasqConfiguration().toLatin1();
+    QFile configFile(QStringLiteral(DNSMASQ_CONFIGURATION));
+    bool current = configFile.open(QIODevice::ReadOnly) && configFile.readAll() == configuration;
+    configFile.close();
+    if (current && m_dnsmasqStarted) {
+        return true;
+    }
+
+    setStage(Stage::StartingDHCP);
+    if (!current) {
+        if (!configFile.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate) || configFile.write(configuration) != configuration.size()) {
+            failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                      QLatin1String("Could not write configuration gadget for P2P connection."));
+            return false;
+        }
+        configFile.close();
+    }
+
+    runDnsmasq(current ? SystemdUnitOperation::Action::Start : SystemdUnitOperation::Action::Restart, false);
+    return false;
+}
+
+void ReconcileEthernetGadget::runDnsmasq(SystemdUnitOperation::Action action, bool removeConfiguration)
+{
+    SystemdUnitOperation *unit = new SystemdUnitOperation(action, QStringLiteral(DHCP_SERVICE_UNIT), this);
+    connect(unit, &Hemera::Operation::finished, this, [this, unit, action, removeConfiguration] {
+        unit->deleteLater();
+        if (unit->isError()) {
+            failStage(unit->errorName(), unit->errorMessage());
+            return;
+        }
+
+        if (removeConfiguration) {
+            QFile::remove(QStringLiteral(DNSMASQ_CONFIGURATION));
+        }
+        m_dnsmasqStarted = action != SystemdUnitOperation::Action::Stop;
+        reconcile();
+    });
+}
+
+QString ReconcileEthernetGadget::dnsmasqConfiguration() const
+{
+    return QStringLiteral(
+"port=0\n"
+"interface=%1\n"
+"bind-interfaces\n"
+"dhcp-range=169.254.%2.%3,169.254.%2.%4,255.255.255.248,12h\n"
+"dhcp-option=3\n"
+"dhcp-option=6\n"
+    ).arg(m_interfaceName).arg(m_randomRangeP2P1).arg(m_randomRangeP2P2 + 2).arg(m_randomRangeP2P2 + 4);
+}
+
+void ReconcileEthernetGadget::acquireTechnology()
+{
+    setStage(Stage::WaitingForTechnology);
+
+    m_manager = NetworkManagerFactory::createInstance();
+    m_technology = m_manager->getTechnology(QStringLiteral("gadget"));
+
+    if (m_technology) {
+        waitForTechnologyProperties();
+        return;
+    }
+
+    // Wait for it to come up. Going down, a technology which never shows up has nothing to tear down either.
+    waitFor(m_manager, &NetworkManager::technologiesChanged, [this] {
+        m_technology = m_manager->getTechnology(QStringLiteral("gadget"));
+        return !m_technology.isNull();
+    }, [this] {
+        waitForTechnologyProperties();
+    }, [this] {
+        if (m_target == Target::Inactive) {
+            m_technologyKnown = true;
+            reconcile();
+            return;
+        }
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
+                  QLatin1String("Could not retrieve gadget on the Network Manager"));
+    });
+}
+
+void ReconcileEthernetGadget::waitForTechnologyProperties()
+{
+    // We have it.
+    if (!m_technology->name().isEmpty()) {
+        m_technologyKnown = true;
+        reconcile();
+        return;
+    }
+
+    // We have to wait for them to come up
+    setStage(Stage::WaitingForTechnologyProperties);
+    waitFor(m_technology.data(), &NetworkTechnology::propertiesReady, [this] {
+        return m_technology && !m_technology->name().isEmpty();
+    }, [this] {
+        m_technologyKnown = true;
+        reconcile();
+    }, [this] {
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
+                  QLatin1String("Could not retrieve gadget on the Network Manager"));
+    });
+}
+
+void ReconcileEthernetGadget::setPowered(bool powered)
+{
+    setStage(powered ? Stage::PoweringTechnology : Stage::PoweringDownTechnology);
+
+    m_technology->setPowered(powered);
+    // There's a bug here in how libconnman-qt manages properties, for any reason. The timeout re-checks the condition.
+    settle(m_technology.data(), &NetworkTechnology::poweredChanged, [this, powered] {
+        return m_technology ? m_technology->powered() == powered : !powered;
+    }, powered ? QStringLiteral("Could not power up Gadget on the Network Manager")
+               : QStringLiteral("Could not power down Gadget on the Network Manager"));
+}
+
+void ReconcileEthernetGadget::setTethering(bool tethering)
+{
+    setStage(tethering ? Stage::EnablingTethering : Stage::DisablingTethering);
+
+    m_technology->setTethering(tethering);
+    settle(m_technology.data(), &NetworkTechnology::tetheringChanged, [this, tethering] {
+        return m_technology ? m_technology->tethering() == tethering : !tethering;
+    }, tethering ? QStringLiteral("Could not set up Tethering on the Gadget.") : QStringLiteral("Could not bring down Tethering on the Gadget."));
+}
+
+void ReconcileEthernetGadget::findService()
+{
+    setStage(Stage::WaitingForService);
+
+    auto findService = [this] () -> bool {
+        QVector< NetworkService* > services = m_manager->getServices(QStringLiteral("gadget"));
+        if (services.isEmpty()) {
+            return false;
+        }
+        m_service = services.first();
+        return true;
+    };
+
+    if (findService()) {
+        reconcile();
+        return;
+    }
+
+    // Some grace time before we die. The service might be on its way
+    waitFor(m_manager, &NetworkManager::servicesChanged, findService, [this] {
+        reconcile();
+    }, [this] {
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                  QLatin1String("No networking services found for the Gadget."));
+    });
+}
+
+void ReconcileEthernetGadget::configureIPv4()
+{
+    setStage(Stage::ConfiguringIPv4);
+
+    if (m_p2pAddress.isNull()) {
+        pickP2PAddress();
+    }
+
+    QVariantMap ipv4Config;
+    ipv4Config.insert(QStringLiteral("Method"), QStringLiteral("manual"));
+    ipv4Config.insert(QStringLiteral("Address"), m_p2pAddress.toString());
+    ipv4Config.insert(QStringLiteral("Netmask"), QStringLiteral("255.255.255.248"));
+    m_service->setIpv4Config(ipv4Config);
+
+    // Wait for config to change
+    settle(m_service.data(), &NetworkService::ipv4ConfigChanged, [this] {
+        return m_service && m_service->ipv4Config().value(QStringLiteral("Method")) == QStringLiteral("manual") &&
+               m_service->ipv4Config().value(QStringLiteral("Address")) == m_p2pAddress.toString();
+    }, QStringLiteral("Could not configure IPv4 for Gadget."));
+}
+
+void ReconcileEthernetGadget::setConnected(bool connected)
+{
+    setStage(connected ? Stage::Connecting : Stage::Disconnecting);
+
+    if (connected) {
+        m_service->requestConnect();
+    } else {
+        m_service->requestDisconnect();
+    }
+
+    settle(m_service.data(), &NetworkService::connectedChanged, [this, connected] {
+        return m_service ? m_service->connected() == connected : !connected;
+    }, connected ? QStringLiteral("Could not connect Gadget to static network route.")
+                 : QStringLiteral("Could not disconnect Gadget from static network route."));
+}
+
+void ReconcileEthernetGadget::configureAddress()
+{
+    setStage(Stage::ConfiguringIPv4);
+
+    if (m_p2pAddress.isNull()) {
+        pickP2PAddress();
+    }
+
+    // Whatever was there before goes: the link is ours.
+    QString errorMessage;
+    int index = RtNetlink::interfaceIndex(m_interfaceName);
+    if (!startLinkMonitor(&errorMessage) || !m_rtnetlink.flushAddresses(index, &errorMessage) ||
+        !m_rtnetlink.addAddress(index, m_p2pAddress, 29, &errorMessage)) {
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                  QStringLiteral("Could not configure IPv4 for Gadget: %1").arg(errorMessage));
+        return;
+    }
+
+    settle(m_linkMonitor, &RtNetlinkMonitor::changed, [this, index] {
+        QString errorMessage;
+        return m_rtnetlink.hasAddress(index, m_p2pAddress, &errorMessage);
+    }, QStringLiteral("Could not configure IPv4 for Gadget."));
+}
+
+void ReconcileEthernetGadget::setLinkUp(bool up)
+{
+    setStage(up ? Stage::Connecting : Stage::Disconnecting);
+
+    // Going down, addresses go first.
+    QString errorMessage;
+    int index = RtNetlink::interfaceIndex(m_interfaceName);
+    if (!startLinkMonitor(&errorMessage) || (!up && !m_rtnetlink.flushAddresses(index, &errorMessage)) ||
+        !m_rtnetlink.setLinkUp(index, up, &errorMessage)) {
+        failStage(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                  QStringLiteral("Could not bring the Gadget interface %1: %2").arg(up ? QStringLiteral("up") : QStringLiteral("down"), errorMessage));
+        return;
+    }
+
+    // Up is enough: carrier comes when a host shows up, and leases will be waiting for it.
+    settle(m_linkMonitor, &RtNetlinkMonitor::changed, [this, index, up] {
+        uint flags = 0;
+        QString errorMessage;
+        return m_rtnetlink.linkFlags(index, &flags, &errorMessage) && ((flags & IFF_UP) != 0) == up;
+    }, up ? QStringLiteral("Could not bring the Gadget interface up.") : QStringLiteral("Could not bring the Gadget interface down."));
+}
+
+void ReconcileEthernetGadget::pickP2PAddress()
+{
+    // We have to generate a random IP.
+    m_randomRangeP2P1 = qrand() % 255;
+    m_randomRangeP2P2 = (qrand()  % 255) & 248;
+    // Low bits of the third octet tell controllers apart.
+    m_randomRangeP2P1 = (m_randomRangeP2P1 & 248) | (m_options.controller & 7);
+    m_p2pAddress = QHostAddress(QStringLiteral("169.254.%1.%2").arg(m_randomRangeP2P1).arg(m_randomRangeP2P2 + 1));
+}
+
+bool ReconcileEthernetGadget::adoptP2PAddress(const QHostAddress &address)
+{
+    if (!m_p2pAddress.isNull()) {
+        return address == m_p2pAddress;
+    }
+
+    // 169.254.x.y, with our controller in the low bits of x and y first in its /29: what pickP2PAddress would give.
+    quint32 ipv4 = address.toIPv4Address();
+    int octet3 = (ipv4 >> 8) & 255;
+    int octet4 = ipv4 & 255;
+    if (address.protocol() != QAbstractSocket::IPv4Protocol || (ipv4 >> 16) != 0xa9fe ||
+        (octet3 & 7) != static_cast<int>(m_options.controller & 7) || (octet4 & 7) != 1) {
+        return false;
+    }
+
+    m_randomRangeP2P1 = octet3;
+    m_randomRangeP2P2 = octet4 - 1;
+    m_p2pAddress = address;
+    return true;
+}
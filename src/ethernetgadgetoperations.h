@@ -1,49 +1,316 @@
 #ifndef ACTIVATEETHERNETGADGET_H
 #define ACTIVATEETHERNETGADGET_H
 
+#include <HemeraCore/Literals>
 #include <HemeraCore/Operation>
 
 #include <HemeraCore/USBGadgetManager>
 
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QPointer>
+
+#include <QtNetwork/QHostAddress>
+
+#include "configfsgadget.h"
+#include "rtnetlink.h"
+#include "systemdunitoperation.h"
+
+#include <functional>
+
+class QTimer;
+
+class DHCPServer;
+class DataPipe;
+
+class NetworkManager;
+class NetworkService;
 class NetworkTechnology;
 
-class ActivateEthernetGadget : public Hemera::Operation
+/**
+ * Common base for the gadget operations. Most of them are about Ethernet, hence the name.
+ *
+ * Every step of an operation is a stage. Stages waiting on connman never spin an event loop: they arm a
+ * transition on a signal and a timeout, and the operation moves on when either of them fires.
+ */
+class EthernetGadgetOperation : public Hemera::Operation
 {
     Q_OBJECT
+    Q_DISABLE_COPY(EthernetGadgetOperation)
 
 public:
-    explicit ActivateEthernetGadget(Hemera::USBGadgetManager::Mode mode, QObject* parent = nullptr);
-    virtual ~ActivateEthernetGadget();
+    enum class Backend : quint8 {
+        /// The legacy g_ether kernel module.
+        LegacyModule = 0,
+        /// A libcomposite gadget built through ConfigFS.
+        ConfigFS
+    };
+
+    enum class Function : quint8 {
+        ECM = 0,
+        NCM,
+        RNDIS
+    };
+
+    /// What configures the network on the gadget interface.
+    enum class Network : quint8 {
+        Connman = 0,
+        /// Addresses and link state are set directly through rtnetlink. P2P only.
+        RtNetlink
+    };
+
+    struct Options {
+        Options() : backend(Backend::LegacyModule), function(Function::ECM), qmult(0), mtu(0), network(Network::Connman), controller(0),
+                    dhcpServer(nullptr), dataPipe(nullptr), imageSize(0), readOnly(false), removable(true), noFUA(false) {}
+
+        Backend backend;
+        /// The UDC the ConfigFS gadget binds to. Empty picks the first one.
+        QString udc;
+        /// The ConfigFS gadget of an additional UDC. Empty is the main one.
+        QString gadget;
+        Function function;
+        /// Request queue length multiplier for high speed links. 0 keeps the kernel default.
+        uint qmult;
+        /// 0 keeps the kernel default.
+        uint mtu;
+        Network network;
+        /// 0 for the main UDC. P2P subnets of different controllers never overlap.
+        uint controller;
+        /// When set, P2P leases are served in-process rather than by dnsmasq.
+        DHCPServer *dhcpServer;
+        /// DataPipe: the service's pipe, which serves the FunctionFS function.
+        DataPipe *dataPipe;
+
+        /// MassStorage: the backing image.
+        QString image;
+        /// MassStorage: when set, the image is built out of this directory first.
+        QString imageSource;
+        /// MassStorage: size of a built image, in bytes. 0 fits its contents, with room to spare.
+        quint64 imageSize;
+        bool readOnly;
+        bool removable;
+        /// MassStorage: ignore the host's Force Unit Access, for faster writes.
+        bool noFUA;
+
+        inline bool operator==(const Options &other) const {
+            return backend == other.backend && udc == other.udc && gadget == other.gadget && function == other.function &&
+                   qmult == other.qmult && mtu == other.mtu && network == other.network && controller == other.controller &&
+                   dhcpServer == other.dhcpServer && dataPipe == other.dataPipe && image == other.image &&
+                   imageSource == other.imageSource && imageSize == other.imageSize && readOnly == other.readOnly &&
+                   removable == other.removable && noFUA == other.noFUA;
+        }
+        inline bool operator!=(const Options &other) const { return !(*this == other); }
+    };
+
+    enum class Stage : quint8 {
+        Idle = 0,
+        LoadingModule,
+        BuildingImage,
+        ConfiguringGadget,
+        WaitingForTechnology,
+        WaitingForTechnologyProperties,
+        PoweringTechnology,
+        WaitingForService,
+        ConfiguringIPv4,
+        Connecting,
+        EnablingTethering,
+        StartingDHCP,
+        StoppingDHCP,
+        Disconnecting,
+        DisablingTethering,
+        PoweringDownTechnology,
+        UnbindingGadget,
+        UnloadingModule,
+        Completed
+    };
+
+    typedef QList< QPair< Stage, qint64 > > StageTimings;
+    typedef QList< Stage > StagePlan;
+
+    virtual ~EthernetGadgetOperation();
+
+    inline Hemera::USBGadgetManager::Mode mode() const { return m_mode; }
+    inline Options options() const { return m_options; }
+    inline Stage stage() const { return m_stage; }
+
+    /// How far along its stage plan the operation is, from 0 to 100. It never goes back.
+    uint progress() const;
+
+    /// The network interface of the gadget, once it is up.
+    inline QString interfaceName() const { return m_interfaceName; }
+    /// The address the device got on the P2P link, once it is configured.
+    inline QHostAddress p2pAddress() const { return m_p2pAddress; }
+
+    /// Time spent in every stage, in microseconds, measured on the monotonic clock.
+    inline StageTimings stageTimings() const { return m_stageTimings; }
+    /// Time from the first stage to completion, in microseconds.
+    inline qint64 elapsed() const { return m_elapsed; }
+    /// Like elapsed(), but for an operation which is still running.
+    qint64 elapsedSoFar() const;
+
+    static QString stageName(Stage stage);
+
+    static Backend backendFromName(const QString &name, bool *ok = nullptr);
+    static QString backendName(Backend backend);
+    static Function functionFromName(const QString &name, bool *ok = nullptr);
+    static QString functionName(Function function);
+    /// The legacy module providing @p function.
+    static QString legacyModule(Function function);
+    static Network networkFromName(const QString &name, bool *ok = nullptr);
+    static QString networkName(Network network);
+
+    /// Brings the gadget up (module loaded, or ConfigFS gadget bound), so that the host can enumerate it. Network is left alone.
+    static bool prepareGadget(const Options &options, QString *interfaceName, QString *errorMessage);
+    /// Serves leases on the P2P link whose device side is @p address.
+    static bool startP2PLeases(DHCPServer *server, const QString &interfaceName, const QHostAddress &address, QString *errorMessage);
+
+    /// Stops the operation at its next stage boundary, which is right away if it is waiting. The operation fails.
+    virtual void cancel();
+    inline bool isCancelRequested() const { return m_cancelRequested; }
+
+Q_SIGNALS:
+    void stageChanged(EthernetGadgetOperation::Stage stage);
 
 protected:
-    virtual void startImpl();
+    explicit EthernetGadgetOperation(Hemera::USBGadgetManager::Mode mode, const Options &options, QObject *parent);
+
+    void setStage(Stage stage);
+
+    /// Moves on with @p onReady as soon as @p condition holds after @p signal, or with @p onTimeout if it does not in time.
+    template <typename Func>
+    inline void waitFor(const typename QtPrivate::FunctionPointer<Func>::Object *sender, Func signal,
+                        const std::function<bool()> &condition,
+                        const std::function<void()> &onReady,
+                        const std::function<void()> &onTimeout) {
+        armStage(QObject::connect(sender, signal, this, [this] { checkStage(); }), condition, onReady, onTimeout);
+    }
+
+    void failStage(const QString &errorName, const QString &errorMessage);
+    void failCanceled();
+
+    /// Starts watching links and addresses, for stages which wait on rtnetlink.
+    bool startLinkMonitor(QString *errorMessage);
+
+    /// The ConfigFS gadget @p options are about.
+    static ConfigFSGadget configFSGadget(const Options &options);
+
+    /// The stages the operation is expected to go through, in order. Stages it skips just make progress jump.
+    StagePlan m_plan;
+
+    Hemera::USBGadgetManager::Mode m_mode;
+    Options m_options;
+    QString m_interfaceName;
+    QHostAddress m_p2pAddress;
+
+    RtNetlink m_rtnetlink;
+    RtNetlinkMonitor *m_linkMonitor;
 
 private Q_SLOTS:
-    void configureKernelModules();
-    void configureConnman();
-    void configureDHCP();
+    void checkStage();
+    void onStageTimeout();
 
 private:
-    Hemera::USBGadgetManager::Mode m_mode;
+    void armStage(const QMetaObject::Connection &connection, const std::function<bool()> &condition,
+                  const std::function<void()> &onReady, const std::function<void()> &onTimeout);
+    void disarmStage();
+    void closeStage();
 
-    // Random IP P2P
-    int m_randomRangeP2P1;
-    int m_randomRangeP2P2;
+    Stage m_stage;
+    int m_planPosition;
+    bool m_cancelRequested;
+    QElapsedTimer m_operationTimer;
+    qint64 m_stageStart;
+    StageTimings m_stageTimings;
+    qint64 m_elapsed;
+
+    QTimer *m_stageTimer;
+    QMetaObject::Connection m_stageConnection;
+    std::function<bool()> m_stageCondition;
+    std::function<void()> m_stageReady;
+    std::function<void()> m_stageTimeout;
 };
 
-class DeactivateEthernetGadget : public Hemera::Operation
+/**
+ * Brings the Ethernet gadget and its network to a target state, from whatever state they are in.
+ *
+ * Every round observes the gadget, the connman technology and service (or the link, through rtnetlink) and the DHCP
+ * server, then applies the first step still missing towards the target. Whatever is in place already is left alone: after
+ * a failure, running again with the same target resumes from where things are, and any target can be reached from there.
+ */
+class ReconcileEthernetGadget : public EthernetGadgetOperation
 {
     Q_OBJECT
 
 public:
-    explicit DeactivateEthernetGadget(Hemera::USBGadgetManager::Mode mode, QObject* parent = nullptr);
-    virtual ~DeactivateEthernetGadget();
+    enum class Target : quint8 {
+        /// The mode is up, and whatever belongs to other modes is down.
+        Active = 0,
+        /// Nothing is up, down to the gadget itself.
+        Inactive,
+        /// The gadget is up for the host to enumerate, and nothing else is touched.
+        Prepared
+    };
+
+    explicit ReconcileEthernetGadget(Hemera::USBGadgetManager::Mode mode, Target target, const Options &options = Options(),
+                                     QObject *parent = nullptr);
+    virtual ~ReconcileEthernetGadget();
+
+    inline Target target() const { return m_target; }
+
+    /// The stages a run might go through. Those already in place are skipped.
+    static StagePlan plan(Hemera::USBGadgetManager::Mode mode, Target target, const Options &options);
 
 protected:
     virtual void startImpl();
 
+private Q_SLOTS:
+    void reconcile();
+
 private:
-    Hemera::USBGadgetManager::Mode m_mode;
+    void reconcileActive();
+    void reconcileInactive();
+    /// Whether DHCP is as it should be. When it is not, a step is under way and the next round comes after it.
+    bool reconcileLeases(bool wanted);
+
+    /// The next round comes as soon as @p condition holds after @p signal.
+    template <typename Func>
+    inline void settle(const typename QtPrivate::FunctionPointer<Func>::Object *sender, Func signal,
+                       const std::function<bool()> &condition, const QString &failure) {
+        waitFor(sender, signal, condition, [this] { reconcile(); }, [this, failure] {
+            failStage(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()), failure);
+        });
+    }
+
+    void acquireTechnology();
+    void waitForTechnologyProperties();
+    void setPowered(bool powered);
+    void setTethering(bool tethering);
+    void findService();
+    void configureIPv4();
+    void setConnected(bool connected);
+    void configureAddress();
+    void setLinkUp(bool up);
+    void runDnsmasq(SystemdUnitOperation::Action action, bool removeConfiguration);
+
+    void pickP2PAddress();
+    /// Takes over the P2P address @p address, if it is one we might have picked.
+    bool adoptP2PAddress(const QHostAddress &address);
+    QString dnsmasqConfiguration() const;
+
+    Target m_target;
+    int m_rounds;
+    bool m_gadgetReady;
+    bool m_technologyKnown;
+    bool m_dnsmasqStarted;
+
+    NetworkManager *m_manager;
+    QPointer< NetworkTechnology > m_technology;
+    QPointer< NetworkService > m_service;
+
+    // Random IP P2P
+    int m_randomRangeP2P1;
+    int m_randomRangeP2P2;
 };
 
 #endif // ACTIVATEETHERNETGADGET_H
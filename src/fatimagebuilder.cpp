@@ -0,0 +1,675 @@
+#include "fatimagebuilder.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSet>
+#include <QtCore/QtEndian>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+constexpr quint32 sectorSize() { return 512; }
+constexpr quint32 reservedSectors() { return 32; }
+constexpr quint32 directoryEntrySize() { return 32; }
+/* Below this, it would be a FAT16 volume */
+constexpr quint32 minimumClusters() { return 65525; }
+constexpr quint32 maximumClusters() { return 0x0FFFFFF5 - 2; }
+/* 64 MiB */
+constexpr quint64 minimumFreeSpace() { return 64 * 1024 * 1024; }
+/* 1 MiB */
+constexpr int copyChunk() { return 1024 * 1024; }
+/* 64 KiB */
+constexpr quint32 fatChunkEntries() { return 16 * 1024; }
+
+constexpr quint32 endOfChain() { return 0x0FFFFFFF; }
+
+enum Attribute : quint8 {
+    VolumeLabel = 0x08,
+    Directory = 0x10,
+    Archive = 0x20,
+    LongName = 0x0F
+};
+
+static const char volumeLabel[] = "HEMERA     ";
+
+static inline void putU16(char *data, quint16 value)
+{
+    qToLittleEndian(value, reinterpret_cast<uchar*>(data));
+}
+
+static inline void putU32(char *data, quint32 value)
+{
+    qToLittleEndian(value, reinterpret_cast<uchar*>(data));
+}
+
+static bool isShortNameCharacter(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != '\0' && strchr("$%'-_@~`!(){}^#&", c));
+}
+
+// Space padded base and extension, or nothing if @p name needs a long name.
+static QByteArray exactShortName(const QString &name)
+{
+    QByteArray latin = name.toLatin1();
+    if (latin.isEmpty() || latin.size() > 12 || QString::fromLatin1(latin) != name) {
+        return QByteArray();
+    }
+
+    int dot = latin.indexOf('.');
+    QByteArray base = dot < 0 ? latin : latin.left(dot);
+    QByteArray extension = dot < 0 ? QByteArray() : latin.mid(dot + 1);
+    if (base.isEmpty() || base.size() > 8 || extension.size() > 3 || (dot >= 0 && extension.isEmpty())) {
+        return QByteArray();
+    }
+    for (char c : base + extension) {
+        if (!isShortNameCharacter(c)) {
+            return QByteArray();
+        }
+    }
+
+    return base.leftJustified(8, ' ') + extension.leftJustified(3, ' ');
+}
+
+static QByteArray shortNameBasis(const QString &part)
+{
+    QByteArray basis;
+    for (QChar c : part.toUpper()) {
+        if (c == QLatin1Char(' ') || c == QLatin1Char('.')) {
+            continue;
+        }
+        char latin = c.unicode() < 128 ? c.toLatin1() : '_';
+        basis.append(isShortNameCharacter(latin) ? latin : '_');
+    }
+    return basis;
+}
+
+static quint8 shortNameChecksum(const QByteArray &shortName)
+{
+    quint8 sum = 0;
+    for (char c : shortName) {
+        sum = static_cast<quint8>(((sum & 1) << 7) + (sum >> 1) + static_cast<quint8>(c));
+    }
+    return sum;
+}
+
+static int longNameEntries(const QString &name)
+{
+    return (name.size() + 12) / 13;
+}
+
+static QByteArray shortEntry(const QByteArray &shortName, quint8 attributes, quint32 cluster, quint32 size, const QDateTime &modified)
+{
+    QByteArray entry(directoryEntrySize(), '\0');
+    memcpy(entry.data(), shortName.constData(), 11);
+    entry[11] = static_cast<char>(attributes);
+
+    // FAT keeps local time, from 1980 on.
+    QDateTime local = modified.isValid() ? modified.toLocalTime() : QDateTime::currentDateTime();
+    QDate date = local.date();
+    QTime time = local.time();
+    quint16 dosDate = date.year() < 1980 ? (1 << 5) | 1 : ((date.year() - 1980) << 9) | (date.month() << 5) | date.day();
+    quint16 dosTime = date.year() < 1980 ? 0 : (time.hour() << 11) | (time.minute() << 5) | (time.second() / 2);
+
+    putU16(entry.data() + 14, dosTime);
+    putU16(entry.data() + 16, dosDate);
+    putU16(entry.data() + 18, dosDate);
+    putU16(entry.data() + 20, cluster >> 16);
+    putU16(entry.data() + 22, dosTime);
+    putU16(entry.data() + 24, dosDate);
+    putU16(entry.data() + 26, cluster & 0xFFFF);
+    putU32(entry.data() + 28, size);
+    return entry;
+}
+
+// The long name entries preceding the short entry, last part first.
+static QByteArray longEntries(const QString &name, const QByteArray &shortName)
+{
+    static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+    QString escaped = name;
+    for (QChar &c : escaped) {
+        if (c.unicode() < 0x20 || QStringLiteral("\\:*?\"<>|").contains(c)) {
+            c = QLatin1Char('_');
+        }
+    }
+
+    quint8 checksum = shortNameChecksum(shortName);
+    int count = longNameEntries(escaped);
+    QByteArray entries;
+    for (int ordinal = count; ordinal >= 1; --ordinal) {
+        QByteArray entry(directoryEntrySize(), '\0');
+        entry[0] = static_cast<char>(ordinal == count ? ordinal | 0x40 : ordinal);
+        entry[11] = static_cast<char>(LongName);
+        entry[13] = static_cast<char>(checksum);
+
+        // A name which doesn't fill its last entry ends with a NUL, then padding.
+        for (int i = 0; i < 13; ++i) {
+            int position = (ordinal - 1) * 13 + i;
+            quint16 unit = position < escaped.size() ? escaped.at(position).unicode() : (position == escaped.size() ? 0x0000 : 0xFFFF);
+            putU16(entry.data() + offsets[i], unit);
+        }
+        entries.append(entry);
+    }
+    return entries;
+}
+
+FatImageBuilder::FatImageBuilder(const QString &sourceDirectory, const QString &imagePath, quint64 size)
+    : m_sourceDirectory(sourceDirectory)
+    , m_imagePath(imagePath)
+    , m_requestedSize(size)
+    , m_contentBytes(0)
+    , m_clusterSize(0)
+    , m_fatSectors(0)
+    , m_clusterCount(0)
+    , m_nextCluster(0)
+    , m_totalSectors(0)
+    , m_fd(-1)
+    , m_currentFile(0)
+    , m_sourceFd(-1)
+    , m_sourceOffset(0)
+    , m_copiedBytes(0)
+    , m_droppedUpTo(0)
+    , m_flushedUpTo(0)
+    , m_writtenUpTo(0)
+{
+}
+
+FatImageBuilder::~FatImageBuilder()
+{
+    if (m_sourceFd >= 0) {
+        ::close(m_sourceFd);
+    }
+
+    // Never leave half an image behind.
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        ::unlink(QFile::encodeName(m_imagePath + QStringLiteral(".part")).constData());
+    }
+}
+
+bool FatImageBuilder::scan(int node, QString *errorMessage)
+{
+    // Symlinks could loop, and there's nothing FAT could make of special files.
+    QFileInfoList entries = QDir(m_nodes.at(node).sourcePath).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden |
+                                                                           QDir::System | QDir::NoSymLinks, QDir::Name);
+    for (const QFileInfo &entry : entries) {
+        if (!entry.isDir() && !entry.isFile()) {
+            continue;
+        }
+
+        Node child;
+        child.name = entry.fileName();
+        child.sourcePath = entry.absoluteFilePath();
+        child.directory = entry.isDir();
+        child.parent = node;
+        child.size = child.directory ? 0 : static_cast<quint64>(entry.size());
+        child.modified = entry.lastModified();
+
+        if (child.name.size() > 255) {
+            *errorMessage = QStringLiteral("%1 has a name too long for FAT.").arg(child.sourcePath);
+            return false;
+        } else if (child.size > 0xFFFFFFFFull) {
+            *errorMessage = QStringLiteral("%1 is larger than FAT32 can hold (4 GiB).").arg(child.sourcePath);
+            return false;
+        }
+
+        m_contentBytes += child.size;
+        m_nodes.append(child);
+        int index = m_nodes.size() - 1;
+        m_nodes[node].children.append(index);
+
+        if (m_nodes.at(index).directory && !scan(index, errorMessage)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void FatImageBuilder::assignShortNames(int directory)
+{
+    QSet< QByteArray > used;
+    QList< int > generated;
+
+    // Names which fit as they are keep them, the others get a numbered tail.
+    for (int child : m_nodes.at(directory).children) {
+        QByteArray shortName = exactShortName(m_nodes.at(child).name);
+        if (shortName.isEmpty() || used.contains(shortName)) {
+            generated.append(child);
+            continue;
+        }
+        m_nodes[child].shortName = shortName;
+        used.insert(shortName);
+    }
+
+    for (int child : generated) {
+        QString name = m_nodes.at(child).name;
+        int dot = name.lastIndexOf(QLatin1Char('.'));
+        QByteArray basis = shortNameBasis(dot > 0 ? name.left(dot) : name);
+        QByteArray extension = dot > 0 ? shortNameBasis(name.mid(dot + 1)).left(3) : QByteArray();
+        if (basis.isEmpty()) {
+            basis = "_";
+        }
+
+        for (int n = 1; ; ++n) {
+            QByteArray tail = '~' + QByteArray::number(n);
+            QByteArray shortName = (basis.left(8 - tail.size()) + tail).leftJustified(8, ' ') + extension.leftJustified(3, ' ');
+            if (!used.contains(shortName)) {
+                m_nodes[child].shortName = shortName;
+                m_nodes[child].longName = true;
+                used.insert(shortName);
+                break;
+            }
+        }
+    }
+}
+
+quint32 FatImageBuilder::directoryEntries(int directory) const
+{
+    // The root has the volume label, the others their dot entries.
+    quint32 entries = directory == 0 ? 1 : 2;
+    for (int child : m_nodes.at(directory).children) {
+        entries += 1 + (m_nodes.at(child).longName ? longNameEntries(m_nodes.at(child).name) : 0);
+    }
+    return entries;
+}
+
+bool FatImageBuilder::layOut(QString *errorMessage)
+{
+    quint64 directoryBytes = 0;
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes.at(i).directory) {
+            if (directoryEntries(i) > 65536) {
+                *errorMessage = QStringLiteral("%1 has more entries than a FAT directory can hold.").arg(m_nodes.at(i).sourcePath);
+                return false;
+            }
+            directoryBytes += directoryEntries(i) * directoryEntrySize();
+        }
+    }
+
+    // What we're aiming for decides the cluster size: the smaller, the less is wasted on small files.
+    quint64 target = m_requestedSize;
+    if (target == 0) {
+        target = m_contentBytes + directoryBytes + qMax(m_contentBytes / 4, minimumFreeSpace());
+    }
+    m_clusterSize = target <= (8ull << 30) ? 4096 : target <= (16ull << 30) ? 8192 : target <= (32ull << 30) ? 16384 : 32768;
+    quint32 sectorsPerCluster = m_clusterSize / sectorSize();
+
+    // Everything gets a contiguous run of clusters, in tree order: the root comes first, at cluster 2.
+    m_nextCluster = 2;
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        Node &node = m_nodes[i];
+        quint64 bytes = node.directory ? directoryEntries(i) * directoryEntrySize() : node.size;
+        node.clusters = qMax< quint32 >(static_cast<quint32>((bytes + m_clusterSize - 1) / m_clusterSize), node.directory ? 1 : 0);
+        node.firstCluster = node.clusters > 0 ? m_nextCluster : 0;
+        m_nextCluster += node.clusters;
+    }
+    quint32 needed = m_nextCluster - 2;
+
+    if (m_requestedSize > 0) {
+        if (m_requestedSize / sectorSize() > 0xFFFFFFFFull) {
+            *errorMessage = QStringLiteral("FAT32 images can't be larger than 2 TiB.");
+            return false;
+        }
+
+        // The FAT takes its share of the requested size: settle on how many clusters are left.
+        quint32 sectors = static_cast<quint32>(m_requestedSize / sectorSize());
+        m_clusterCount = sectors / sectorsPerCluster;
+        for (int i = 0; i < 3; ++i) {
+            m_fatSectors = ((m_clusterCount + 2) * 4 + sectorSize() - 1) / sectorSize();
+            quint32 metadata = reservedSectors() + 2 * m_fatSectors;
+            m_clusterCount = sectors > metadata ? (sectors - metadata) / sectorsPerCluster : 0;
+        }
+
+        if (m_clusterCount < minimumClusters()) {
+            *errorMessage = QStringLiteral("FAT32 images must be at least %1 MiB large.")
+                                .arg((static_cast<quint64>(minimumClusters()) * m_clusterSize >> 20) + 1);
+            return false;
+        } else if (needed > m_clusterCount) {
+            *errorMessage = QStringLiteral("The contents of %1 don't fit in %2 bytes.").arg(m_sourceDirectory).arg(m_requestedSize);
+            return false;
+        }
+    } else {
+        // Free space is free: the image is sparse.
+        quint64 slack = qMax(m_contentBytes / 4, minimumFreeSpace()) / m_clusterSize;
+        m_clusterCount = static_cast<quint32>(qBound< quint64 >(minimumClusters() + 16, needed + slack, maximumClusters()));
+        m_fatSectors = ((m_clusterCount + 2) * 4 + sectorSize() - 1) / sectorSize();
+    }
+
+    if (needed > maximumClusters() ||
+        reservedSectors() + 2ull * m_fatSectors + static_cast<quint64>(m_clusterCount) * sectorsPerCluster > 0xFFFFFFFFull) {
+        *errorMessage = QStringLiteral("The contents of %1 are too large for a FAT32 image.").arg(m_sourceDirectory);
+        return false;
+    }
+    m_totalSectors = reservedSectors() + 2 * m_fatSectors + m_clusterCount * sectorsPerCluster;
+
+    return true;
+}
+
+quint64 FatImageBuilder::clusterOffset(quint32 cluster) const
+{
+    return (static_cast<quint64>(reservedSectors()) + 2 * m_fatSectors) * sectorSize() + static_cast<quint64>(cluster - 2) * m_clusterSize;
+}
+
+QByteArray FatImageBuilder::directoryContents(int directory) const
+{
+    const Node &node = m_nodes.at(directory);
+    QByteArray contents;
+
+    if (directory == 0) {
+        contents.append(shortEntry(QByteArray(volumeLabel, 11), VolumeLabel, 0, 0, QDateTime::currentDateTime()));
+    } else {
+        // The root is cluster 0 to its children.
+        quint32 parentCluster = node.parent == 0 ? 0 : m_nodes.at(node.parent).firstCluster;
+        contents.append(shortEntry(".          ", Directory, node.firstCluster, 0, node.modified));
+        contents.append(shortEntry("..         ", Directory, parentCluster, 0, node.modified));
+    }
+
+    for (int index : node.children) {
+        const Node &child = m_nodes.at(index);
+        if (child.longName) {
+            contents.append(longEntries(child.name, child.shortName));
+        }
+        contents.append(shortEntry(child.shortName, child.directory ? Directory : Archive, child.firstCluster,
+                                   static_cast<quint32>(child.size), child.modified));
+    }
+
+    return contents;
+}
+
+bool FatImageBuilder::writeAt(quint64 offset, const char *data, qint64 size, QString *errorMessage)
+{
+    qint64 written = 0;
+    while (written < size) {
+        ssize_t result = ::pwrite(m_fd, data + written, size - written, offset + written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *errorMessage = QStringLiteral("Could not write %1: %2").arg(m_imagePath, QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+        written += result;
+    }
+
+    m_writtenUpTo = qMax(m_writtenUpTo, offset + size);
+    return true;
+}
+
+bool FatImageBuilder::writeMetadata(QString *errorMessage)
+{
+    quint32 usedClusters = m_nextCluster - 2;
+
+    QByteArray boot(sectorSize(), '\0');
+    char *b = boot.data();
+    memcpy(b, "\xEB\x58\x90" "HEMERA  ", 11);
+    putU16(b + 11, sectorSize());
+    b[13] = static_cast<char>(m_clusterSize / sectorSize());
+    putU16(b + 14, reservedSectors());
+    b[16] = 2;
+    b[21] = static_cast<char>(0xF8);
+    putU16(b + 24, 63);
+    putU16(b + 26, 255);
+    putU32(b + 32, m_totalSectors);
+    putU32(b + 36, m_fatSectors);
+    putU32(b + 44, 2);
+    putU16(b + 48, 1);
+    putU16(b + 50, 6);
+    b[64] = static_cast<char>(0x80);
+    b[66] = 0x29;
+    putU32(b + 67, static_cast<quint32>(QDateTime::currentMSecsSinceEpoch()));
+    memcpy(b + 71, volumeLabel, 11);
+    memcpy(b + 82, "FAT32   ", 8);
+    b[510] = 0x55;
+    b[511] = static_cast<char>(0xAA);
+
+    QByteArray fsInfo(sectorSize(), '\0');
+    putU32(fsInfo.data(), 0x41615252);
+    putU32(fsInfo.data() + 484, 0x61417272);
+    putU32(fsInfo.data() + 488, m_clusterCount - usedClusters);
+    putU32(fsInfo.data() + 492, m_nextCluster);
+    putU32(fsInfo.data() + 508, 0xAA550000);
+
+    // Sectors 6 and 7 are the backup.
+    if (!writeAt(0, boot.constData(), boot.size(), errorMessage) || !writeAt(sectorSize(), fsInfo.constData(), fsInfo.size(), errorMessage) ||
+        !writeAt(6 * sectorSize(), boot.constData(), boot.size(), errorMessage) ||
+        !writeAt(7 * sectorSize(), fsInfo.constData(), fsInfo.size(), errorMessage)) {
+        return false;
+    }
+
+    // Runs are contiguous and back to back: the used part of the FAT is one stretch, the rest stays a hole.
+    QVector< quint32 > runEnds;
+    for (const Node &node : m_nodes) {
+        if (node.clusters > 0) {
+            runEnds.append(node.firstCluster + node.clusters - 1);
+        }
+    }
+
+    int run = 0;
+    for (quint32 start = 0; start < m_nextCluster; start += fatChunkEntries()) {
+        quint32 count = qMin(fatChunkEntries(), m_nextCluster - start);
+        QByteArray chunk(count * 4, '\0');
+        for (quint32 cluster = start; cluster < start + count; ++cluster) {
+            quint32 value;
+            if (cluster == 0) {
+                value = 0x0FFFFFF8;
+            } else if (cluster == 1) {
+                value = endOfChain();
+            } else {
+                while (runEnds.at(run) < cluster) {
+                    ++run;
+                }
+                value = runEnds.at(run) == cluster ? endOfChain() : cluster + 1;
+            }
+            putU32(chunk.data() + (cluster - start) * 4, value);
+        }
+
+        for (quint32 fat = 0; fat < 2; ++fat) {
+            quint64 offset = (static_cast<quint64>(reservedSectors()) + fat * m_fatSectors) * sectorSize() + start * 4ull;
+            if (!writeAt(offset, chunk.constData(), chunk.size(), errorMessage)) {
+                return false;
+            }
+        }
+    }
+
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes.at(i).directory) {
+            QByteArray contents = directoryContents(i);
+            if (!writeAt(clusterOffset(m_nodes.at(i).firstCluster), contents.constData(), contents.size(), errorMessage)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool FatImageBuilder::start(QString *errorMessage)
+{
+    if (!QFileInfo(m_sourceDirectory).isDir()) {
+        *errorMessage = QStringLiteral("%1 is not a directory.").arg(m_sourceDirectory);
+        return false;
+    }
+
+    m_nodes.clear();
+    m_contentBytes = 0;
+
+    Node root;
+    root.sourcePath = QFileInfo(m_sourceDirectory).absoluteFilePath();
+    root.directory = true;
+    root.modified = QFileInfo(m_sourceDirectory).lastModified();
+    m_nodes.append(root);
+
+    if (!scan(0, errorMessage)) {
+        return false;
+    }
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes.at(i).directory) {
+            assignShortNames(i);
+        }
+    }
+    if (!layOut(errorMessage)) {
+        return false;
+    }
+
+    if (QFileInfo(m_imagePath).exists() && !isBuiltImage(m_imagePath)) {
+        *errorMessage = QStringLiteral("%1 already exists, and is not an image built here before.").arg(m_imagePath);
+        return false;
+    }
+
+    // Built aside, so that nobody ever sees half an image. Whatever a previous attempt left there goes, links included, never
+    // what they point to.
+    QByteArray partPath = QFile::encodeName(m_imagePath + QStringLiteral(".part"));
+    ::unlink(partPath.constData());
+    m_fd = ::open(partPath.constData(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        *errorMessage = QStringLiteral("Could not create %1: %2").arg(QFile::decodeName(partPath), QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    if (::ftruncate(m_fd, static_cast<off_t>(m_totalSectors) * sectorSize()) < 0) {
+        *errorMessage = QStringLiteral("Could not size %1: %2").arg(QFile::decodeName(partPath), QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    m_currentFile = 0;
+    m_copiedBytes = 0;
+    return writeMetadata(errorMessage);
+}
+
+void FatImageBuilder::releaseWritten()
+{
+    // The previous round had its time to reach the disk: wait for whatever is left of it, then drop it from the cache.
+    if (m_flushedUpTo > m_droppedUpTo) {
+        ::sync_file_range(m_fd, m_droppedUpTo, m_flushedUpTo - m_droppedUpTo,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        ::posix_fadvise(m_fd, m_droppedUpTo, m_flushedUpTo - m_droppedUpTo, POSIX_FADV_DONTNEED);
+        m_droppedUpTo = m_flushedUpTo;
+    }
+
+    // This round's goes out in the background.
+    if (m_writtenUpTo > m_flushedUpTo) {
+        ::sync_file_range(m_fd, m_flushedUpTo, m_writtenUpTo - m_flushedUpTo, SYNC_FILE_RANGE_WRITE);
+        m_flushedUpTo = m_writtenUpTo;
+    }
+}
+
+bool FatImageBuilder::writeData(qint64 budget, bool *done, QString *errorMessage)
+{
+    *done = false;
+    QByteArray buffer(copyChunk(), Qt::Uninitialized);
+
+    for (qint64 spent = 0; spent < budget; ) {
+        if (m_sourceFd < 0) {
+            do {
+                ++m_currentFile;
+            } while (m_currentFile < m_nodes.size() && (m_nodes.at(m_currentFile).directory || m_nodes.at(m_currentFile).size == 0));
+
+            if (m_currentFile >= m_nodes.size()) {
+                *done = finish(errorMessage);
+                return *done;
+            }
+
+            m_sourceFd = ::open(QFile::encodeName(m_nodes.at(m_currentFile).sourcePath).constData(), O_RDONLY | O_CLOEXEC);
+            if (m_sourceFd < 0) {
+                *errorMessage = QStringLiteral("Could not read %1: %2").arg(m_nodes.at(m_currentFile).sourcePath,
+                                                                           QString::fromLocal8Bit(strerror(errno)));
+                return false;
+            }
+            ::posix_fadvise(m_sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            m_sourceOffset = 0;
+        }
+
+        const Node &node = m_nodes.at(m_currentFile);
+        ssize_t size = ::pread(m_sourceFd, buffer.data(), qMin< quint64 >(buffer.size(), node.size - m_sourceOffset), m_sourceOffset);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *errorMessage = QStringLiteral("Could not read %1: %2").arg(node.sourcePath, QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+
+        if (size == 0) {
+            // It shrank under us: the rest reads as zeros, which is what a hole is.
+            m_copiedBytes += node.size - m_sourceOffset;
+            m_sourceOffset = node.size;
+        } else {
+            // Zeros are holes already.
+            bool zeros = buffer.at(0) == '\0' && memcmp(buffer.constData(), buffer.constData() + 1, size - 1) == 0;
+            if (!zeros && !writeAt(clusterOffset(node.firstCluster) + m_sourceOffset, buffer.constData(), size, errorMessage)) {
+                return false;
+            }
+            ::posix_fadvise(m_sourceFd, m_sourceOffset, size, POSIX_FADV_DONTNEED);
+            m_sourceOffset += size;
+            m_copiedBytes += size;
+            spent += size;
+        }
+
+        if (m_sourceOffset >= node.size) {
+            ::close(m_sourceFd);
+            m_sourceFd = -1;
+        }
+    }
+
+    releaseWritten();
+    return true;
+}
+
+bool FatImageBuilder::finish(QString *errorMessage)
+{
+    QByteArray partPath = QFile::encodeName(m_imagePath + QStringLiteral(".part"));
+    if (::fdatasync(m_fd) < 0) {
+        *errorMessage = QStringLiteral("Could not flush %1: %2").arg(QFile::decodeName(partPath), QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(m_fd);
+    m_fd = -1;
+
+    // The target might have changed since we started.
+    if (QFileInfo(m_imagePath).exists() && !isBuiltImage(m_imagePath)) {
+        *errorMessage = QStringLiteral("%1 showed up meanwhile, and is not an image built here before.").arg(m_imagePath);
+        ::unlink(partPath.constData());
+        return false;
+    }
+
+    if (::rename(partPath.constData(), QFile::encodeName(m_imagePath).constData()) < 0) {
+        *errorMessage = QStringLiteral("Could not move %1 in place: %2").arg(QFile::decodeName(partPath), QString::fromLocal8Bit(strerror(errno)));
+        ::unlink(partPath.constData());
+        return false;
+    }
+
+    return true;
+}
+
+bool FatImageBuilder::isBuiltImage(const QString &path)
+{
+    QByteArray encoded = QFile::encodeName(path);
+    int fd = ::open(encoded.constData(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat status;
+    char boot[sectorSize()];
+    bool built = ::fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+                 ::pread(fd, boot, sizeof(boot), 0) == static_cast<ssize_t>(sizeof(boot)) &&
+                 memcmp(boot, "\xEB\x58\x90" "HEMERA  ", 11) == 0 && memcmp(boot + 82, "FAT32   ", 8) == 0 &&
+                 static_cast<uchar>(boot[510]) == 0x55 && static_cast<uchar>(boot[511]) == 0xAA;
+    ::close(fd);
+    return built;
+}
+
+uint FatImageBuilder::progress() const
+{
+    if (m_contentBytes == 0) {
+        return m_fd < 0 ? 100 : 0;
+    }
+
+    return static_cast<uint>(qMin< quint64 >(m_copiedBytes * 100 / m_contentBytes, 100));
+}
@@ -0,0 +1,90 @@
+#ifndef FATIMAGEBUILDER_H
+#define FATIMAGEBUILDER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QDateTime>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+/**
+ * Builds a FAT32 disk image out of a directory, for a mass storage function to expose.
+ *
+ * The image is a sparse file: only metadata and file contents are ever written, free space costs nothing. Contents are
+ * streamed a chunk at a time, so that neither RAM nor the page cache ever hold more than that, and so that callers can
+ * spread the work over their event loop.
+ */
+class FatImageBuilder
+{
+public:
+    /// @p size is in bytes. 0 fits the contents, with room to spare for whatever the host wants to add.
+    FatImageBuilder(const QString &sourceDirectory, const QString &imagePath, quint64 size = 0);
+    ~FatImageBuilder();
+
+    /// Lays the volume out and writes everything but file contents.
+    bool start(QString *errorMessage);
+    /// Copies up to @p budget bytes of file contents. The image shows up at its path once @p done.
+    bool writeData(qint64 budget, bool *done, QString *errorMessage);
+
+    /// How much of the contents is in, from 0 to 100.
+    uint progress() const;
+
+    /// Whether @p path is a regular file holding an image we built: the only kind we ever replace.
+    static bool isBuiltImage(const QString &path);
+
+private:
+    Q_DISABLE_COPY(FatImageBuilder)
+
+    struct Node {
+        Node() : directory(false), parent(-1), size(0), longName(false), firstCluster(0), clusters(0) {}
+
+        QString name;
+        QString sourcePath;
+        bool directory;
+        int parent;
+        quint64 size;
+        QDateTime modified;
+        QList< int > children;
+        /// 8.3 name, space padded. Long names come on top of it.
+        QByteArray shortName;
+        bool longName;
+        quint32 firstCluster;
+        quint32 clusters;
+    };
+
+    bool scan(int node, QString *errorMessage);
+    void assignShortNames(int directory);
+    quint32 directoryEntries(int directory) const;
+    bool layOut(QString *errorMessage);
+    QByteArray directoryContents(int directory) const;
+    bool writeMetadata(QString *errorMessage);
+    bool writeAt(quint64 offset, const char *data, qint64 size, QString *errorMessage);
+    quint64 clusterOffset(quint32 cluster) const;
+    void releaseWritten();
+    bool finish(QString *errorMessage);
+
+    QString m_sourceDirectory;
+    QString m_imagePath;
+    quint64 m_requestedSize;
+
+    QVector< Node > m_nodes;
+    quint64 m_contentBytes;
+
+    quint32 m_clusterSize;
+    quint32 m_fatSectors;
+    quint32 m_clusterCount;
+    quint32 m_nextCluster;
+    quint32 m_totalSectors;
+
+    int m_fd;
+    int m_currentFile;
+    int m_sourceFd;
+    quint64 m_sourceOffset;
+    quint64 m_copiedBytes;
+    /// Written contents go through writeback and out of the page cache in rounds, ending at these offsets.
+    quint64 m_droppedUpTo;
+    quint64 m_flushedUpTo;
+    quint64 m_writtenUpTo;
+};
+
+#endif // FATIMAGEBUILDER_H
@@ -0,0 +1,167 @@
+#include "gadgetcapabilities.h"
+
+#include "gadgetmodes.h"
+
+#include <HemeraCore/USBGadgetManager>
+
+#include <connman-qt5/networkmanager.h>
+
+#include <QtCore/QDebug>
+
+GadgetCapabilities::GadgetCapabilities(QObject *parent)
+    : QObject(parent)
+    , m_manager(nullptr)
+    , m_networkManagerKnown(false)
+    , m_availableModes(static_cast<uint>(Hemera::USBGadgetManager::Mode::None))
+{
+}
+
+GadgetCapabilities::~GadgetCapabilities()
+{
+}
+
+bool GadgetCapabilities::hasGadgetTechnology() const
+{
+    return m_manager && m_manager->isAvailable() && m_manager->getTechnology(QStringLiteral("gadget"));
+}
+
+void GadgetCapabilities::bindNetworkManager()
+{
+    if (m_manager) {
+        return;
+    }
+
+    // The instance is shared: operations will find technologies and services already there.
+    m_manager = NetworkManagerFactory::createInstance();
+    connect(m_manager, &NetworkManager::availabilityChanged, this, &GadgetCapabilities::onNetworkManagerAvailabilityChanged);
+    connect(m_manager, &NetworkManager::technologiesChanged, this, &GadgetCapabilities::updateAvailableModes);
+
+    if (m_manager->isAvailable()) {
+        onNetworkManagerAvailabilityChanged();
+    }
+}
+
+void GadgetCapabilities::onNetworkManagerAvailabilityChanged()
+{
+    // Availability is worth something only once connman-qt made up its mind.
+    m_networkManagerKnown = true;
+    updateAvailableModes();
+
+    if (m_manager->isAvailable()) {
+        Q_EMIT networkManagerReady();
+    }
+}
+
+void GadgetCapabilities::refresh()
+{
+    m_hardware = probeHardware();
+    updateAvailableModes();
+}
+
+void GadgetCapabilities::updateAvailableModes()
+{
+    uint availableModes = static_cast<uint>(Hemera::USBGadgetManager::Mode::None);
+
+    for (Hemera::USBGadgetManager::Mode mode : { Hemera::USBGadgetManager::Mode::EthernetP2P,
+                                                 Hemera::USBGadgetManager::Mode::EthernetTethering,
+                                                 GadgetModes::EthernetNCM }) {
+        EthernetGadgetOperation::Options options;
+        options.function = mode == GadgetModes::EthernetNCM ? EthernetGadgetOperation::Function::NCM : EthernetGadgetOperation::Function::ECM;
+
+        // Any backend and any network will do, and there's always the embedded DHCP server.
+        for (EthernetGadgetOperation::Backend backend : { EthernetGadgetOperation::Backend::LegacyModule, EthernetGadgetOperation::Backend::ConfigFS }) {
+            for (EthernetGadgetOperation::Network network : { EthernetGadgetOperation::Network::Connman, EthernetGadgetOperation::Network::RtNetlink }) {
+                options.backend = backend;
+                options.network = network;
+                if (unavailabilityReason(static_cast<uint>(mode), options, true).isEmpty()) {
+                    availableModes |= static_cast<uint>(mode);
+                }
+            }
+        }
+    }
+
+    // Disks and data pipes are on ConfigFS only, and have no network to speak of.
+    EthernetGadgetOperation::Options options;
+    options.backend = EthernetGadgetOperation::Backend::ConfigFS;
+    for (Hemera::USBGadgetManager::Mode mode : { GadgetModes::MassStorage, GadgetModes::DataPipe }) {
+        if (unavailabilityReason(static_cast<uint>(mode), options, true).isEmpty()) {
+            availableModes |= static_cast<uint>(mode);
+        }
+    }
+
+    if (availableModes != m_availableModes) {
+        qDebug() << "Available USB Gadget modes changed from" << m_availableModes << "to" << availableModes;
+        m_availableModes = availableModes;
+        Q_EMIT availableModesChanged();
+    }
+}
+
+QString GadgetCapabilities::unavailabilityReason(uint mode, const EthernetGadgetOperation::Options &options) const
+{
+    return unavailabilityReason(mode, options, options.dhcpServer != nullptr);
+}
+
+QString GadgetCapabilities::unavailabilityReason(uint mode, const EthernetGadgetOperation::Options &options, bool embeddedDHCP) const
+{
+    if (mode == static_cast<uint>(GadgetModes::MassStorage)) {
+        if (m_hardware.udcs.isEmpty()) {
+            return QStringLiteral("No USB Device Controller is available on this system.");
+        } else if (options.backend != EthernetGadgetOperation::Backend::ConfigFS || !m_hardware.configFS) {
+            return QStringLiteral("MassStorage needs a USB Gadget built through ConfigFS.");
+        } else if (!m_hardware.functions.contains(QStringLiteral("mass_storage"))) {
+            return QStringLiteral("The mass_storage USB function (usb_f_mass_storage) is not available on this system.");
+        } else if (!options.udc.isEmpty() && !m_hardware.udcs.contains(options.udc)) {
+            return QStringLiteral("The USB Device Controller %1 is not available on this system.").arg(options.udc);
+        }
+        return QString();
+    } else if (mode == static_cast<uint>(GadgetModes::DataPipe)) {
+        if (m_hardware.udcs.isEmpty()) {
+            return QStringLiteral("No USB Device Controller is available on this system.");
+        } else if (options.backend != EthernetGadgetOperation::Backend::ConfigFS || !m_hardware.configFS) {
+            return QStringLiteral("DataPipe needs a USB Gadget built through ConfigFS.");
+        } else if (!m_hardware.functions.contains(QStringLiteral("ffs"))) {
+            return QStringLiteral("The FunctionFS USB function (usb_f_fs) is not available on this system.");
+        } else if (!options.udc.isEmpty() && !m_hardware.udcs.contains(options.udc)) {
+            return QStringLiteral("The USB Device Controller %1 is not available on this system.").arg(options.udc);
+        }
+        return QString();
+    } else if (!GadgetModes::isEthernet(static_cast<Hemera::USBGadgetManager::Mode>(mode))) {
+        return QStringLiteral("The mode you requested is either not implemented or not available.");
+    }
+
+    if (m_hardware.udcs.isEmpty()) {
+        return QStringLiteral("No USB Device Controller is available on this system.");
+    }
+
+    if (options.backend == EthernetGadgetOperation::Backend::LegacyModule) {
+        QString module = EthernetGadgetOperation::legacyModule(options.function);
+        if (!m_hardware.legacyModules.contains(module)) {
+            return QStringLiteral("The %1 kernel module is not available on this system.").arg(module);
+        }
+    } else if (options.backend == EthernetGadgetOperation::Backend::ConfigFS) {
+        QString type = EthernetGadgetOperation::functionName(options.function);
+        if (!m_hardware.configFS) {
+            return QStringLiteral("This kernel can't build USB Gadgets through ConfigFS.");
+        } else if (!m_hardware.functions.contains(type)) {
+            return QStringLiteral("The %1 USB function (usb_f_%2) is not available on this system.").arg(type.toUpper(), type);
+        } else if (!options.udc.isEmpty() && !m_hardware.udcs.contains(options.udc)) {
+            return QStringLiteral("The USB Device Controller %1 is not available on this system.").arg(options.udc);
+        }
+    }
+
+    if (options.network == EthernetGadgetOperation::Network::RtNetlink) {
+        // We can put an address on a link, sharing a connection is another story.
+        if (!GadgetModes::isPointToPoint(static_cast<Hemera::USBGadgetManager::Mode>(mode))) {
+            return QStringLiteral("Tethering needs connman: it can't be configured through rtnetlink.");
+        }
+    } else if (m_networkManagerKnown && !m_manager->isAvailable()) {
+        // The gadget technology shows up only once the gadget is there, so connman itself is all we can ask for.
+        return QStringLiteral("Connman is not running: the gadget network can't be configured.");
+    }
+
+    if (GadgetModes::isPointToPoint(static_cast<Hemera::USBGadgetManager::Mode>(mode)) && !embeddedDHCP && !m_hardware.dnsmasq) {
+        return QStringLiteral("dnsmasq is not installed. Use the embedded DHCP server for P2P instead.");
+    }
+
+    return QString();
+}
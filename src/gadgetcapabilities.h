@@ -0,0 +1,75 @@
+#ifndef GADGETCAPABILITIES_H
+#define GADGETCAPABILITIES_H
+
+#include "ethernetgadgetoperations.h"
+
+#include <QtCore/QObject>
+#include <QtCore/QStringList>
+
+class NetworkManager;
+
+/**
+ * What this system can actually do with its USB device port.
+ *
+ * Probing happens once at startup and again whenever devices or connman come and go, so that requests
+ * which can't possibly succeed are turned down right away rather than after a chain of stage timeouts.
+ */
+class GadgetCapabilities : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(GadgetCapabilities)
+
+public:
+    struct Hardware {
+        Hardware() : configFS(false), dnsmasq(false) {}
+
+        /// USB Device Controllers, as found in /sys/class/udc.
+        QStringList udcs;
+        /// Legacy gadget modules which are loaded or can be loaded.
+        QStringList legacyModules;
+        /// libcomposite gadgets can be built through ConfigFS.
+        bool configFS;
+        /// Function types available to ConfigFS gadgets.
+        QStringList functions;
+        /// dnsmasq can serve P2P leases.
+        bool dnsmasq;
+    };
+
+    /// Probes the kernel and the filesystem. It lives in its own translation unit, so that it can be stubbed out.
+    static Hardware probeHardware();
+
+    explicit GadgetCapabilities(QObject *parent = nullptr);
+    virtual ~GadgetCapabilities();
+
+    inline Hardware hardware() const { return m_hardware; }
+    inline bool isNetworkManagerBound() const { return m_manager; }
+    inline uint availableModes() const { return m_availableModes; }
+    bool hasGadgetTechnology() const;
+
+    /// Returns why @p mode can't be activated with @p options, or an empty string if it can.
+    QString unavailabilityReason(uint mode, const EthernetGadgetOperation::Options &options) const;
+
+public Q_SLOTS:
+    void refresh();
+    /// Starts following connman. Until then, it is assumed to be there: binding costs startup time we'd rather not pay.
+    void bindNetworkManager();
+
+Q_SIGNALS:
+    void availableModesChanged();
+    /// Connman showed up, with its technologies and services being discovered.
+    void networkManagerReady();
+
+private Q_SLOTS:
+    void updateAvailableModes();
+    void onNetworkManagerAvailabilityChanged();
+
+private:
+    QString unavailabilityReason(uint mode, const EthernetGadgetOperation::Options &options, bool embeddedDHCP) const;
+
+    NetworkManager *m_manager;
+    bool m_networkManagerKnown;
+    Hardware m_hardware;
+    uint m_availableModes;
+};
+
+#endif // GADGETCAPABILITIES_H
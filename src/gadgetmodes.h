@@ -0,0 +1,54 @@
+#ifndef GADGETMODES_H
+#define GADGETMODES_H
+
+#include <HemeraCore/USBGadgetManager>
+
+#include <QtCore/QString>
+
+/**
+ * Modes this daemon implements on top of the ones the SDK knows about.
+ *
+ * They travel over D-Bus as plain mode bits, well above the SDK's own.
+ */
+namespace GadgetModes
+{
+
+/// A point-to-point link, just like EthernetP2P, over a CDC-NCM function.
+constexpr Hemera::USBGadgetManager::Mode EthernetNCM = static_cast<Hemera::USBGadgetManager::Mode>(1u << 16);
+/// A disk image, exposed through a mass_storage function.
+constexpr Hemera::USBGadgetManager::Mode MassStorage = static_cast<Hemera::USBGadgetManager::Mode>(1u << 17);
+/// Raw bulk endpoints, through a FunctionFS function, handed to local clients.
+constexpr Hemera::USBGadgetManager::Mode DataPipe = static_cast<Hemera::USBGadgetManager::Mode>(1u << 18);
+
+/// Whether @p mode is an Ethernet mode serving a point-to-point link, rather than tethering.
+inline bool isPointToPoint(Hemera::USBGadgetManager::Mode mode)
+{
+    return mode == Hemera::USBGadgetManager::Mode::EthernetP2P || mode == EthernetNCM;
+}
+
+inline bool isEthernet(Hemera::USBGadgetManager::Mode mode)
+{
+    return isPointToPoint(mode) || mode == Hemera::USBGadgetManager::Mode::EthernetTethering;
+}
+
+inline QString name(uint mode)
+{
+    switch (static_cast<Hemera::USBGadgetManager::Mode>(mode)) {
+        case Hemera::USBGadgetManager::Mode::EthernetP2P:
+            return QStringLiteral("EthernetP2P");
+        case Hemera::USBGadgetManager::Mode::EthernetTethering:
+            return QStringLiteral("EthernetTethering");
+        case EthernetNCM:
+            return QStringLiteral("EthernetNCM");
+        case MassStorage:
+            return QStringLiteral("MassStorage");
+        case DataPipe:
+            return QStringLiteral("DataPipe");
+        default:
+            return QString::number(mode);
+    }
+}
+
+}
+
+#endif // GADGETMODES_H
@@ -0,0 +1,38 @@
+#include "gadgetcapabilities.h"
+
+#include "configfsgadget.h"
+#include "kernelmodules.h"
+
+#include <QtCore/QStandardPaths>
+
+GadgetCapabilities::Hardware GadgetCapabilities::probeHardware()
+{
+    Hardware hardware;
+
+    hardware.udcs = ConfigFSGadget::availableUDCs();
+    for (const QString &module : { QStringLiteral("g_ether"), QStringLiteral("g_ncm") }) {
+        if (KernelModules::isAvailable(module)) {
+            hardware.legacyModules.append(module);
+        }
+    }
+
+    hardware.configFS = ConfigFSGadget::isSupported();
+    if (hardware.configFS) {
+        for (const QString &function : { QStringLiteral("ecm"), QStringLiteral("ncm"), QStringLiteral("rndis"), QStringLiteral("mass_storage") }) {
+            if (KernelModules::isAvailable(QStringLiteral("usb_f_") + function)) {
+                hardware.functions.append(function);
+            }
+        }
+        // FunctionFS is the one function whose module isn't named after it.
+        if (KernelModules::isAvailable(QStringLiteral("usb_f_fs"))) {
+            hardware.functions.append(QStringLiteral("ffs"));
+        }
+    }
+
+    // dnsmasq lives in sbin, which is not always in our PATH.
+    hardware.dnsmasq = !QStandardPaths::findExecutable(QStringLiteral("dnsmasq")).isEmpty() ||
+                       !QStandardPaths::findExecutable(QStringLiteral("dnsmasq"),
+                                                       { QStringLiteral("/usr/sbin"), QStringLiteral("/sbin") }).isEmpty();
+
+    return hardware;
+}
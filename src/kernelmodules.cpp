@@ -0,0 +1,148 @@
+#include "kernelmodules.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QGlobalStatic>
+
+#include <libkmod.h>
+
+#include <errno.h>
+#include <string.h>
+
+namespace {
+
+class KmodContext
+{
+public:
+    KmodContext()
+        : ctx(kmod_new(nullptr, nullptr))
+    {
+        // Load indexes once: every lookup afterwards does not need to hit the filesystem again.
+        if (ctx) {
+            kmod_load_resources(ctx);
+        }
+    }
+    ~KmodContext()
+    {
+        if (ctx) {
+            kmod_unref(ctx);
+        }
+    }
+
+    struct kmod_ctx *ctx;
+};
+
+}
+
+Q_GLOBAL_STATIC(KmodContext, kmodContext)
+
+static inline QString errorString(int error)
+{
+    return QString::fromLocal8Bit(strerror(error < 0 ? -error : error));
+}
+
+bool KernelModules::isLoaded(const QString &module)
+{
+    // Both loaded and built-in modules show up here, and in both cases there's nothing left to load.
+    return QDir(QStringLiteral("/sys/module/%1").arg(module)).exists();
+}
+
+bool KernelModules::isAvailable(const QString &module)
+{
+    if (isLoaded(module)) {
+        return true;
+    }
+
+    if (!kmodContext()->ctx) {
+        return false;
+    }
+
+    struct kmod_list *list = nullptr;
+    int err = kmod_module_new_from_lookup(kmodContext()->ctx, module.toLatin1().constData(), &list);
+    if (err < 0 || !list) {
+        return false;
+    }
+
+    kmod_module_unref_list(list);
+    return true;
+}
+
+QByteArray KernelModules::parameter(const QString &module, const QString &name)
+{
+    QFile file(QStringLiteral("/sys/module/%1/parameters/%2").arg(module, name));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    return file.readAll().trimmed();
+}
+
+bool KernelModules::load(const QString &module, QString *errorMessage)
+{
+    return load(module, QString(), errorMessage);
+}
+
+bool KernelModules::load(const QString &module, const QString &parameters, QString *errorMessage)
+{
+    if (!kmodContext()->ctx) {
+        *errorMessage = QStringLiteral("Could not create a kmod context.");
+        return false;
+    }
+
+    struct kmod_list *list = nullptr;
+    int err = kmod_module_new_from_lookup(kmodContext()->ctx, module.toLatin1().constData(), &list);
+    if (err < 0 || !list) {
+        *errorMessage = QStringLiteral("Could not find kernel module %1.").arg(module);
+        return false;
+    }
+
+    struct kmod_list *it;
+    kmod_list_foreach(it, list) {
+        struct kmod_module *mod = kmod_module_get_module(it);
+        // Resolves dependencies and applies options from modprobe.d, just like modprobe would. We were asked for this
+        // module explicitly, so the blacklist doesn't apply, as with modprobe.
+        err = kmod_module_probe_insert_module(mod, 0, parameters.isEmpty() ? nullptr : parameters.toLatin1().constData(),
+                                              nullptr, nullptr, nullptr);
+        kmod_module_unref(mod);
+        if (err != 0) {
+            break;
+        }
+    }
+    kmod_module_unref_list(list);
+
+    if (err < 0) {
+        *errorMessage = QStringLiteral("Could not load kernel module %1: %2").arg(module, errorString(err));
+        return false;
+    } else if (err > 0) {
+        // Nothing failed, but kmod chose not to insert it.
+        *errorMessage = QStringLiteral("Could not load kernel module %1: kmod skipped it (%2).").arg(module).arg(err);
+        return false;
+    }
+
+    return true;
+}
+
+bool KernelModules::unload(const QString &module, QString *errorMessage)
+{
+    if (!kmodContext()->ctx) {
+        *errorMessage = QStringLiteral("Could not create a kmod context.");
+        return false;
+    }
+
+    struct kmod_module *mod = nullptr;
+    int err = kmod_module_new_from_name(kmodContext()->ctx, module.toLatin1().constData(), &mod);
+    if (err < 0) {
+        *errorMessage = QStringLiteral("Could not find kernel module %1: %2").arg(module, errorString(err));
+        return false;
+    }
+
+    err = kmod_module_remove_module(mod, 0);
+    kmod_module_unref(mod);
+
+    if (err < 0) {
+        *errorMessage = QStringLiteral("Could not unload kernel module %1: %2").arg(module, errorString(err));
+        return false;
+    }
+
+    return true;
+}
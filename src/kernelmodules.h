@@ -0,0 +1,32 @@
+#ifndef KERNELMODULES_H
+#define KERNELMODULES_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+/**
+ * In-process kernel module management.
+ *
+ * Checks are done against sysfs, loading and unloading go through libkmod, which honors modprobe.d
+ * (and hence the MAC address options generated by gadget-mac-address.service). No process is ever spawned.
+ */
+class KernelModules
+{
+public:
+    static bool isLoaded(const QString &module);
+    /// Whether the module is loaded or can be loaded.
+    static bool isAvailable(const QString &module);
+
+    /// The current value of a module parameter, as exposed in sysfs.
+    static QByteArray parameter(const QString &module, const QString &name);
+
+    static bool load(const QString &module, QString *errorMessage);
+    /// Loads @p module with @p parameters on top of those from modprobe.d.
+    static bool load(const QString &module, const QString &parameters, QString *errorMessage);
+    static bool unload(const QString &module, QString *errorMessage);
+
+private:
+    KernelModules() = delete;
+};
+
+#endif // KERNELMODULES_H
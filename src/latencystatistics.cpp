@@ -0,0 +1,110 @@
+#include "latencystatistics.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QSaveFile>
+
+#include <algorithm>
+
+LatencyStatistics::LatencyStatistics(int windowSize)
+    : m_windowSize(windowSize)
+{
+}
+
+void LatencyStatistics::record(const QString &series, qint64 usecs)
+{
+    Series &s = m_series[series];
+
+    if (s.samples.size() < m_windowSize) {
+        s.samples.append(usecs);
+    } else {
+        s.samples[s.next] = usecs;
+    }
+    s.next = (s.next + 1) % m_windowSize;
+
+    ++s.count;
+    s.max = qMax(s.max, usecs);
+}
+
+QVariantMap LatencyStatistics::toVariantMap() const
+{
+    QVariantMap result;
+
+    for (QHash< QString, Series >::const_iterator i = m_series.constBegin(); i != m_series.constEnd(); ++i) {
+        QVector< qint64 > sorted = i.value().samples;
+        std::sort(sorted.begin(), sorted.end());
+
+        auto percentile = [&sorted] (int p) -> qint64 {
+            return sorted.at(qMin(sorted.size() - 1, (sorted.size() * p) / 100));
+        };
+
+        QVariantMap series;
+        series.insert(QStringLiteral("count"), i.value().count);
+        series.insert(QStringLiteral("p50"), percentile(50));
+        series.insert(QStringLiteral("p95"), percentile(95));
+        series.insert(QStringLiteral("p99"), percentile(99));
+        series.insert(QStringLiteral("max"), i.value().max);
+        result.insert(i.key(), series);
+    }
+
+    return result;
+}
+
+bool LatencyStatistics::save(const QString &path, QString *errorMessage) const
+{
+    QJsonObject statistics;
+    for (QHash< QString, Series >::const_iterator i = m_series.constBegin(); i != m_series.constEnd(); ++i) {
+        // Oldest first, so that a different window size on the way back in keeps the most recent ones.
+        QJsonArray samples;
+        const QVector< qint64 > &ring = i.value().samples;
+        int first = ring.size() < m_windowSize ? 0 : i.value().next;
+        for (int n = 0; n < ring.size(); ++n) {
+            samples.append(static_cast<double>(ring.at((first + n) % ring.size())));
+        }
+
+        QJsonObject series;
+        series.insert(QStringLiteral("samples"), samples);
+        series.insert(QStringLiteral("count"), static_cast<double>(i.value().count));
+        series.insert(QStringLiteral("max"), static_cast<double>(i.value().max));
+        statistics.insert(i.key(), series);
+    }
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(statistics).toJson(QJsonDocument::Compact)) < 0 || !file.commit()) {
+        *errorMessage = QStringLiteral("Could not write latency statistics to %1: %2").arg(path, file.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+void LatencyStatistics::load(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QJsonObject statistics = QJsonDocument::fromJson(file.readAll()).object();
+    for (QJsonObject::const_iterator i = statistics.constBegin(); i != statistics.constEnd(); ++i) {
+        QJsonObject series = i.value().toObject();
+        QJsonArray samples = series.value(QStringLiteral("samples")).toArray();
+        if (samples.isEmpty()) {
+            continue;
+        }
+        for (const QJsonValue &sample : samples) {
+            record(i.key(), static_cast<qint64>(sample.toDouble()));
+        }
+
+        // Counts and maxima cover more than the window.
+        Series &s = m_series[i.key()];
+        s.count = qMax(s.count, static_cast<quint64>(series.value(QStringLiteral("count")).toDouble()));
+        s.max = qMax(s.max, static_cast<qint64>(series.value(QStringLiteral("max")).toDouble()));
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef LATENCYSTATISTICS_H
+#define LATENCYSTATISTICS_H
+
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QVariantMap>
+#include <QtCore/QVector>
+
+/**
+ * Rolling latency histograms.
+ *
+ * Every series keeps its last samples in a fixed-size ring, percentiles are computed only when asked for.
+ */
+class LatencyStatistics
+{
+public:
+    explicit LatencyStatistics(int windowSize = 512);
+
+    void record(const QString &series, qint64 usecs);
+
+    /// Maps every series to its count, p50, p95, p99 and max, in microseconds.
+    QVariantMap toVariantMap() const;
+
+    /// Samples outlive the daemon through @p path, so that idle exits don't reset them.
+    bool save(const QString &path, QString *errorMessage) const;
+    /// Leaves the statistics empty if @p path can't be read.
+    void load(const QString &path);
+
+private:
+    struct Series {
+        Series() : next(0), count(0), max(0) {}
+
+        QVector< qint64 > samples;
+        int next;
+        quint64 count;
+        qint64 max;
+    };
+
+    int m_windowSize;
+    QHash< QString, Series > m_series;
+};
+
+#endif // LATENCYSTATISTICS_H
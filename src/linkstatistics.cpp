@@ -0,0 +1,164 @@
+#include "linkstatistics.h"
+
+#include "rtnetlink.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QTimer>
+
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+#include <net/if.h>
+
+#include <stddef.h>
+#include <string.h>
+
+/* 1 second */
+constexpr int samplingInterval() { return 1000; }
+
+LinkStatistics::LinkStatistics(int window, int signalInterval, QObject *parent)
+    : QObject(parent)
+    , m_window(qMax(window, samplingInterval()))
+    , m_signalInterval(signalInterval)
+    , m_rtnetlink(new RtNetlink)
+    , m_sampleTimer(new QTimer(this))
+    , m_lastSignal(0)
+    , m_readFailed(false)
+{
+    m_sampleTimer->setInterval(samplingInterval());
+    connect(m_sampleTimer, &QTimer::timeout, this, &LinkStatistics::sample);
+    m_clock.start();
+}
+
+LinkStatistics::~LinkStatistics()
+{
+    delete m_rtnetlink;
+}
+
+void LinkStatistics::setInterfaceName(const QString &interfaceName)
+{
+    if (interfaceName == m_interfaceName) {
+        return;
+    }
+
+    m_interfaceName = interfaceName;
+    m_samples.clear();
+    m_readFailed = false;
+
+    if (m_interfaceName.isEmpty()) {
+        m_sampleTimer->stop();
+        return;
+    }
+
+    sample();
+    m_sampleTimer->start();
+}
+
+bool LinkStatistics::read(Counters *counters, QString *errorMessage)
+{
+    if (!m_rtnetlink->open(errorMessage)) {
+        return false;
+    }
+
+    struct ifinfomsg request;
+    memset(&request, 0, sizeof(request));
+    request.ifi_family = AF_UNSPEC;
+    request.ifi_index = if_nametoindex(m_interfaceName.toLatin1().constData());
+    if (request.ifi_index == 0) {
+        *errorMessage = QStringLiteral("There is no interface named %1.").arg(m_interfaceName);
+        return false;
+    }
+
+    QList< QByteArray > replies;
+    if (!m_rtnetlink->transact(RtNetlink::message(RTM_GETLINK, 0, &request, sizeof(request)), &replies, errorMessage)) {
+        return false;
+    }
+
+    // Every counter comes in this one attribute.
+    QByteArray stats = replies.isEmpty() ? QByteArray() : RtNetlink::attribute(replies.first(), sizeof(struct ifinfomsg), IFLA_STATS64);
+    if (stats.size() < static_cast<int>(offsetof(struct rtnl_link_stats64, tx_dropped) + sizeof(__u64))) {
+        *errorMessage = QStringLiteral("The kernel reported no statistics for %1.").arg(m_interfaceName);
+        return false;
+    }
+
+    struct rtnl_link_stats64 link;
+    memset(&link, 0, sizeof(link));
+    memcpy(&link, stats.constData(), qMin(stats.size(), static_cast<int>(sizeof(link))));
+
+    counters->rxBytes = link.rx_bytes;
+    counters->txBytes = link.tx_bytes;
+    counters->rxPackets = link.rx_packets;
+    counters->txPackets = link.tx_packets;
+    counters->rxErrors = link.rx_errors;
+    counters->txErrors = link.tx_errors;
+    counters->rxDropped = link.rx_dropped;
+    counters->txDropped = link.tx_dropped;
+    return true;
+}
+
+void LinkStatistics::sample()
+{
+    Counters counters;
+    QString errorMessage;
+    if (!read(&counters, &errorMessage)) {
+        // Once is enough: the interface might just be going away.
+        if (!m_readFailed) {
+            qWarning() << "Could not sample link statistics:" << errorMessage;
+            m_readFailed = true;
+        }
+        return;
+    }
+    m_readFailed = false;
+
+    qint64 now = m_clock.elapsed();
+    m_samples.append(qMakePair(now, counters));
+    while (m_samples.size() > 2 && now - m_samples.at(1).first >= m_window) {
+        m_samples.removeFirst();
+    }
+
+    if (now - m_lastSignal < m_signalInterval && m_lastSignal > 0) {
+        return;
+    }
+
+    if (memcmp(&counters, &m_lastSignalCounters, sizeof(Counters)) != 0) {
+        m_lastSignal = now;
+        m_lastSignalCounters = counters;
+        Q_EMIT updated();
+    }
+}
+
+QVariantMap LinkStatistics::toVariantMap() const
+{
+    QVariantMap statistics;
+    if (m_interfaceName.isEmpty() || m_samples.isEmpty()) {
+        return statistics;
+    }
+
+    const QPair< qint64, Counters > &first = m_samples.first();
+    const QPair< qint64, Counters > &last = m_samples.last();
+    double seconds = (last.first - first.first) / 1000.0;
+
+    struct Counter {
+        const char *name;
+        quint64 Counters::*member;
+    };
+    static const Counter counters[] = {
+        { "rxBytes", &Counters::rxBytes }, { "txBytes", &Counters::txBytes },
+        { "rxPackets", &Counters::rxPackets }, { "txPackets", &Counters::txPackets },
+        { "rxErrors", &Counters::rxErrors }, { "txErrors", &Counters::txErrors },
+        { "rxDropped", &Counters::rxDropped }, { "txDropped", &Counters::txDropped }
+    };
+
+    statistics.insert(QStringLiteral("interface"), m_interfaceName);
+    statistics.insert(QStringLiteral("window"), static_cast<uint>(last.first - first.first));
+    for (const Counter &counter : counters) {
+        quint64 value = last.second.*counter.member;
+        statistics.insert(QLatin1String(counter.name), value);
+        // Counters only go backwards if the interface was recreated under us: that's no traffic to speak of.
+        quint64 start = first.second.*counter.member;
+        statistics.insert(QLatin1String(counter.name) + QStringLiteral("PerSecond"),
+                          seconds > 0 && value >= start ? (value - start) / seconds : 0.0);
+    }
+
+    return statistics;
+}
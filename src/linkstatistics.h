@@ -0,0 +1,74 @@
+#ifndef LINKSTATISTICS_H
+#define LINKSTATISTICS_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QVariantMap>
+
+class QTimer;
+
+class RtNetlink;
+
+/**
+ * Traffic counters and rates of the gadget network interface.
+ *
+ * All counters are read at once with a single rtnetlink RTM_GETLINK request, once a second and only while there's an
+ * interface to watch. Rates are computed over a sliding window.
+ */
+class LinkStatistics : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(LinkStatistics)
+
+public:
+    struct Counters {
+        Counters() : rxBytes(0), txBytes(0), rxPackets(0), txPackets(0), rxErrors(0), txErrors(0), rxDropped(0), txDropped(0) {}
+
+        quint64 rxBytes;
+        quint64 txBytes;
+        quint64 rxPackets;
+        quint64 txPackets;
+        quint64 rxErrors;
+        quint64 txErrors;
+        quint64 rxDropped;
+        quint64 txDropped;
+    };
+
+    /// Rates are computed over @p window ms, updated() is emitted at most every @p signalInterval ms.
+    explicit LinkStatistics(int window, int signalInterval, QObject *parent = nullptr);
+    virtual ~LinkStatistics();
+
+    /// Starts sampling @p interfaceName, or stops sampling altogether if it is empty.
+    void setInterfaceName(const QString &interfaceName);
+    inline QString interfaceName() const { return m_interfaceName; }
+
+    /// The interface, the latest counters and their rates per second over the window. Empty if there's no interface.
+    QVariantMap toVariantMap() const;
+
+Q_SIGNALS:
+    /// Counters moved since the last time. Rate-limited.
+    void updated();
+
+private Q_SLOTS:
+    void sample();
+
+private:
+    bool read(Counters *counters, QString *errorMessage);
+
+    int m_window;
+    int m_signalInterval;
+
+    RtNetlink *m_rtnetlink;
+    QString m_interfaceName;
+    QTimer *m_sampleTimer;
+    QElapsedTimer m_clock;
+    /// Oldest first, spanning the window.
+    QList< QPair< qint64, Counters > > m_samples;
+    qint64 m_lastSignal;
+    Counters m_lastSignalCounters;
+    bool m_readFailed;
+};
+
+#endif // LINKSTATISTICS_H
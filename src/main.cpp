@@ -1,4 +1,5 @@
 #include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
 
 #include <HemeraCore/Operation>
 
@@ -8,9 +9,13 @@
 
 int main(int argc, char **argv)
 {
+    // We're D-Bus activated: whatever we spend from here on, the first caller waits for.
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+
     QCoreApplication app(argc, argv);
 
-    USBGadgetManagerService *usbGadgetManagerService = new USBGadgetManagerService;
+    USBGadgetManagerService *usbGadgetManagerService = new USBGadgetManagerService(startupTimer);
 
     QObject::connect(usbGadgetManagerService->init(), &Hemera::Operation::finished, [] (Hemera::Operation *op) {
         if (op->isError()) {
@@ -0,0 +1,223 @@
+#include "massstorageoperations.h"
+
+#include "fatimagebuilder.h"
+#include "gadgetmodes.h"
+
+#include <HemeraCore/Literals>
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QTimer>
+
+#include <sys/stat.h>
+
+#define IMAGE_DIRECTORY "/var/lib/gravity-usb-gadget-manager/images"
+
+/* 8 MiB */
+constexpr qint64 imageBuildBudget() { return 8 * 1024 * 1024; }
+
+static QString imageDirectory()
+{
+    QString path = QString::fromLocal8Bit(qgetenv("GRAVITY_USB_GADGET_IMAGE_DIRECTORY"));
+    return QFileInfo(path.isEmpty() ? QStringLiteral(IMAGE_DIRECTORY) : path).canonicalFilePath();
+}
+
+static bool isInside(const QString &path, const QString &directory)
+{
+    return path.startsWith(directory + QLatin1Char('/'));
+}
+
+static bool isAllowedBlockDevice(const QString &path)
+{
+    for (const QString &device : QString::fromLocal8Bit(qgetenv("GRAVITY_USB_GADGET_BLOCK_DEVICES")).split(QLatin1Char(':'), QString::SkipEmptyParts)) {
+        if (QFileInfo(device).canonicalFilePath() == path) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static ConfigFSGadget::Function massStorageFunction()
+{
+    return ConfigFSGadget::Function(QStringLiteral("mass_storage"), QStringLiteral("0"));
+}
+
+ActivateMassStorageGadget::ActivateMassStorageGadget(const Options &options, QObject *parent)
+    : EthernetGadgetOperation(GadgetModes::MassStorage, options, parent)
+    , m_builder(nullptr)
+{
+    if (!options.imageSource.isEmpty()) {
+        m_plan << Stage::BuildingImage;
+    }
+    m_plan << Stage::ConfiguringGadget;
+}
+
+ActivateMassStorageGadget::~ActivateMassStorageGadget()
+{
+    delete m_builder;
+}
+
+bool ActivateMassStorageGadget::resolveImagePaths(Options *options, QString *errorMessage)
+{
+    QString directory = imageDirectory();
+    QString shownDirectory = directory.isEmpty() ? QStringLiteral("the image directory") : directory;
+
+    if (!options->imageSource.isEmpty()) {
+        QString source = QFileInfo(options->imageSource).canonicalFilePath();
+        if (directory.isEmpty() || source.isEmpty() || !isInside(source, directory) || !QFileInfo(source).isDir()) {
+            *errorMessage = QStringLiteral("directory must be an existing directory within %1.").arg(shownDirectory);
+            return false;
+        }
+        options->imageSource = source;
+    }
+
+    if (options->image.isEmpty()) {
+        return true;
+    }
+
+    QString image = QFileInfo(options->image).canonicalFilePath();
+    if (image.isEmpty()) {
+        // Not there yet: fine for an image we are about to build, in a directory we may write to.
+        QFileInfo info(options->image);
+        QString parent = QFileInfo(info.absolutePath()).canonicalFilePath();
+        if (options->imageSource.isEmpty() || directory.isEmpty() || parent.isEmpty() ||
+            (parent != directory && !isInside(parent, directory)) || info.fileName().isEmpty()) {
+            *errorMessage = QStringLiteral("file must be an existing image within %1, or one to build there.").arg(shownDirectory);
+            return false;
+        }
+        options->image = parent + QLatin1Char('/') + info.fileName();
+        return true;
+    }
+
+    struct stat status;
+    if (::stat(QFile::encodeName(image).constData(), &status) < 0) {
+        *errorMessage = QStringLiteral("Could not inspect %1.").arg(options->image);
+        return false;
+    }
+
+    // Devices are never built over, and only exposed when the configuration names them.
+    if (S_ISBLK(status.st_mode)) {
+        if (!options->imageSource.isEmpty() || !isAllowedBlockDevice(image)) {
+            *errorMessage = QStringLiteral("%1 is a block device which is not allowed in GRAVITY_USB_GADGET_BLOCK_DEVICES.").arg(options->image);
+            return false;
+        }
+    } else if (!S_ISREG(status.st_mode) || directory.isEmpty() || !isInside(image, directory)) {
+        *errorMessage = QStringLiteral("file must be a regular file within %1.").arg(shownDirectory);
+        return false;
+    } else if (!options->imageSource.isEmpty() && !FatImageBuilder::isBuiltImage(image)) {
+        *errorMessage = QStringLiteral("%1 already exists, and is not an image built from a directory: it won't be replaced.").arg(options->image);
+        return false;
+    }
+
+    options->image = image;
+    return true;
+}
+
+void ActivateMassStorageGadget::startImpl()
+{
+    if (m_options.imageSource.isEmpty()) {
+        configureGadget();
+    } else {
+        buildImage();
+    }
+}
+
+void ActivateMassStorageGadget::buildImage()
+{
+    setStage(Stage::BuildingImage);
+
+    m_builder = new FatImageBuilder(m_options.imageSource, m_options.image, m_options.imageSize);
+
+    QString errorMessage;
+    if (!m_builder->start(&errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                             QStringLiteral("Could not build the disk image: %1").arg(errorMessage));
+        return;
+    }
+
+    QTimer::singleShot(0, this, &ActivateMassStorageGadget::writeImageData);
+}
+
+void ActivateMassStorageGadget::writeImageData()
+{
+    // Every chunk is a stage boundary.
+    if (isCancelRequested()) {
+        failCanceled();
+        return;
+    }
+
+    bool done;
+    QString errorMessage;
+    if (!m_builder->writeData(imageBuildBudget(), &done, &errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                             QStringLiteral("Could not build the disk image: %1").arg(errorMessage));
+        return;
+    } else if (!done) {
+        QTimer::singleShot(0, this, &ActivateMassStorageGadget::writeImageData);
+        return;
+    }
+
+    delete m_builder;
+    m_builder = nullptr;
+    configureGadget();
+}
+
+void ActivateMassStorageGadget::configureGadget()
+{
+    setStage(Stage::ConfiguringGadget);
+
+    if (!QFile::exists(m_options.image)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                             QStringLiteral("The disk image %1 does not exist.").arg(m_options.image));
+        return;
+    }
+
+    // The kernel opens the image as soon as it's given one, honoring the flags set by then: they go first, on a fresh function.
+    ConfigFSGadget::Function function = massStorageFunction();
+    function.attributes.insert(QStringLiteral("lun.0/ro"), m_options.readOnly ? "1" : "0");
+    function.attributes.insert(QStringLiteral("lun.0/removable"), m_options.removable ? "1" : "0");
+    function.attributes.insert(QStringLiteral("lun.0/nofua"), m_options.noFUA ? "1" : "0");
+
+    QString errorMessage;
+    ConfigFSGadget gadget = configFSGadget(m_options);
+    if (!gadget.prepare(&errorMessage) || !gadget.unbind(&errorMessage) ||
+        !gadget.setFunctions(QList< ConfigFSGadget::Function >(), &errorMessage) ||
+        !gadget.setFunctions(QList< ConfigFSGadget::Function >() << function, &errorMessage) ||
+        !gadget.setFunctionAttribute(function, QStringLiteral("lun.0/file"), QFile::encodeName(m_options.image), &errorMessage) ||
+        !gadget.bind(m_options.udc, &errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+        return;
+    }
+
+    setStage(Stage::Completed);
+    setFinished();
+}
+
+///////////////////
+
+DeactivateMassStorageGadget::DeactivateMassStorageGadget(const Options &options, QObject *parent)
+    : EthernetGadgetOperation(GadgetModes::MassStorage, options, parent)
+{
+    m_plan << Stage::UnbindingGadget;
+}
+
+DeactivateMassStorageGadget::~DeactivateMassStorageGadget()
+{
+}
+
+void DeactivateMassStorageGadget::startImpl()
+{
+    setStage(Stage::UnbindingGadget);
+
+    // Unlike network functions, this one goes away: it holds the image open, and whoever asked for it wants it back.
+    QString errorMessage;
+    ConfigFSGadget gadget = configFSGadget(m_options);
+    if (!gadget.unbind(&errorMessage) || !gadget.setFunctions(QList< ConfigFSGadget::Function >(), &errorMessage)) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+        return;
+    }
+
+    setStage(Stage::Completed);
+    setFinished();
+}
@@ -0,0 +1,54 @@
+#ifndef MASSSTORAGEOPERATIONS_H
+#define MASSSTORAGEOPERATIONS_H
+
+#include "ethernetgadgetoperations.h"
+
+class FatImageBuilder;
+
+/**
+ * Exposes a disk image through the mass_storage function of the ConfigFS gadget, building it first if asked to.
+ *
+ * Building runs on our event loop, a chunk at a time: requests keep being served meanwhile, and a Deactivate can cancel it.
+ */
+class ActivateMassStorageGadget : public EthernetGadgetOperation
+{
+    Q_OBJECT
+
+public:
+    explicit ActivateMassStorageGadget(const Options &options = Options(), QObject *parent = nullptr);
+    virtual ~ActivateMassStorageGadget();
+
+    /**
+     * Resolves the image and its source directory in @p options to canonical paths, and checks we may use them.
+     *
+     * Both must sit in the image directory, GRAVITY_USB_GADGET_IMAGE_DIRECTORY: callers are not trusted with the rest of
+     * the filesystem. Images are regular files, or block devices listed in GRAVITY_USB_GADGET_BLOCK_DEVICES. An image
+     * about to be built may not exist yet, but it only ever replaces one built here before.
+     */
+    static bool resolveImagePaths(Options *options, QString *errorMessage);
+
+protected:
+    virtual void startImpl();
+
+private Q_SLOTS:
+    void buildImage();
+    void writeImageData();
+    void configureGadget();
+
+private:
+    FatImageBuilder *m_builder;
+};
+
+class DeactivateMassStorageGadget : public EthernetGadgetOperation
+{
+    Q_OBJECT
+
+public:
+    explicit DeactivateMassStorageGadget(const Options &options = Options(), QObject *parent = nullptr);
+    virtual ~DeactivateMassStorageGadget();
+
+protected:
+    virtual void startImpl();
+};
+
+#endif // MASSSTORAGEOPERATIONS_H
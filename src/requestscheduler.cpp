@@ -0,0 +1,257 @@
+#include "requestscheduler.h"
+
+#include <HemeraCore/Literals>
+
+#include <QtCore/QDebug>
+
+/* Bursts beyond this are a client bug, not something worth queueing */
+constexpr int maxPendingRequests() { return 8; }
+
+RequestScheduler::RequestScheduler(const std::function<uint()> &activeMode, const Factory &factory, QObject *parent)
+    : QObject(parent)
+    , m_activeMode(activeMode)
+    , m_factory(factory)
+    , m_running(nullptr)
+{
+}
+
+RequestScheduler::~RequestScheduler()
+{
+}
+
+QString RequestScheduler::typeName(Type type)
+{
+    switch (type) {
+        case Type::Activate:
+            return QStringLiteral("Activate");
+        case Type::Deactivate:
+            return QStringLiteral("Deactivate");
+        case Type::SwitchMode:
+            return QStringLiteral("SwitchMode");
+        case Type::Prepare:
+            return QStringLiteral("Prepare");
+    }
+
+    return QString();
+}
+
+uint RequestScheduler::targetMode(const Request &request)
+{
+    return request.type == Type::Deactivate || request.type == Type::Prepare ? static_cast<uint>(Hemera::USBGadgetManager::Mode::None)
+                                                                              : request.mode;
+}
+
+RequestScheduler::Request *RequestScheduler::latestRequest()
+{
+    if (!m_queue.isEmpty()) {
+        return &m_queue.last();
+    } else if (m_running) {
+        return &m_runningRequest;
+    }
+
+    return nullptr;
+}
+
+uint RequestScheduler::projectedMode() const
+{
+    if (!m_queue.isEmpty()) {
+        return targetMode(m_queue.last());
+    } else if (m_running) {
+        return targetMode(m_runningRequest);
+    }
+
+    return m_activeMode();
+}
+
+EthernetGadgetOperation::Options RequestScheduler::projectedOptions(const EthernetGadgetOperation::Options &active) const
+{
+    if (!m_queue.isEmpty()) {
+        return m_queue.last().options;
+    } else if (m_running) {
+        return m_runningRequest.options;
+    }
+
+    return active;
+}
+
+void RequestScheduler::replyAll(const Request &request, const QString &errorName, const QString &errorMessage)
+{
+    for (const Reply &reply : request.replies) {
+        reply(errorName, errorMessage);
+    }
+}
+
+void RequestScheduler::schedule(Type type, uint mode, const EthernetGadgetOperation::Options &options, const Reply &reply)
+{
+    // Asking for what was already asked for? Ride along.
+    Request *latest = latestRequest();
+    if (latest && latest->type == type && (latest != &m_runningRequest || !m_running->isCancelRequested()) &&
+        (type == Type::Deactivate || (latest->mode == mode && latest->options == options))) {
+        latest->replies << reply;
+        return;
+    }
+
+    uint projected = projectedMode();
+
+    switch (type) {
+        case Type::Activate:
+            if (projected != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                reply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                      QStringLiteral("You have requested activation, but there's already an active mode on the USB Gadget. "
+                                     "Call Deactivate first, then retry."));
+                return;
+            }
+
+            // Retrying picks up where the failed attempt stopped. Anything else reconciles only what it knows about:
+            // the leftovers go first.
+            if (hasResidue() && m_queue.isEmpty() && !m_running &&
+                (m_residue.mode != mode || m_residue.options.backend != options.backend || m_residue.options.network != options.network ||
+                 m_residue.options.function != options.function || m_residue.options.udc != options.udc)) {
+                queueRollback(m_residue.mode, m_residue.options, QList< Reply >());
+            }
+            break;
+        case Type::Prepare:
+            if (projected != static_cast<uint>(Hemera::USBGadgetManager::Mode::None) || !m_queue.isEmpty() || m_running) {
+                // Whatever comes first brings the gadget up anyway, or down for a reason.
+                reply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                      QStringLiteral("The USB Gadget can be prepared only while nothing else is scheduled on it."));
+                return;
+            }
+            break;
+        case Type::SwitchMode:
+            // Already there? Same mode with other link settings is a switch still: the reconciler reapplies them. Against
+            // the active mode rather than a scheduled one, the factory tells.
+            if (projected == mode && latest && latest->options == options) {
+                reply(QString(), QString());
+                return;
+            }
+            break;
+        case Type::Deactivate:
+            if (projected == static_cast<uint>(Hemera::USBGadgetManager::Mode::None) && hasResidue() && m_queue.isEmpty() && !m_running) {
+                qDebug() << "Cleaning up after the failed activation of mode" << m_residue.mode;
+                queueRollback(m_residue.mode, m_residue.options, QList< Reply >() << reply);
+                runNext();
+                return;
+            } else if (projected == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                reply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                      QStringLiteral("You have requested deactivation, but there's no active modes on the USB Gadget."));
+                return;
+            }
+
+            // Whatever is still waiting to bring something up is moot.
+            while (!m_queue.isEmpty() && m_queue.last().type != Type::Deactivate) {
+                replyAll(m_queue.takeLast(), Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                         QStringLiteral("This request was superseded by a Deactivate request."));
+            }
+
+            if (projectedMode() == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                // Activate, then Deactivate: nothing to do at all.
+                reply(QString(), QString());
+                return;
+            } else if (!m_queue.isEmpty()) {
+                m_queue.last().replies << reply;
+                return;
+            }
+
+            // If it's an activation we're running, stop it and clean up what it did so far.
+            if (m_running && m_runningRequest.type != Type::Deactivate) {
+                qDebug() << "Canceling the running operation, a Deactivate request supersedes it.";
+                m_running->cancel();
+                queueRollback(m_runningRequest.mode, m_runningRequest.options, QList< Reply >() << reply);
+                return;
+            }
+            break;
+    }
+
+    if (m_queue.size() >= maxPendingRequests()) {
+        reply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+              QStringLiteral("Too many requests are pending on the USB Gadget. Retry later."));
+        return;
+    }
+
+    Request request;
+    request.type = type;
+    request.mode = mode;
+    request.options = options;
+    request.replies << reply;
+    m_queue.append(request);
+
+    if (!m_running) {
+        runNext();
+    }
+}
+
+void RequestScheduler::queueRollback(uint mode, const EthernetGadgetOperation::Options &options, const QList< Reply > &replies)
+{
+    Request request;
+    request.type = Type::Deactivate;
+    request.mode = mode;
+    request.options = options;
+    request.rollback = true;
+    request.replies = replies;
+    m_queue.append(request);
+}
+
+bool RequestScheduler::cancel()
+{
+    if (!m_running || m_running->isCancelRequested()) {
+        return false;
+    }
+
+    m_running->cancel();
+    return true;
+}
+
+void RequestScheduler::runNext()
+{
+    while (!m_queue.isEmpty()) {
+        Request request = m_queue.takeFirst();
+
+        QString errorMessage;
+        EthernetGadgetOperation *op = m_factory(request, &errorMessage);
+        if (!op) {
+            if (errorMessage.isEmpty()) {
+                replyAll(request, QString(), QString());
+            } else {
+                replyAll(request, Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()), errorMessage);
+            }
+            continue;
+        }
+
+        m_running = op;
+        m_runningRequest = request;
+        connect(op, &Hemera::Operation::finished, this, &RequestScheduler::onOperationFinished);
+        return;
+    }
+
+    // However we got here, with requests which turned out to need nothing or with none at all, that's it.
+    Q_EMIT idle();
+}
+
+void RequestScheduler::onOperationFinished()
+{
+    EthernetGadgetOperation *op = m_running;
+    Request request = m_runningRequest;
+
+    m_running = nullptr;
+    m_runningRequest = Request();
+
+    // Failed Deactivates and SwitchModes leave a mode active, which is what cleans them up. Preparing cleans up nothing.
+    if (op->isError() && (request.type == Type::Activate || request.rollback)) {
+        m_residue = request;
+        m_residue.replies.clear();
+    } else if (!op->isError() && request.type != Type::Prepare) {
+        m_residue = Request();
+    }
+
+    if (op->isError()) {
+        replyAll(request, op->errorName(), op->errorMessage());
+    } else {
+        replyAll(request, QString(), QString());
+    }
+
+    // Nothing refers to a finished operation past its finished handlers: without this, every request would stay around for good.
+    op->deleteLater();
+
+    runNext();
+}
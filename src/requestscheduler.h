@@ -0,0 +1,96 @@
+#ifndef REQUESTSCHEDULER_H
+#define REQUESTSCHEDULER_H
+
+#include "ethernetgadgetoperations.h"
+
+#include <QtCore/QList>
+#include <QtCore/QObject>
+
+#include <functional>
+
+/**
+ * Serializes Activate, Deactivate, SwitchMode and Prepare requests.
+ *
+ * Only one operation touches the gadget at any given time. Requests coming in meanwhile are queued, after being
+ * checked against the mode the gadget will be in once everything before them went through: requests for the same
+ * target ride along with the one already scheduled, and a Deactivate cancels out whatever activation is still pending.
+ *
+ * An activation which fails leaves behind whatever it got done. The scheduler remembers it: a Deactivate, although there
+ * is no active mode, cleans it up, and so does an activation which would not.
+ */
+class RequestScheduler : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RequestScheduler)
+
+public:
+    enum class Type : quint8 {
+        Activate = 0,
+        Deactivate,
+        SwitchMode,
+        /// Brings the gadget up for the host to enumerate, with no mode active.
+        Prepare
+    };
+
+    /// Called exactly once for every scheduled request. The error name is empty on success.
+    typedef std::function<void(const QString &errorName, const QString &errorMessage)> Reply;
+
+    struct Request {
+        Request() : type(Type::Activate), mode(0), rollback(false) {}
+
+        Type type;
+        /// The mode to bring up or, for a Deactivate, the one to bring down.
+        uint mode;
+        EthernetGadgetOperation::Options options;
+        /// The Deactivate cleans up after an interrupted operation.
+        bool rollback;
+        QList< Reply > replies;
+    };
+
+    /// Creates the operation serving @p request when its turn comes. Returning nullptr with no error means there's nothing to do.
+    typedef std::function<EthernetGadgetOperation*(const Request &request, QString *errorMessage)> Factory;
+
+    explicit RequestScheduler(const std::function<uint()> &activeMode, const Factory &factory, QObject *parent = nullptr);
+    virtual ~RequestScheduler();
+
+    void schedule(Type type, uint mode, const EthernetGadgetOperation::Options &options, const Reply &reply);
+    /// Cancels the running operation at its next stage boundary. Queued requests are left alone. Returns false if nothing runs.
+    bool cancel();
+
+    inline bool isIdle() const { return !m_running; }
+    inline EthernetGadgetOperation *runningOperation() const { return m_running; }
+    inline Type runningType() const { return m_runningRequest.type; }
+    inline int pendingRequests() const { return m_queue.size(); }
+
+    /// The mode the gadget will be in once everything scheduled went through.
+    uint projectedMode() const;
+    /// The options the gadget will run with once everything scheduled went through, @p active if nothing is.
+    EthernetGadgetOperation::Options projectedOptions(const EthernetGadgetOperation::Options &active) const;
+    /// Whether a failed activation left something behind, which nothing scheduled cleans up.
+    inline bool hasResidue() const { return m_residue.mode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None); }
+
+    static QString typeName(Type type);
+
+Q_SIGNALS:
+    /// The last scheduled request went through.
+    void idle();
+
+private:
+    void runNext();
+    void onOperationFinished();
+
+    Request *latestRequest();
+    static uint targetMode(const Request &request);
+    static void replyAll(const Request &request, const QString &errorName, const QString &errorMessage);
+    void queueRollback(uint mode, const EthernetGadgetOperation::Options &options, const QList< Reply > &replies);
+
+    std::function<uint()> m_activeMode;
+    Factory m_factory;
+
+    EthernetGadgetOperation *m_running;
+    Request m_runningRequest;
+    QList< Request > m_queue;
+    Request m_residue;
+};
+
+#endif // REQUESTSCHEDULER_H
@@ -0,0 +1,339 @@
+#include "rtnetlink.h"
+
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QtEndian>
+
+#include <linux/if_addr.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+RtNetlink::RtNetlink()
+    : m_socket(-1)
+    , m_sequence(0)
+{
+}
+
+RtNetlink::~RtNetlink()
+{
+    if (m_socket >= 0) {
+        ::close(m_socket);
+    }
+}
+
+bool RtNetlink::open(QString *errorMessage)
+{
+    if (m_socket >= 0) {
+        return true;
+    }
+
+    m_socket = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_socket < 0) {
+        *errorMessage = QStringLiteral("Could not create a rtnetlink socket: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    if (::bind(m_socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        *errorMessage = QStringLiteral("Could not bind the rtnetlink socket: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        ::close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    return true;
+}
+
+QByteArray RtNetlink::message(quint16 type, quint16 flags, const void *header, int headerSize)
+{
+    QByteArray message(NLMSG_SPACE(headerSize), '\0');
+
+    struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr*>(message.data());
+    nlh->nlmsg_len = NLMSG_LENGTH(headerSize);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = flags;
+    memcpy(NLMSG_DATA(nlh), header, headerSize);
+
+    return message;
+}
+
+void RtNetlink::appendAttribute(QByteArray *message, quint16 type, const void *data, int size)
+{
+    int offset = NLMSG_ALIGN(message->size());
+    message->resize(offset + RTA_SPACE(size));
+    memset(message->data() + offset, 0, RTA_SPACE(size));
+
+    struct rtattr *rta = reinterpret_cast<struct rtattr*>(message->data() + offset);
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(size);
+    memcpy(RTA_DATA(rta), data, size);
+
+    reinterpret_cast<struct nlmsghdr*>(message->data())->nlmsg_len = message->size();
+}
+
+QByteArray RtNetlink::attribute(const QByteArray &message, int headerSize, quint16 type)
+{
+    const struct nlmsghdr *nlh = reinterpret_cast<const struct nlmsghdr*>(message.constData());
+    int length = nlh->nlmsg_len - NLMSG_LENGTH(headerSize);
+    const struct rtattr *rta = reinterpret_cast<const struct rtattr*>(static_cast<const char*>(NLMSG_DATA(nlh)) + NLMSG_ALIGN(headerSize));
+
+    for (; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == type) {
+            return QByteArray(static_cast<const char*>(RTA_DATA(rta)), RTA_PAYLOAD(rta));
+        }
+    }
+
+    return QByteArray();
+}
+
+bool RtNetlink::transact(QByteArray request, QList< QByteArray > *replies, QString *errorMessage)
+{
+    if (!open(errorMessage)) {
+        return false;
+    }
+
+    struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr*>(request.data());
+    nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq = ++m_sequence;
+
+    if (::send(m_socket, request.constData(), request.size(), 0) < 0) {
+        *errorMessage = QStringLiteral("Could not send the rtnetlink request: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    QVarLengthArray< char, 8192 > buffer(8192);
+    for (;;) {
+        ssize_t size = ::recv(m_socket, buffer.data(), buffer.size(), 0);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *errorMessage = QStringLiteral("Could not read the rtnetlink reply: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+
+        int length = size;
+        for (const struct nlmsghdr *reply = reinterpret_cast<const struct nlmsghdr*>(buffer.constData()); NLMSG_OK(reply, length);
+             reply = NLMSG_NEXT(reply, length)) {
+            // Leftovers from a request which failed halfway.
+            if (reply->nlmsg_seq != m_sequence) {
+                continue;
+            }
+
+            if (reply->nlmsg_type == NLMSG_ERROR) {
+                const struct nlmsgerr *error = static_cast<const struct nlmsgerr*>(NLMSG_DATA(reply));
+                if (error->error != 0) {
+                    *errorMessage = QString::fromLocal8Bit(strerror(-error->error));
+                    return false;
+                }
+                return true;
+            } else if (reply->nlmsg_type == NLMSG_DONE) {
+                return true;
+            }
+
+            if (replies) {
+                replies->append(QByteArray(reinterpret_cast<const char*>(reply), reply->nlmsg_len));
+            }
+        }
+    }
+}
+
+int RtNetlink::interfaceIndex(const QString &interfaceName)
+{
+    return static_cast<int>(if_nametoindex(interfaceName.toLatin1().constData()));
+}
+
+bool RtNetlink::linkFlags(int index, uint *flags, QString *errorMessage)
+{
+    struct ifinfomsg request;
+    memset(&request, 0, sizeof(request));
+    request.ifi_family = AF_UNSPEC;
+    request.ifi_index = index;
+
+    QList< QByteArray > replies;
+    if (!transact(message(RTM_GETLINK, 0, &request, sizeof(request)), &replies, errorMessage)) {
+        return false;
+    } else if (replies.isEmpty()) {
+        *errorMessage = QStringLiteral("The kernel did not report link %1.").arg(index);
+        return false;
+    }
+
+    *flags = static_cast<const struct ifinfomsg*>(NLMSG_DATA(reinterpret_cast<const struct nlmsghdr*>(replies.first().constData())))->ifi_flags;
+    return true;
+}
+
+bool RtNetlink::setLinkUp(int index, bool up, QString *errorMessage)
+{
+    struct ifinfomsg request;
+    memset(&request, 0, sizeof(request));
+    request.ifi_family = AF_UNSPEC;
+    request.ifi_index = index;
+    request.ifi_flags = up ? IFF_UP : 0;
+    request.ifi_change = IFF_UP;
+
+    return transact(message(RTM_NEWLINK, 0, &request, sizeof(request)), nullptr, errorMessage);
+}
+
+bool RtNetlink::addresses(int index, QList< QByteArray > *replies, QString *errorMessage)
+{
+    struct ifaddrmsg request;
+    memset(&request, 0, sizeof(request));
+    request.ifa_family = AF_INET;
+
+    QList< QByteArray > all;
+    if (!transact(message(RTM_GETADDR, NLM_F_DUMP, &request, sizeof(request)), &all, errorMessage)) {
+        return false;
+    }
+
+    // Dumps can't be filtered by interface on every kernel.
+    for (const QByteArray &reply : all) {
+        const struct ifaddrmsg *address = static_cast<const struct ifaddrmsg*>(NLMSG_DATA(reinterpret_cast<const struct nlmsghdr*>(reply.constData())));
+        if (static_cast<int>(address->ifa_index) == index) {
+            replies->append(reply);
+        }
+    }
+    return true;
+}
+
+bool RtNetlink::hasAddress(int index, const QHostAddress &address, QString *errorMessage)
+{
+    QList< QByteArray > replies;
+    if (!addresses(index, &replies, errorMessage)) {
+        return false;
+    }
+
+    quint32 wanted = qToBigEndian(address.toIPv4Address());
+    for (const QByteArray &reply : replies) {
+        QByteArray local = attribute(reply, sizeof(struct ifaddrmsg), IFA_LOCAL);
+        if (local.size() == sizeof(wanted) && memcmp(local.constData(), &wanted, sizeof(wanted)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RtNetlink::localAddresses(int index, QList< QPair< QHostAddress, int > > *found, QString *errorMessage)
+{
+    QList< QByteArray > replies;
+    if (!addresses(index, &replies, errorMessage)) {
+        return false;
+    }
+
+    for (const QByteArray &reply : replies) {
+        const struct ifaddrmsg *address = static_cast<const struct ifaddrmsg*>(NLMSG_DATA(reinterpret_cast<const struct nlmsghdr*>(reply.constData())));
+        QByteArray local = attribute(reply, sizeof(struct ifaddrmsg), IFA_LOCAL);
+        quint32 networkOrder;
+        if (local.size() != sizeof(networkOrder)) {
+            continue;
+        }
+        memcpy(&networkOrder, local.constData(), sizeof(networkOrder));
+        found->append(qMakePair(QHostAddress(qFromBigEndian(networkOrder)), static_cast<int>(address->ifa_prefixlen)));
+    }
+    return true;
+}
+
+bool RtNetlink::addAddress(int index, const QHostAddress &address, int prefixLength, QString *errorMessage)
+{
+    struct ifaddrmsg request;
+    memset(&request, 0, sizeof(request));
+    request.ifa_family = AF_INET;
+    request.ifa_prefixlen = prefixLength;
+    request.ifa_scope = RT_SCOPE_UNIVERSE;
+    request.ifa_index = index;
+
+    quint32 hostOrder = address.toIPv4Address();
+    quint32 local = qToBigEndian(hostOrder);
+    quint32 broadcast = qToBigEndian(hostOrder | (prefixLength >= 32 ? 0 : 0xffffffffu >> prefixLength));
+
+    QByteArray newAddress = message(RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &request, sizeof(request));
+    appendAttribute(&newAddress, IFA_LOCAL, &local, sizeof(local));
+    appendAttribute(&newAddress, IFA_ADDRESS, &local, sizeof(local));
+    appendAttribute(&newAddress, IFA_BROADCAST, &broadcast, sizeof(broadcast));
+
+    return transact(newAddress, nullptr, errorMessage);
+}
+
+bool RtNetlink::flushAddresses(int index, QString *errorMessage)
+{
+    QList< QByteArray > replies;
+    if (!addresses(index, &replies, errorMessage)) {
+        return false;
+    }
+
+    for (const QByteArray &reply : replies) {
+        const struct ifaddrmsg *address = static_cast<const struct ifaddrmsg*>(NLMSG_DATA(reinterpret_cast<const struct nlmsghdr*>(reply.constData())));
+        QByteArray local = attribute(reply, sizeof(struct ifaddrmsg), IFA_LOCAL);
+
+        QByteArray deleteAddress = message(RTM_DELADDR, 0, address, sizeof(struct ifaddrmsg));
+        appendAttribute(&deleteAddress, IFA_LOCAL, local.constData(), local.size());
+        if (!transact(deleteAddress, nullptr, errorMessage)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+///////////////////
+
+RtNetlinkMonitor::RtNetlinkMonitor(QObject *parent)
+    : QObject(parent)
+    , m_socket(-1)
+    , m_notifier(nullptr)
+{
+}
+
+RtNetlinkMonitor::~RtNetlinkMonitor()
+{
+    delete m_notifier;
+    if (m_socket >= 0) {
+        ::close(m_socket);
+    }
+}
+
+bool RtNetlinkMonitor::start(QString *errorMessage)
+{
+    if (m_socket >= 0) {
+        return true;
+    }
+
+    m_socket = ::socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_socket < 0) {
+        *errorMessage = QStringLiteral("Could not create a rtnetlink socket: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (::bind(m_socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        *errorMessage = QStringLiteral("Could not listen to rtnetlink events: %1").arg(QString::fromLocal8Bit(strerror(errno)));
+        ::close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read);
+    connect(m_notifier, &QSocketNotifier::activated, this, &RtNetlinkMonitor::onActivated);
+    return true;
+}
+
+void RtNetlinkMonitor::onActivated()
+{
+    // What changed doesn't matter, whoever listens checks what it is waiting for. A burst is one change.
+    char buffer[8192];
+    while (::recv(m_socket, buffer, sizeof(buffer), 0) > 0 || errno == EINTR) {
+    }
+
+    Q_EMIT changed();
+}
@@ -0,0 +1,85 @@
+#ifndef RTNETLINK_H
+#define RTNETLINK_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+
+#include <QtNetwork/QHostAddress>
+
+class QSocketNotifier;
+
+/**
+ * A minimal synchronous rtnetlink client.
+ *
+ * The kernel handles route requests as they are sent, so replies are already there when we read them: no event
+ * loop round trip is needed.
+ */
+class RtNetlink
+{
+public:
+    RtNetlink();
+    ~RtNetlink();
+
+    bool open(QString *errorMessage);
+    inline bool isOpen() const { return m_socket >= 0; }
+
+    /// A request of @p type whose payload is @p header. Attributes can be appended with appendAttribute.
+    static QByteArray message(quint16 type, quint16 flags, const void *header, int headerSize);
+    static void appendAttribute(QByteArray *message, quint16 type, const void *data, int size);
+    /// The payload of the first attribute of @p type in @p message, after its @p headerSize bytes long header.
+    static QByteArray attribute(const QByteArray &message, int headerSize, quint16 type);
+
+    /// Sends @p request and collects its replies, until the kernel acknowledges it or reports an error.
+    bool transact(QByteArray request, QList< QByteArray > *replies, QString *errorMessage);
+
+    /// The index of @p interfaceName, 0 if there's no such interface.
+    static int interfaceIndex(const QString &interfaceName);
+
+    bool linkFlags(int index, uint *flags, QString *errorMessage);
+    bool setLinkUp(int index, bool up, QString *errorMessage);
+
+    bool hasAddress(int index, const QHostAddress &address, QString *errorMessage);
+    /// Every IPv4 address on the interface, with its prefix length.
+    bool localAddresses(int index, QList< QPair< QHostAddress, int > > *found, QString *errorMessage);
+    bool addAddress(int index, const QHostAddress &address, int prefixLength, QString *errorMessage);
+    /// Removes every IPv4 address from the interface.
+    bool flushAddresses(int index, QString *errorMessage);
+
+private:
+    Q_DISABLE_COPY(RtNetlink)
+
+    bool addresses(int index, QList< QByteArray > *replies, QString *errorMessage);
+
+    int m_socket;
+    quint32 m_sequence;
+};
+
+/**
+ * Tells whenever a link or an IPv4 address changes, for conditions to be checked again.
+ */
+class RtNetlinkMonitor : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RtNetlinkMonitor)
+
+public:
+    explicit RtNetlinkMonitor(QObject *parent = nullptr);
+    virtual ~RtNetlinkMonitor();
+
+    bool start(QString *errorMessage);
+
+Q_SIGNALS:
+    void changed();
+
+private Q_SLOTS:
+    void onActivated();
+
+private:
+    int m_socket;
+    QSocketNotifier *m_notifier;
+};
+
+#endif // RTNETLINK_H
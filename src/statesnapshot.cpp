@@ -0,0 +1,99 @@
+#include "statesnapshot.h"
+
+#include <HemeraCore/USBGadgetManager>
+
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QSaveFile>
+
+#define STATE_SNAPSHOT_PATH "/run/gravity-usb-gadget-manager/state.json"
+
+StateSnapshot::StateSnapshot()
+    : activeMode(static_cast<uint>(Hemera::USBGadgetManager::Mode::None))
+    , backend(EthernetGadgetOperation::Backend::LegacyModule)
+    , function(EthernetGadgetOperation::Function::ECM)
+    , qmult(0)
+    , mtu(0)
+    , network(EthernetGadgetOperation::Network::Connman)
+    , embeddedDHCP(false)
+{
+}
+
+QString StateSnapshot::path(const QString &controller)
+{
+    QString path = QString::fromLocal8Bit(qgetenv("GRAVITY_USB_GADGET_STATE_FILE"));
+    if (path.isEmpty()) {
+        path = QStringLiteral(STATE_SNAPSHOT_PATH);
+    }
+    if (controller.isEmpty()) {
+        return path;
+    }
+
+    // Additional controllers sit next to the main one.
+    QFileInfo info(path);
+    return info.absolutePath() + QLatin1Char('/') + info.completeBaseName() + QLatin1Char('-') + controller + QLatin1Char('.') + info.suffix();
+}
+
+StateSnapshot StateSnapshot::load(const QString &controller)
+{
+    StateSnapshot snapshot;
+
+    QFile file(path(controller));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return snapshot;
+    }
+
+    QJsonParseError error;
+    QJsonObject state = QJsonDocument::fromJson(file.readAll(), &error).object();
+    if (error.error != QJsonParseError::NoError) {
+        qWarning() << "Discarding corrupted state snapshot" << path(controller) << ":" << error.errorString();
+        return snapshot;
+    }
+
+    snapshot.activeMode = static_cast<uint>(state.value(QStringLiteral("activeMode")).toDouble());
+    snapshot.backend = EthernetGadgetOperation::backendFromName(state.value(QStringLiteral("backend")).toString());
+    snapshot.udc = state.value(QStringLiteral("udc")).toString();
+    snapshot.function = EthernetGadgetOperation::functionFromName(state.value(QStringLiteral("function")).toString());
+    snapshot.qmult = static_cast<uint>(state.value(QStringLiteral("qmult")).toDouble());
+    snapshot.mtu = static_cast<uint>(state.value(QStringLiteral("mtu")).toDouble());
+    snapshot.network = EthernetGadgetOperation::networkFromName(state.value(QStringLiteral("network")).toString());
+    snapshot.embeddedDHCP = state.value(QStringLiteral("embeddedDHCP")).toBool();
+    snapshot.interfaceName = state.value(QStringLiteral("interface")).toString();
+    snapshot.p2pAddress = QHostAddress(state.value(QStringLiteral("p2pAddress")).toString());
+    snapshot.lockOwner = state.value(QStringLiteral("lockOwner")).toString();
+    snapshot.lockReason = state.value(QStringLiteral("lockReason")).toString();
+
+    return snapshot;
+}
+
+bool StateSnapshot::save(const QString &controller, QString *errorMessage) const
+{
+    QJsonObject state;
+    state.insert(QStringLiteral("activeMode"), static_cast<double>(activeMode));
+    state.insert(QStringLiteral("backend"), EthernetGadgetOperation::backendName(backend));
+    state.insert(QStringLiteral("udc"), udc);
+    state.insert(QStringLiteral("function"), EthernetGadgetOperation::functionName(function));
+    state.insert(QStringLiteral("qmult"), static_cast<double>(qmult));
+    state.insert(QStringLiteral("mtu"), static_cast<double>(mtu));
+    state.insert(QStringLiteral("network"), EthernetGadgetOperation::networkName(network));
+    state.insert(QStringLiteral("embeddedDHCP"), embeddedDHCP);
+    state.insert(QStringLiteral("interface"), interfaceName);
+    state.insert(QStringLiteral("p2pAddress"), p2pAddress.isNull() ? QString() : p2pAddress.toString());
+    state.insert(QStringLiteral("lockOwner"), lockOwner);
+    state.insert(QStringLiteral("lockReason"), lockReason);
+
+    QDir().mkpath(QFileInfo(path(controller)).absolutePath());
+
+    // Never leave a half-written snapshot behind.
+    QSaveFile file(path(controller));
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(state).toJson(QJsonDocument::Compact)) < 0 || !file.commit()) {
+        *errorMessage = QStringLiteral("Could not write the state snapshot to %1: %2").arg(path(controller), file.errorString());
+        return false;
+    }
+
+    return true;
+}
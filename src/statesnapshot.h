@@ -0,0 +1,41 @@
+#ifndef STATESNAPSHOT_H
+#define STATESNAPSHOT_H
+
+#include "ethernetgadgetoperations.h"
+
+#include <QtCore/QString>
+
+#include <QtNetwork/QHostAddress>
+
+/**
+ * What the daemon needs to pick up where it left off after exiting.
+ *
+ * It is written on every transition to a file in /run: it outlives the daemon, but not the gadget itself,
+ * which is gone after a reboot anyway.
+ */
+struct StateSnapshot
+{
+    StateSnapshot();
+
+    uint activeMode;
+    EthernetGadgetOperation::Backend backend;
+    QString udc;
+    EthernetGadgetOperation::Function function;
+    uint qmult;
+    uint mtu;
+    EthernetGadgetOperation::Network network;
+    bool embeddedDHCP;
+    QString interfaceName;
+    QHostAddress p2pAddress;
+
+    QString lockOwner;
+    QString lockReason;
+
+    /// Returns an empty snapshot if there's none, or if it can't be read. @p controller is empty for the main UDC.
+    static StateSnapshot load(const QString &controller = QString());
+    bool save(const QString &controller, QString *errorMessage) const;
+
+    static QString path(const QString &controller = QString());
+};
+
+#endif // STATESNAPSHOT_H
@@ -0,0 +1,165 @@
+#include "systemdunitoperation.h"
+
+#include "tracebuffer.h"
+
+#include <HemeraCore/Literals>
+
+#include <QtCore/QTimer>
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusError>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <QtDBus/QDBusPendingReply>
+
+#define SYSTEMD_SERVICE "org.freedesktop.systemd1"
+#define SYSTEMD_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+
+/* 30 seconds */
+constexpr int jobTimeout() { return 30 * 1000; }
+
+SystemdUnitOperation::SystemdUnitOperation(Action action, const QString &unit, QObject *parent)
+    : Operation(parent)
+    , m_action(action)
+    , m_unit(unit)
+    , m_timeoutTimer(new QTimer(this))
+    , m_traceStart(-1)
+{
+    m_timeoutTimer->setSingleShot(true);
+    connect(m_timeoutTimer, &QTimer::timeout, this, [this] {
+        disconnectJobSignals();
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
+                             QStringLiteral("systemd did not complete the job for %1 in time.").arg(m_unit));
+    });
+
+    // Jobs are where we wait on other processes: they get a span each, from the call to the job's removal.
+    connect(this, &Hemera::Operation::finished, this, [this] {
+        if (m_traceStart >= 0) {
+            TraceBuffer::complete(TraceBuffer::SystemdTrack, "systemd", actionName() + QLatin1Char(' ') + m_unit, m_traceStart,
+                                  TraceBuffer::now() - m_traceStart, isError() ? errorName() : QString());
+        }
+    });
+}
+
+SystemdUnitOperation::~SystemdUnitOperation()
+{
+}
+
+void SystemdUnitOperation::subscribe()
+{
+    QDBusConnection::systemBus().asyncCall(QDBusMessage::createMethodCall(QStringLiteral(SYSTEMD_SERVICE), QStringLiteral(SYSTEMD_PATH),
+                                                                          QStringLiteral(SYSTEMD_MANAGER_INTERFACE), QStringLiteral("Subscribe")));
+}
+
+void SystemdUnitOperation::startImpl()
+{
+    if (TraceBuffer::isEnabled()) {
+        m_traceStart = TraceBuffer::now();
+    }
+
+    QDBusConnection bus = QDBusConnection::systemBus();
+
+    // The service subscribed to job signals already.
+    bus.connect(QStringLiteral(SYSTEMD_SERVICE), QStringLiteral(SYSTEMD_PATH), QStringLiteral(SYSTEMD_MANAGER_INTERFACE),
+                QStringLiteral("JobRemoved"), this, SLOT(onJobRemoved(uint,QDBusObjectPath,QString,QString)));
+
+    QDBusMessage call = QDBusMessage::createMethodCall(QStringLiteral(SYSTEMD_SERVICE), QStringLiteral(SYSTEMD_PATH),
+                                                       QStringLiteral(SYSTEMD_MANAGER_INTERFACE),
+                                                       m_action == Action::Start ? QStringLiteral("StartUnit")
+                                                                                 : m_action == Action::Stop ? QStringLiteral("StopUnit")
+                                                                                                            : QStringLiteral("RestartUnit"));
+    call.setArguments(QVariantList() << m_unit << QStringLiteral("replace"));
+
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(bus.asyncCall(call), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, &SystemdUnitOperation::onJobQueued);
+
+    m_timeoutTimer->start(jobTimeout());
+}
+
+void SystemdUnitOperation::onJobQueued(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply< QDBusObjectPath > reply = *watcher;
+    watcher->deleteLater();
+
+    if (reply.isError()) {
+        QString errorName = reply.error().name();
+        QString hemeraError;
+        if (errorName == QStringLiteral("org.freedesktop.DBus.Error.AccessDenied") ||
+            errorName == QStringLiteral("org.freedesktop.systemd1.UnitMasked")) {
+            hemeraError = Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed());
+        } else if (errorName == QStringLiteral("org.freedesktop.DBus.Error.NoReply") ||
+                   errorName == QStringLiteral("org.freedesktop.DBus.Error.Timeout")) {
+            hemeraError = Hemera::Literals::literal(Hemera::Literals::Errors::timeout());
+        } else {
+            hemeraError = Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest());
+        }
+
+        m_timeoutTimer->stop();
+        disconnectJobSignals();
+        setFinishedWithError(hemeraError, QStringLiteral("Could not %1 %2: %3").arg(actionName(), m_unit, reply.error().message()));
+        return;
+    }
+
+    m_job = reply.value();
+
+    if (m_earlyResults.contains(m_job.path())) {
+        finishJob(m_earlyResults.value(m_job.path()));
+    }
+    m_earlyResults.clear();
+}
+
+void SystemdUnitOperation::onJobRemoved(uint id, const QDBusObjectPath &job, const QString &unit, const QString &result)
+{
+    Q_UNUSED(id)
+
+    if (unit != m_unit) {
+        return;
+    }
+
+    if (m_job.path().isEmpty()) {
+        // The reply to our call is still on its way.
+        m_earlyResults.insert(job.path(), result);
+        return;
+    }
+
+    if (job.path() == m_job.path()) {
+        finishJob(result);
+    }
+}
+
+void SystemdUnitOperation::disconnectJobSignals()
+{
+    QDBusConnection::systemBus().disconnect(QStringLiteral(SYSTEMD_SERVICE), QStringLiteral(SYSTEMD_PATH), QStringLiteral(SYSTEMD_MANAGER_INTERFACE),
+                                            QStringLiteral("JobRemoved"), this, SLOT(onJobRemoved(uint,QDBusObjectPath,QString,QString)));
+}
+
+void SystemdUnitOperation::finishJob(const QString &result)
+{
+    m_timeoutTimer->stop();
+    disconnectJobSignals();
+
+    if (result == QStringLiteral("done")) {
+        setFinished();
+    } else if (result == QStringLiteral("timeout")) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::timeout()),
+                             QStringLiteral("systemd timed out handling %1.").arg(m_unit));
+    } else {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                             QStringLiteral("systemd job for %1 completed with result %2.").arg(m_unit, result));
+    }
+}
+
+QString SystemdUnitOperation::actionName() const
+{
+    switch (m_action) {
+        case Action::Start:
+            return QStringLiteral("start");
+        case Action::Stop:
+            return QStringLiteral("stop");
+        case Action::Restart:
+            return QStringLiteral("restart");
+    }
+
+    return QString();
+}
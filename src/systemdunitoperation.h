@@ -0,0 +1,61 @@
+#ifndef SYSTEMDUNITOPERATION_H
+#define SYSTEMDUNITOPERATION_H
+
+#include <HemeraCore/Operation>
+
+#include <QtCore/QHash>
+
+#include <QtDBus/QDBusObjectPath>
+
+class QDBusPendingCallWatcher;
+class QTimer;
+
+/**
+ * Starts, stops or restarts a systemd unit through the systemd Manager D-Bus API.
+ *
+ * The call is asynchronous, and the operation finishes only once systemd reports the job as removed.
+ */
+class SystemdUnitOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(SystemdUnitOperation)
+
+public:
+    enum class Action : quint8 {
+        Start = 0,
+        Stop,
+        /// Starts the unit as well, if it is not running.
+        Restart
+    };
+
+    explicit SystemdUnitOperation(Action action, const QString &unit, QObject *parent = nullptr);
+    virtual ~SystemdUnitOperation();
+
+    /// systemd sends job signals to subscribers only. Call once per process, before any operation starts: the subscription
+    /// lasts until we leave the bus.
+    static void subscribe();
+
+protected:
+    virtual void startImpl() override final;
+
+private Q_SLOTS:
+    void onJobQueued(QDBusPendingCallWatcher *watcher);
+    void onJobRemoved(uint id, const QDBusObjectPath &job, const QString &unit, const QString &result);
+
+private:
+    void disconnectJobSignals();
+    void finishJob(const QString &result);
+    QString actionName() const;
+
+    Action m_action;
+    QString m_unit;
+    QDBusObjectPath m_job;
+    QTimer *m_timeoutTimer;
+    /// When the job was asked for, if it is being traced.
+    qint64 m_traceStart;
+
+    // Jobs which completed before we knew which one was ours.
+    QHash< QString, QString > m_earlyResults;
+};
+
+#endif // SYSTEMDUNITOPERATION_H
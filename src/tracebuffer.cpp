@@ -0,0 +1,179 @@
+#include "tracebuffer.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QHash>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QVector>
+
+#include <time.h>
+#include <unistd.h>
+
+/* 16384 events, about 1.5MiB */
+constexpr int traceBufferSize() { return 16384; }
+
+namespace {
+
+struct Event {
+    Event() : phase('X'), track(0), category(nullptr), start(0), duration(0) {}
+
+    char phase;
+    int track;
+    const char *category;
+    QString name;
+    QString detail;
+    qint64 start;
+    qint64 duration;
+};
+
+struct TraceState {
+    TraceState() : next(0), recorded(0) {}
+
+    QVector< Event > events;
+    int next;
+    quint64 recorded;
+    QHash< QString, int > operationTracks;
+};
+
+}
+
+Q_GLOBAL_STATIC(TraceState, traceState)
+
+bool TraceBuffer::s_enabled = false;
+
+static void record(const Event &event)
+{
+    TraceState *state = traceState();
+
+    if (state->events.size() < traceBufferSize()) {
+        state->events.append(event);
+    } else {
+        state->events[state->next] = event;
+    }
+    state->next = (state->next + 1) % traceBufferSize();
+    ++state->recorded;
+}
+
+void TraceBuffer::setEnabled(bool enabled)
+{
+    if (enabled && !s_enabled) {
+        // The ring only takes memory once it's used.
+        traceState()->events.reserve(traceBufferSize());
+    }
+    s_enabled = enabled;
+}
+
+qint64 TraceBuffer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+int TraceBuffer::operationTrack(const QString &udc)
+{
+    TraceState *state = traceState();
+
+    QHash< QString, int >::const_iterator i = state->operationTracks.constFind(udc);
+    if (i != state->operationTracks.constEnd()) {
+        return i.value();
+    }
+
+    int track = SystemdTrack + 1 + state->operationTracks.size();
+    state->operationTracks.insert(udc, track);
+    return track;
+}
+
+void TraceBuffer::complete(int track, const char *category, const QString &name, qint64 start, qint64 duration,
+                           const QString &detail)
+{
+    if (!s_enabled) {
+        return;
+    }
+
+    Event event;
+    event.track = track;
+    event.category = category;
+    event.name = name;
+    event.detail = detail;
+    event.start = start;
+    event.duration = duration;
+    record(event);
+}
+
+void TraceBuffer::instant(int track, const char *category, const QString &name, const QString &detail)
+{
+    if (!s_enabled) {
+        return;
+    }
+
+    Event event;
+    event.phase = 'i';
+    event.track = track;
+    event.category = category;
+    event.name = name;
+    event.detail = detail;
+    event.start = now();
+    record(event);
+}
+
+QByteArray TraceBuffer::toChromeTrace()
+{
+    TraceState *state = traceState();
+    qint64 pid = getpid();
+
+    QJsonArray events;
+
+    // Name the process and every track, so that the timeline reads without a legend.
+    auto metadata = [&events, pid] (const QString &name, int track, const QString &value) {
+        QJsonObject event;
+        event.insert(QStringLiteral("name"), name);
+        event.insert(QStringLiteral("ph"), QStringLiteral("M"));
+        event.insert(QStringLiteral("pid"), pid);
+        event.insert(QStringLiteral("tid"), track);
+        event.insert(QStringLiteral("args"), QJsonObject { { QStringLiteral("name"), value } });
+        events.append(event);
+    };
+    metadata(QStringLiteral("process_name"), 0, QCoreApplication::applicationName());
+    metadata(QStringLiteral("thread_name"), ServiceTrack, QStringLiteral("USBGadgetManagerService"));
+    metadata(QStringLiteral("thread_name"), SystemdTrack, QStringLiteral("systemd"));
+    for (QHash< QString, int >::const_iterator i = state->operationTracks.constBegin(); i != state->operationTracks.constEnd(); ++i) {
+        metadata(QStringLiteral("thread_name"), i.value(),
+                 i.key().isEmpty() ? QStringLiteral("Operations") : QStringLiteral("Operations on %1").arg(i.key()));
+    }
+
+    // Oldest first: once the ring is full, that's where the next event would go.
+    int count = state->events.size();
+    int first = count < traceBufferSize() ? 0 : state->next;
+    for (int n = 0; n < count; ++n) {
+        const Event &e = state->events.at((first + n) % count);
+
+        QJsonObject event;
+        event.insert(QStringLiteral("name"), e.name);
+        event.insert(QStringLiteral("cat"), QLatin1String(e.category));
+        event.insert(QStringLiteral("ph"), QString(QLatin1Char(e.phase)));
+        event.insert(QStringLiteral("ts"), e.start);
+        if (e.phase == 'X') {
+            event.insert(QStringLiteral("dur"), e.duration);
+        } else {
+            event.insert(QStringLiteral("s"), QStringLiteral("t"));
+        }
+        event.insert(QStringLiteral("pid"), pid);
+        event.insert(QStringLiteral("tid"), e.track);
+        if (!e.detail.isEmpty()) {
+            event.insert(QStringLiteral("args"), QJsonObject { { QStringLiteral("detail"), e.detail } });
+        }
+        events.append(event);
+    }
+
+    QJsonObject trace;
+    trace.insert(QStringLiteral("traceEvents"), events);
+    trace.insert(QStringLiteral("displayTimeUnit"), QStringLiteral("ms"));
+    trace.insert(QStringLiteral("otherData"), QJsonObject {
+        { QStringLiteral("recordedEvents"), static_cast<qint64>(state->recorded) },
+        { QStringLiteral("droppedEvents"), static_cast<qint64>(state->recorded - count) }
+    });
+
+    return QJsonDocument(trace).toJson(QJsonDocument::Compact);
+}
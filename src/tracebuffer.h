@@ -0,0 +1,64 @@
+#ifndef TRACEBUFFER_H
+#define TRACEBUFFER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+/**
+ * Timeline tracing of daemon activity, exported in Chrome trace format for chrome://tracing or Perfetto.
+ *
+ * Spans and instant events go into a fixed-size ring, shared by the whole process: the oldest events make room for new
+ * ones. Tracing is off unless asked for, and then recording sites cost a single check.
+ */
+class TraceBuffer
+{
+public:
+    /// Tracks show up as threads on the timeline. Operations get one per UDC, as they run side by side.
+    enum Track {
+        ServiceTrack = 1,
+        SystemdTrack = 2
+    };
+
+    static inline bool isEnabled() { return s_enabled; }
+    /// Stopping keeps whatever was recorded, for a later dump.
+    static void setEnabled(bool enabled);
+
+    /// Monotonic, in microseconds.
+    static qint64 now();
+
+    static int operationTrack(const QString &udc);
+
+    /// A span which started at @p start and lasted @p duration, both in microseconds.
+    static void complete(int track, const char *category, const QString &name, qint64 start, qint64 duration,
+                         const QString &detail = QString());
+    static void instant(int track, const char *category, const QString &name, const QString &detail = QString());
+
+    /// The buffer, as a Chrome trace JSON object.
+    static QByteArray toChromeTrace();
+
+private:
+    static bool s_enabled;
+};
+
+/// Records a span for its own lifetime, if tracing was enabled when it started.
+class TraceSpan
+{
+public:
+    inline TraceSpan(int track, const char *category, const QString &name)
+        : m_track(track), m_category(category), m_name(name), m_start(TraceBuffer::isEnabled() ? TraceBuffer::now() : -1) {}
+    inline ~TraceSpan() {
+        if (m_start >= 0) {
+            TraceBuffer::complete(m_track, m_category, m_name, m_start, TraceBuffer::now() - m_start);
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(TraceSpan)
+
+    int m_track;
+    const char *m_category;
+    QString m_name;
+    qint64 m_start;
+};
+
+#endif // TRACEBUFFER_H
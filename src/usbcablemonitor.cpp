@@ -0,0 +1,202 @@
+#include "usbcablemonitor.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QStringList>
+
+#include <libudev.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define UDC_CLASS_PATH "/sys/class/udc"
+#define POWER_SUPPLY_CLASS_PATH "/sys/class/power_supply"
+#define ANDROID_USB_STATE_PATH "/sys/class/android_usb/android0/state"
+
+static QByteArray readAttribute(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    return file.readAll().trimmed();
+}
+
+USBCableMonitor::USBCableMonitor(QObject *parent)
+    : QObject(parent)
+    , m_udev(nullptr)
+    , m_monitor(nullptr)
+    , m_udevNotifier(nullptr)
+    , m_status(Status::Unknown)
+{
+}
+
+USBCableMonitor::~USBCableMonitor()
+{
+    for (QSocketNotifier *notifier : m_udcStateNotifiers) {
+        ::close(notifier->socket());
+        delete notifier;
+    }
+
+    if (m_monitor) {
+        udev_monitor_unref(m_monitor);
+    }
+    if (m_udev) {
+        udev_unref(m_udev);
+    }
+}
+
+bool USBCableMonitor::start()
+{
+    m_udev = udev_new();
+    if (!m_udev) {
+        return false;
+    }
+
+    m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+    if (!m_monitor) {
+        return false;
+    }
+
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "udc", nullptr);
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "power_supply", nullptr);
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "android_usb", nullptr);
+    if (udev_monitor_enable_receiving(m_monitor) < 0) {
+        return false;
+    }
+
+    m_udevNotifier = new QSocketNotifier(udev_monitor_get_fd(m_monitor), QSocketNotifier::Read, this);
+    connect(m_udevNotifier, &QSocketNotifier::activated, this, &USBCableMonitor::onUdevEvent);
+
+    watchUDCStates();
+    refresh();
+
+    return canDetectCable();
+}
+
+bool USBCableMonitor::canDetectCable() const
+{
+    return m_status != Status::Unknown || !m_udcStateNotifiers.isEmpty();
+}
+
+void USBCableMonitor::onUdevEvent()
+{
+    struct udev_device *device = udev_monitor_receive_device(m_monitor);
+    if (!device) {
+        return;
+    }
+
+    QByteArray subsystem = udev_device_get_subsystem(device);
+    QByteArray action = udev_device_get_action(device);
+    udev_device_unref(device);
+
+    if (subsystem == "udc" || action == "add" || action == "remove") {
+        watchUDCStates();
+        Q_EMIT devicesChanged();
+    }
+
+    refresh();
+}
+
+void USBCableMonitor::watchUDCStates()
+{
+    QStringList udcs = QDir(QStringLiteral(UDC_CLASS_PATH)).entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System);
+
+    // Forget about those which went away
+    for (QHash< QString, QSocketNotifier* >::iterator i = m_udcStateNotifiers.begin(); i != m_udcStateNotifiers.end();) {
+        if (udcs.contains(i.key())) {
+            ++i;
+            continue;
+        }
+        ::close(i.value()->socket());
+        delete i.value();
+        i = m_udcStateNotifiers.erase(i);
+    }
+
+    for (const QString &udc : udcs) {
+        if (m_udcStateNotifiers.contains(udc)) {
+            continue;
+        }
+
+        QByteArray path = QStringLiteral(UDC_CLASS_PATH "/%1/state").arg(udc).toLocal8Bit();
+        int fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        // sysfs notifies changes as priority data, once the attribute has been read at least once.
+        char buffer[64];
+        ssize_t size = ::read(fd, buffer, sizeof(buffer));
+        Q_UNUSED(size)
+
+        QSocketNotifier *notifier = new QSocketNotifier(fd, QSocketNotifier::Exception, this);
+        connect(notifier, &QSocketNotifier::activated, this, &USBCableMonitor::onUDCStateChanged);
+        m_udcStateNotifiers.insert(udc, notifier);
+    }
+}
+
+void USBCableMonitor::onUDCStateChanged(int fd)
+{
+    // Rearm the notification
+    char buffer[64];
+    ::lseek(fd, 0, SEEK_SET);
+    ssize_t size = ::read(fd, buffer, sizeof(buffer));
+    Q_UNUSED(size)
+
+    refresh();
+}
+
+void USBCableMonitor::refresh()
+{
+    Status status = Status::Unknown;
+
+    auto update = [&status] (bool connected) {
+        if (connected) {
+            status = Status::Connected;
+        } else if (status == Status::Unknown) {
+            status = Status::Disconnected;
+        }
+    };
+
+    // The UDC knows best: anything but "not attached" means there's a host on the other side. Each one for itself, too.
+    QHash< QString, Status > udcStatuses;
+    for (const QString &udc : m_udcStateNotifiers.keys()) {
+        QByteArray state = readAttribute(QStringLiteral(UDC_CLASS_PATH "/%1/state").arg(udc));
+        if (!state.isEmpty()) {
+            update(state != "not attached");
+            udcStatuses.insert(udc, state != "not attached" ? Status::Connected : Status::Disconnected);
+        }
+    }
+    QStringList changedUDCs;
+    for (const QString &udc : udcStatuses.keys() + m_udcStatuses.keys()) {
+        if (udcStatuses.value(udc, Status::Unknown) != m_udcStatuses.value(udc, Status::Unknown) && !changedUDCs.contains(udc)) {
+            changedUDCs << udc;
+        }
+    }
+    m_udcStatuses = udcStatuses;
+
+    // VBUS, as seen by the charger.
+    for (const QString &supply : QDir(QStringLiteral(POWER_SUPPLY_CLASS_PATH)).entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System)) {
+        QString base = QStringLiteral(POWER_SUPPLY_CLASS_PATH "/%1/").arg(supply);
+        if (!readAttribute(base + QStringLiteral("type")).startsWith("USB")) {
+            continue;
+        }
+        update(readAttribute(base + QStringLiteral("online")) == "1");
+    }
+
+    // Android kernels
+    QByteArray androidState = readAttribute(QStringLiteral(ANDROID_USB_STATE_PATH));
+    if (!androidState.isEmpty()) {
+        update(androidState != "DISCONNECTED");
+    }
+
+    if (status != m_status) {
+        m_status = status;
+        Q_EMIT statusChanged(status);
+    }
+    for (const QString &udc : changedUDCs) {
+        Q_EMIT udcStatusChanged(udc, udcStatus(udc));
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef USBCABLEMONITOR_H
+#define USBCABLEMONITOR_H
+
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+
+class QSocketNotifier;
+
+struct udev;
+struct udev_monitor;
+
+/**
+ * Tracks whether a USB host is connected, without polling.
+ *
+ * UDC, power supply and android_usb devices are followed through udev, while UDC link states, which
+ * do not generate uevents, are followed through sysfs attribute notifications.
+ */
+class USBCableMonitor : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(USBCableMonitor)
+
+public:
+    enum class Status : uint {
+        Unknown = 0,
+        Disconnected = 1,
+        Connected = 2
+    };
+
+    explicit USBCableMonitor(QObject *parent = nullptr);
+    virtual ~USBCableMonitor();
+
+    /// Starts monitoring. Returns false if there's nothing on this system which can tell us about the cable.
+    bool start();
+
+    inline Status status() const { return m_status; }
+    bool canDetectCable() const;
+
+    /// What the state of @p udc alone tells. Unknown when it has none, as the other sources are about the system as a whole.
+    inline Status udcStatus(const QString &udc) const { return m_udcStatuses.value(udc, Status::Unknown); }
+    inline bool canDetectCable(const QString &udc) const { return m_udcStateNotifiers.contains(udc); }
+
+Q_SIGNALS:
+    void statusChanged(USBCableMonitor::Status status);
+    void udcStatusChanged(const QString &udc, USBCableMonitor::Status status);
+    /// A UDC, a power supply or an android_usb device came or went.
+    void devicesChanged();
+
+private Q_SLOTS:
+    void onUdevEvent();
+    void onUDCStateChanged(int fd);
+
+private:
+    void watchUDCStates();
+    void refresh();
+
+    struct udev *m_udev;
+    struct udev_monitor *m_monitor;
+    QSocketNotifier *m_udevNotifier;
+
+    QHash< QString, QSocketNotifier* > m_udcStateNotifiers;
+    QHash< QString, Status > m_udcStatuses;
+
+    Status m_status;
+};
+
+#endif // USBCABLEMONITOR_H
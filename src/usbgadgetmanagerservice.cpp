@@ -1,13 +1,33 @@
 #include "usbgadgetmanagerservice.h"
 
+#include "datapipe.h"
+#include "datapipeoperations.h"
+#include "dhcpserver.h"
 #include "ethernetgadgetoperations.h"
+#include "configfsgadget.h"
+#include "gadgetcapabilities.h"
+#include "gadgetmodes.h"
+#include "kernelmodules.h"
+#include "linkstatistics.h"
+#include "massstorageoperations.h"
+#include "statesnapshot.h"
+#include "systemdunitoperation.h"
+#include "tracebuffer.h"
+#include "usbcablemonitor.h"
 
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QTimer>
+#include <QtCore/QVector>
 
 #include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusConnectionInterface>
 #include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusObjectPath>
+#include <QtDBus/QDBusServiceWatcher>
 
 #include <HemeraCore/Literals>
 #include <HemeraCore/Operation>
@@ -16,38 +36,230 @@
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
 
+#include <sys/uio.h>
+
 #include "usbgadgetmanageradaptor.h"
 
 /* 60 seconds */
 constexpr int killerInterval() { return 60 * 1000; }
 
-USBGadgetManagerService::USBGadgetManagerService()
-    : AsyncInitDBusObject(nullptr)
-    , killerTimer(new QTimer(this))
+/* 10 seconds */
+constexpr int linkStatisticsWindow() { return 10 * 1000; }
+/* 10 seconds */
+constexpr int linkStatisticsSignalInterval() { return 10 * 1000; }
+
+static int intervalFromEnvironment(const char *variable, int defaultValue)
+{
+    bool ok;
+    int seconds = qgetenv(variable).toInt(&ok);
+    return ok && seconds > 0 ? seconds * 1000 : defaultValue;
+}
+
+/* Bounds of the gadget interface MTU: the IPv4 minimum, and what u_ether accepts */
+constexpr uint minimumMTU() { return 68; }
+constexpr uint maximumMTU() { return 15412; }
+
+// Spans a D-Bus method on the service track, and sees its reply off as it returns.
+class DBusMethodSpan : public TraceSpan
+{
+public:
+    DBusMethodSpan(USBGadgetManagerService *service, const QString &method)
+        : TraceSpan(TraceBuffer::ServiceTrack, "dbus", method), m_service(service) {}
+    ~DBusMethodSpan() { m_service->recordMethodReturn(); }
+
+private:
+    USBGadgetManagerService *m_service;
+};
+
+USBGadgetManagerService::USBGadgetManagerService(const QElapsedTimer &startupTimer)
+    : USBGadgetManagerService(nullptr, QString(), 0)
+{
+    m_startupTimer = startupTimer;
+    if (!m_startupTimer.isValid()) {
+        m_startupTimer.start();
+    }
+
+    if (!qgetenv("GRAVITY_USB_GADGET_TRACE").isEmpty()) {
+        TraceBuffer::setEnabled(true);
+    }
+}
+
+USBGadgetManagerService::USBGadgetManagerService(USBGadgetManagerService *main, const QString &udc, uint controller)
+    : AsyncInitDBusObject(main)
+    , m_main(main)
+    , m_udc(udc)
+    , m_controller(controller)
+    , killerTimer(main ? nullptr : new QTimer(this))
+    , m_stateChangedTimer(new QTimer(this))
+    , m_lockOwnerWatcher(new QDBusServiceWatcher(this))
+    , m_dataPipeHolderWatcher(new QDBusServiceWatcher(this))
     , m_activeMode(static_cast<uint>(Hemera::USBGadgetManager::Mode::None))
-    // TODO: These have to be detected at runtime.
-    , m_availableModes(static_cast<uint>(Hemera::USBGadgetManager::Mode::EthernetP2P | Hemera::USBGadgetManager::Mode::EthernetTethering))
+    , m_canDetectCableHotplugging(false)
+    , m_usbCableStatus(static_cast<uint>(USBCableMonitor::Status::Unknown))
+    , m_hotplugPrepared(false)
+    , m_dhcpServer(new DHCPServer(this))
+    , m_dataPipe(new DataPipe(this))
+    , m_cableMonitor(main ? main->m_cableMonitor : new USBCableMonitor(this))
+    , m_capabilities(main ? main->m_capabilities : new GadgetCapabilities(this))
+    , m_scheduler(new RequestScheduler([this] { return m_activeMode; },
+                                       [this] (const RequestScheduler::Request &request, QString *errorMessage) {
+                                           return createOperation(request, errorMessage);
+                                       }, this))
+    , m_linkStatistics(new LinkStatistics(intervalFromEnvironment("GRAVITY_USB_GADGET_STATS_WINDOW", linkStatisticsWindow()),
+                                          intervalFromEnvironment("GRAVITY_USB_GADGET_STATS_SIGNAL_INTERVAL", linkStatisticsSignalInterval()),
+                                          this))
+    , m_firstReplySent(false)
+    , m_connmanReadyRecorded(false)
 {
 }
 
 USBGadgetManagerService::~USBGadgetManagerService()
 {
+    QString errorMessage;
+    if (!m_latencyStatistics.save(latencyStatisticsPath(), &errorMessage)) {
+        qWarning() << errorMessage;
+    }
+}
+
+QString USBGadgetManagerService::latencyStatisticsPath() const
+{
+    // Next to the state snapshot: what survives us lives there.
+    QString path = QFileInfo(StateSnapshot::path()).absolutePath() + QStringLiteral("/latency-statistics");
+    return (m_main ? path + QLatin1Char('-') + controllerName(m_udc) : path) + QStringLiteral(".json");
+}
+
+uint USBGadgetManagerService::availableModes() const
+{
+    if (!m_main) {
+        return m_capabilities->availableModes();
+    }
+
+    // Our options are fixed: what's left is whether they work on our UDC.
+    uint availableModes = static_cast<uint>(Hemera::USBGadgetManager::Mode::None);
+    for (Hemera::USBGadgetManager::Mode mode : { Hemera::USBGadgetManager::Mode::EthernetP2P,
+                                                 Hemera::USBGadgetManager::Mode::EthernetTethering,
+                                                 GadgetModes::EthernetNCM,
+                                                 GadgetModes::MassStorage,
+                                                 GadgetModes::DataPipe }) {
+        EthernetGadgetOperation::Options options;
+        QString errorMessage;
+        if (parseOptions(static_cast<uint>(mode), QVariantMap(), &options, &errorMessage) &&
+            m_capabilities->unavailabilityReason(static_cast<uint>(mode), options).isEmpty()) {
+            availableModes |= static_cast<uint>(mode);
+        }
+    }
+    return availableModes;
+}
+
+QString USBGadgetManagerService::controllerName(const QString &udc)
+{
+    QString name = udc;
+    for (QChar &c : name) {
+        if (!(c.isLetterOrNumber() && c.unicode() < 128) && c != QLatin1Char('_')) {
+            c = QLatin1Char('_');
+        }
+    }
+    return name;
+}
+
+QString USBGadgetManagerService::objectPath() const
+{
+    QString path = Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerPath());
+    return m_main ? path + QLatin1Char('/') + controllerName(m_udc) : path;
+}
+
+bool USBGadgetManagerService::isBusy() const
+{
+    // Some things can't survive us: a lock somebody relies on, an operation, leases we serve, or a function whose ep0 we hold.
+    // Neither can what an active mode is watched through: link statistics, and the signals reporting on them.
+    return !m_scheduler->isIdle() || !m_systemWideLockOwner.isEmpty() || m_dhcpServer->isRunning() || m_dataPipe->isRunning() ||
+           m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None);
+}
+
+uint USBGadgetManagerService::cableStatus() const
+{
+    QString udc = m_main ? m_udc : m_capabilities->hardware().udcs.value(0);
+    if (m_cableMonitor->canDetectCable(udc)) {
+        return static_cast<uint>(m_cableMonitor->udcStatus(udc));
+    }
+
+    return static_cast<uint>(m_main ? USBCableMonitor::Status::Unknown : m_cableMonitor->status());
+}
+
+void USBGadgetManagerService::updateControllers()
+{
+    // The first UDC is ours, every other one gets an object of its own. Objects stay when their UDC goes away: they turn
+    // requests down meanwhile, and whatever they were up to is still theirs when it comes back.
+    QStringList udcs = m_capabilities->hardware().udcs;
+    for (int i = 1; i < udcs.size(); ++i) {
+        QString udc = udcs.at(i);
+        if (m_controllers.contains(udc)) {
+            continue;
+        }
+
+        USBGadgetManagerService *controller = new USBGadgetManagerService(this, udc, m_controllers.size() + 1);
+        m_controllers.insert(udc, controller);
+        connect(controller->init(), &Hemera::Operation::finished, this, [udc] (Hemera::Operation *op) {
+            if (op->isError()) {
+                qWarning() << "Could not set up the USB Gadget Manager for" << udc << ":" << op->errorMessage();
+            }
+        });
+    }
+}
+
+QVariantMap USBGadgetManagerService::controllers() const
+{
+    QVariantMap controllers;
+    QString udc = m_capabilities->hardware().udcs.value(0);
+    if (!udc.isEmpty()) {
+        controllers.insert(udc, QVariant::fromValue(QDBusObjectPath(objectPath())));
+    }
+    for (QHash< QString, USBGadgetManagerService* >::const_iterator i = m_controllers.constBegin(); i != m_controllers.constEnd(); ++i) {
+        controllers.insert(i.key(), QVariant::fromValue(QDBusObjectPath(i.value()->objectPath())));
+    }
+    return controllers;
+}
+
+QVariantMap USBGadgetManagerService::GetControllers()
+{
+    DBusMethodSpan span(this, QStringLiteral("GetControllers"));
+
+    return m_main ? m_main->controllers() : controllers();
 }
 
 void USBGadgetManagerService::initImpl()
 {
+    // Additional controllers live next to the main object, on the name it already holds.
+    if (m_main) {
+        if (!QDBusConnection::systemBus().registerObject(objectPath(), this)) {
+            setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::registerObjectFailed()),
+                         QStringLiteral("Could not register the USB Gadget Manager object for %1 on DBus.").arg(m_udc));
+            return;
+        }
+        new USBGadgetManagerAdaptor(this);
+
+        // VBUS and android_usb tell about the main UDC only: ours has its own state to go by, or nothing.
+        m_canDetectCableHotplugging = m_cableMonitor->canDetectCable(m_udc);
+        initController();
+        setReady();
+        return;
+    }
+
     if (!QDBusConnection::systemBus().registerService(Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerService()))) {
         setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::registerServiceFailed()),
                      QStringLiteral("Could not register USB Gadget Manager service on DBus. This means either a wrong installation or a corrupted instance."));
         return;
     }
-    if (!QDBusConnection::systemBus().registerObject(Hemera::Literals::literal(Hemera::Literals::DBus::usbGadgetManagerPath()), this)) {
+    if (!QDBusConnection::systemBus().registerObject(objectPath(), this)) {
         setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::registerObjectFailed()),
                      QStringLiteral("Could not register USB Gadget Manager object on DBus. This means either a wrong installation or a corrupted instance."));
         return;
     }
     new USBGadgetManagerAdaptor(this);
 
+    // dnsmasq runs as a systemd job: one subscription serves every job to come.
+    SystemdUnitOperation::subscribe();
+
     connect(killerTimer, &QTimer::timeout, [] {
         sd_notify(0, "STATUS=USB Gadget Manager is shutting down due to inactivity.\n");
         QCoreApplication::instance()->quit();
@@ -55,77 +267,894 @@ void USBGadgetManagerService::initImpl()
     killerTimer->setInterval(killerInterval());
     killerTimer->setSingleShot(true);
 
-    // Don't start it.
-    //killerTimer->start();
+    // Cable hotplugging
+    m_canDetectCableHotplugging = m_cableMonitor->start();
+
+    // What can we do? Probe once now, then again whenever devices come and go.
+    m_capabilities->refresh();
+    connect(m_cableMonitor, &USBCableMonitor::devicesChanged, m_capabilities, &GadgetCapabilities::refresh);
+
+    initController();
+
+    // Every other UDC, as they show up.
+    updateControllers();
+    connect(m_cableMonitor, &USBCableMonitor::devicesChanged, this, &USBGadgetManagerService::updateControllers);
+
+    // Connman is bound lazily, or right after we're ready if asked for: either way, not on our startup path.
+    connect(m_capabilities, &GadgetCapabilities::networkManagerReady, this, [this] {
+        if (!m_connmanReadyRecorded) {
+            m_connmanReadyRecorded = true;
+            recordStartupMilestone(QStringLiteral("ConnmanReady"));
+        }
+    });
+    if (!qgetenv("GRAVITY_USB_GADGET_CONNMAN_WARMUP").isEmpty()) {
+        QTimer::singleShot(0, m_capabilities, &GadgetCapabilities::bindNetworkManager);
+    }
 
+    recordStartupMilestone(QStringLiteral("Ready"));
     setReady();
 }
 
-void USBGadgetManagerService::Activate(uint mode, const QVariantMap& arguments)
+void USBGadgetManagerService::initController()
+{
+    // A lock holder which leaves the bus gives up its lock.
+    m_lockOwnerWatcher->setConnection(QDBusConnection::systemBus());
+    m_lockOwnerWatcher->setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+    connect(m_lockOwnerWatcher, &QDBusServiceWatcher::serviceUnregistered, this, [this] (const QString &service) {
+        m_lockOwnerWatcher->removeWatchedService(service);
+        if (service == m_systemWideLockOwner) {
+            qDebug() << "Lock owner" << service << "left the bus, releasing the lock.";
+            m_systemWideLockOwner.clear();
+            m_systemWideLockReason.clear();
+            Q_EMIT systemWideLockChanged();
+        }
+    });
+
+    // The data pipe endpoints are one client's at a time: until it leaves the bus, or the mode goes down.
+    m_dataPipeHolderWatcher->setConnection(QDBusConnection::systemBus());
+    m_dataPipeHolderWatcher->setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+    auto releaseDataPipe = [this] {
+        m_dataPipeHolderWatcher->setWatchedServices(QStringList());
+        m_dataPipeHolder.clear();
+    };
+    connect(m_dataPipeHolderWatcher, &QDBusServiceWatcher::serviceUnregistered, this, releaseDataPipe);
+    connect(this, &USBGadgetManagerService::activeModeChanged, this, [this, releaseDataPipe] {
+        if (m_activeMode != static_cast<uint>(GadgetModes::DataPipe)) {
+            releaseDataPipe();
+        }
+    });
+
+    // Pick up where the previous instance left off, then keep the snapshot up to date.
+    restoreState();
+    m_latencyStatistics.load(latencyStatisticsPath());
+    connect(this, &USBGadgetManagerService::activeModeChanged, this, &USBGadgetManagerService::saveState);
+    connect(this, &USBGadgetManagerService::systemWideLockChanged, this, &USBGadgetManagerService::saveState);
+
+    // Traffic on the gadget interface, whenever there's one.
+    m_linkStatistics->setInterfaceName(m_activeInterfaceName);
+    connect(this, &USBGadgetManagerService::activeModeChanged, this, [this] {
+        m_linkStatistics->setInterfaceName(m_activeInterfaceName);
+    });
+    connect(m_linkStatistics, &LinkStatistics::updated, this, [this] {
+        Q_EMIT LinkStatisticsChanged(m_linkStatistics->toVariantMap());
+    });
+
+    // Now that state survives us, we can leave when there's nothing to do.
+    connect(this, &USBGadgetManagerService::systemWideLockChanged, this, &USBGadgetManagerService::rearmIdleTimer);
+    connect(this, &USBGadgetManagerService::activeModeChanged, this, &USBGadgetManagerService::rearmIdleTimer);
+    connect(m_scheduler, &RequestScheduler::idle, this, &USBGadgetManagerService::rearmIdleTimer);
+
+    m_usbCableStatus = cableStatus();
+    connect(m_cableMonitor, &USBCableMonitor::statusChanged, this, &USBGadgetManagerService::onCableStatusChanged);
+    connect(m_cableMonitor, &USBCableMonitor::udcStatusChanged, this, &USBGadgetManagerService::onCableStatusChanged);
+
+    rearmIdleTimer();
+
+    // Whatever changes in a transition goes out in one StateChanged, once we're back to the event loop.
+    m_stateChangedTimer->setSingleShot(true);
+    m_stateChangedTimer->setInterval(0);
+    connect(m_stateChangedTimer, &QTimer::timeout, this, &USBGadgetManagerService::emitStateChanged);
+    connect(this, &USBGadgetManagerService::activeModeChanged, this, &USBGadgetManagerService::scheduleStateChanged);
+    connect(this, &USBGadgetManagerService::systemWideLockChanged, this, &USBGadgetManagerService::scheduleStateChanged);
+    connect(this, &USBGadgetManagerService::usbCableStatusChanged, this, &USBGadgetManagerService::scheduleStateChanged);
+    connect(m_capabilities, &GadgetCapabilities::availableModesChanged, this, &USBGadgetManagerService::scheduleStateChanged);
+    connect(m_dataPipe, &DataPipe::enabledChanged, this, &USBGadgetManagerService::scheduleStateChanged);
+    m_publishedState = state();
+}
+
+QVariantMap USBGadgetManagerService::state() const
+{
+    QVariantMap state;
+    state.insert(QStringLiteral("activeMode"), activeMode());
+    state.insert(QStringLiteral("availableModes"), availableModes());
+    state.insert(QStringLiteral("canDetectCableHotplugging"), canDetectCableHotplugging());
+    state.insert(QStringLiteral("usbCableStatus"), usbCableStatus());
+    state.insert(QStringLiteral("systemWideLockActive"), isSystemWideLockActive());
+    state.insert(QStringLiteral("systemWideLockOwner"), systemWideLockOwner());
+    state.insert(QStringLiteral("systemWideLockReason"), systemWideLockReason());
+    state.insert(QStringLiteral("dataPipeEnabled"), m_dataPipe->isEnabled());
+    return state;
+}
+
+void USBGadgetManagerService::scheduleStateChanged()
+{
+    if (!m_stateChangedTimer->isActive()) {
+        m_stateChangedTimer->start();
+    }
+}
+
+void USBGadgetManagerService::emitStateChanged()
+{
+    TraceSpan span(TraceBuffer::ServiceTrack, "event", QStringLiteral("emitStateChanged"));
+
+    QVariantMap current = state();
+    QVariantMap changed;
+
+    for (QVariantMap::const_iterator i = current.constBegin(); i != current.constEnd(); ++i) {
+        if (m_publishedState.value(i.key()) != i.value()) {
+            changed.insert(i.key(), i.value());
+        }
+    }
+
+    m_publishedState = current;
+
+    // Changes which reverted themselves within the transition are no changes.
+    if (!changed.isEmpty()) {
+        Q_EMIT StateChanged(changed);
+    }
+}
+
+QVariantMap USBGadgetManagerService::GetOperation()
+{
+    DBusMethodSpan span(this, QStringLiteral("GetOperation"));
+
+    QVariantMap operation;
+    operation.insert(QStringLiteral("pending"), m_scheduler->pendingRequests());
+
+    EthernetGadgetOperation *op = m_scheduler->runningOperation();
+    if (op) {
+        operation.insert(QStringLiteral("operation"), RequestScheduler::typeName(m_scheduler->runningType()));
+        operation.insert(QStringLiteral("mode"), static_cast<uint>(op->mode()));
+        operation.insert(QStringLiteral("stage"), EthernetGadgetOperation::stageName(op->stage()));
+        operation.insert(QStringLiteral("percent"), op->progress());
+        operation.insert(QStringLiteral("elapsed"), op->elapsedSoFar());
+    }
+
+    return operation;
+}
+
+QVariantMap USBGadgetManagerService::GetState()
+{
+    DBusMethodSpan span(this, QStringLiteral("GetState"));
+
+    return state();
+}
+
+void USBGadgetManagerService::restoreState()
+{
+    StateSnapshot snapshot = StateSnapshot::load(m_main ? controllerName(m_udc) : QString());
+
+    if (!snapshot.lockOwner.isEmpty() && QDBusConnection::systemBus().interface()->isServiceRegistered(snapshot.lockOwner)) {
+        m_systemWideLockOwner = snapshot.lockOwner;
+        m_systemWideLockReason = snapshot.lockReason;
+        m_lockOwnerWatcher->addWatchedService(m_systemWideLockOwner);
+    }
+
+    if (snapshot.activeMode == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+        return;
+    }
+
+    // Trust the snapshot only as long as the gadget it talks about is still there.
+    EthernetGadgetOperation::Options options;
+    QString errorMessage;
+    parseOptions(snapshot.activeMode, QVariantMap(), &options, &errorMessage);
+    bool gadgetUp = snapshot.backend == EthernetGadgetOperation::Backend::ConfigFS
+                        ? !(options.gadget.isEmpty() ? ConfigFSGadget() : ConfigFSGadget(options.gadget)).boundUDC().isEmpty()
+                        : KernelModules::isLoaded(EthernetGadgetOperation::legacyModule(snapshot.function));
+    if (!gadgetUp) {
+        qDebug() << "The USB Gadget went away since the state snapshot was taken, discarding it.";
+        saveState();
+        return;
+    }
+
+    // A FunctionFS function died with the ep0 we held: all that's left to do is cleaning up.
+    if (snapshot.activeMode == static_cast<uint>(GadgetModes::DataPipe)) {
+        qDebug() << "The data pipe did not survive the previous instance, tearing it down.";
+        ConfigFSGadget gadget = options.gadget.isEmpty() ? ConfigFSGadget() : ConfigFSGadget(options.gadget);
+        if (!gadget.unbind(&errorMessage)) {
+            qWarning() << "Could not unbind the stale data pipe:" << errorMessage;
+        }
+        DataPipe::unmount(DataPipe::instanceName(options.gadget));
+        if (!gadget.setFunctions(QList< ConfigFSGadget::Function >(), &errorMessage)) {
+            qWarning() << "Could not remove the stale data pipe function:" << errorMessage;
+        }
+        saveState();
+        return;
+    }
+
+    m_activeMode = snapshot.activeMode;
+    m_activeOptions.backend = snapshot.backend;
+    m_activeOptions.udc = snapshot.udc;
+    m_activeOptions.function = snapshot.function;
+    m_activeOptions.qmult = snapshot.qmult;
+    m_activeOptions.mtu = snapshot.mtu;
+    m_activeOptions.network = snapshot.network;
+    m_activeOptions.dhcpServer = snapshot.embeddedDHCP ? m_dhcpServer : nullptr;
+    m_activeOptions.gadget = options.gadget;
+    m_activeOptions.controller = options.controller;
+    m_activeInterfaceName = snapshot.interfaceName;
+    m_activeP2PAddress = snapshot.p2pAddress;
+
+    // dnsmasq lives on by itself, leases we serve don't.
+    if (GadgetModes::isPointToPoint(static_cast<Hemera::USBGadgetManager::Mode>(m_activeMode)) && snapshot.embeddedDHCP) {
+        if (!EthernetGadgetOperation::startP2PLeases(m_dhcpServer, m_activeInterfaceName, m_activeP2PAddress, &errorMessage)) {
+            qWarning() << "Could not resume serving P2P leases:" << errorMessage;
+        }
+    }
+
+    qDebug() << "Restored mode" << m_activeMode << "from the state snapshot.";
+}
+
+void USBGadgetManagerService::saveState()
+{
+    TraceSpan span(TraceBuffer::ServiceTrack, "event", QStringLiteral("saveState"));
+
+    StateSnapshot snapshot;
+    snapshot.activeMode = m_activeMode;
+    snapshot.backend = m_activeOptions.backend;
+    snapshot.udc = m_activeOptions.udc;
+    snapshot.function = m_activeOptions.function;
+    snapshot.qmult = m_activeOptions.qmult;
+    snapshot.mtu = m_activeOptions.mtu;
+    snapshot.network = m_activeOptions.network;
+    snapshot.embeddedDHCP = m_activeOptions.dhcpServer != nullptr;
+    snapshot.interfaceName = m_activeInterfaceName;
+    snapshot.p2pAddress = m_activeP2PAddress;
+    snapshot.lockOwner = m_systemWideLockOwner;
+    snapshot.lockReason = m_systemWideLockReason;
+
+    QString errorMessage;
+    if (!snapshot.save(m_main ? controllerName(m_udc) : QString(), &errorMessage)) {
+        qWarning() << errorMessage;
+    }
+}
+
+void USBGadgetManagerService::rearmIdleTimer()
+{
+    // There's one process for all controllers: the main object decides for all of them.
+    if (m_main) {
+        m_main->rearmIdleTimer();
+        return;
+    }
+
+    // A hotplug policy waiting for a cable can't survive us either, nor can a trace nobody dumped yet.
+    bool busy = isBusy() || isHotplugPending() || TraceBuffer::isEnabled();
+    for (USBGadgetManagerService *controller : m_controllers) {
+        busy = busy || controller->isBusy();
+    }
+    if (busy) {
+        killerTimer->stop();
+        return;
+    }
+
+    killerTimer->start();
+}
+
+void USBGadgetManagerService::onCableStatusChanged()
+{
+    TraceSpan span(TraceBuffer::ServiceTrack, "event", QStringLiteral("onCableStatusChanged"));
+
+    // Some other UDC's cable, most likely.
+    uint status = cableStatus();
+    if (status == m_usbCableStatus) {
+        return;
+    }
+    m_usbCableStatus = status;
+    Q_EMIT usbCableStatusChanged();
+
+    // The policy is about the main UDC.
+    if (m_main || status != static_cast<uint>(USBCableMonitor::Status::Connected)) {
+        return;
+    }
+
+    // Opt-in: bring the configured mode up as soon as a host shows up.
+    uint mode = 0;
+    EthernetGadgetOperation::Options options;
+    QString errorMessage;
+    QByteArray policy = hotplugPolicy(&mode, &options, &errorMessage);
+    if (policy.isEmpty()) {
+        if (!errorMessage.isEmpty()) {
+            qWarning() << "Hotplug policy can't be applied:" << errorMessage;
+        }
+        return;
+    } else if (!m_systemWideLockOwner.isEmpty() || !m_scheduler->isIdle() ||
+               m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+        return;
+    }
+
+    // Just the gadget, for prearm: clients calling Activate will find it enumerated already.
+    RequestScheduler::Type type = policy == "prearm" ? RequestScheduler::Type::Prepare : RequestScheduler::Type::Activate;
+    m_scheduler->schedule(type, mode, options, [type] (const QString &errorName, const QString &errorMessage) {
+        if (!errorName.isEmpty()) {
+            qWarning() << "Hotplug policy failed to" << RequestScheduler::typeName(type) << "the USB Gadget:" << errorName << errorMessage;
+        }
+    });
+}
+
+QByteArray USBGadgetManagerService::hotplugPolicy(uint *mode, EthernetGadgetOperation::Options *options, QString *errorMessage) const
+{
+    // The policy is about the main UDC.
+    QByteArray policy = qgetenv("GRAVITY_USB_GADGET_HOTPLUG_POLICY");
+    if (m_main || policy.isEmpty()) {
+        return QByteArray();
+    } else if (policy != "prearm" && policy != "activate") {
+        *errorMessage = QStringLiteral("%1 is not a known policy. Use either prearm or activate.").arg(QString::fromLatin1(policy));
+        return QByteArray();
+    } else if (!m_canDetectCableHotplugging) {
+        *errorMessage = QStringLiteral("The USB cable can't be detected on this system.");
+        return QByteArray();
+    }
+
+    *mode = qgetenv("GRAVITY_USB_GADGET_HOTPLUG_MODE").toUInt();
+    if (!(*mode & m_capabilities->availableModes()) || !GadgetModes::isEthernet(static_cast<Hemera::USBGadgetManager::Mode>(*mode))) {
+        *errorMessage = QStringLiteral("GRAVITY_USB_GADGET_HOTPLUG_MODE must be an available Ethernet mode.");
+        return QByteArray();
+    } else if (!parseOptions(*mode, QVariantMap(), options, errorMessage)) {
+        return QByteArray();
+    }
+    *errorMessage = m_capabilities->unavailabilityReason(*mode, *options);
+    if (!errorMessage->isEmpty()) {
+        return QByteArray();
+    }
+
+    return policy;
+}
+
+bool USBGadgetManagerService::isHotplugPending() const
+{
+    uint mode = 0;
+    EthernetGadgetOperation::Options options;
+    QString errorMessage;
+    QByteArray policy = hotplugPolicy(&mode, &options, &errorMessage);
+
+    // Once the mode is up, or the gadget for prearm, there's nothing left for a cable to trigger.
+    return !policy.isEmpty() && m_activeMode == static_cast<uint>(Hemera::USBGadgetManager::Mode::None) &&
+           !(policy == "prearm" && m_hotplugPrepared);
+}
+
+void USBGadgetManagerService::trackOperation(const QString &operation, EthernetGadgetOperation *op)
+{
+    // Operations run on our event loop: report where they are, so a slow activation is never a black box.
+    connect(op, &EthernetGadgetOperation::stageChanged, this, [this, op] (EthernetGadgetOperation::Stage stage) {
+        QString stageName = EthernetGadgetOperation::stageName(stage);
+        sd_notifyf(0, "STATUS=USB Gadget Manager is active. Current operation stage: %s.\n", stageName.toLatin1().constData());
+        Q_EMIT OperationProgress(static_cast<uint>(op->mode()), stageName, op->progress());
+    });
+    connect(op, &Hemera::Operation::finished, this, [this, operation, op] {
+        sd_notify(0, "STATUS=USB Gadget Manager is active.\n");
+        recordOperation(operation, op);
+    });
+}
+
+void USBGadgetManagerService::recordOperation(const QString &operation, EthernetGadgetOperation *op)
+{
+    QString series = operation + QLatin1Char('/') + GadgetModes::name(static_cast<uint>(op->mode())) + QLatin1Char('/');
+
+    // Structured fields, so that time-to-link can be queried straight from the journal.
+    QList< QByteArray > fields;
+    fields << QStringLiteral("MESSAGE=USB Gadget %1 for mode %2 %3 in %4 ms")
+                  .arg(operation, GadgetModes::name(static_cast<uint>(op->mode())), op->isError() ? QStringLiteral("failed") : QStringLiteral("completed"))
+                  .arg(op->elapsed() / 1000).toUtf8()
+           << "USB_GADGET_OPERATION=" + operation.toLatin1()
+           << "USB_GADGET_MODE=" + GadgetModes::name(static_cast<uint>(op->mode())).toLatin1()
+           << "USB_GADGET_RESULT=" + (op->isError() ? op->errorName().toLatin1() : QByteArray("success"))
+           << "USB_GADGET_TOTAL_USEC=" + QByteArray::number(op->elapsed());
+
+    // Operations which gave up early would drag percentiles down: they get series of their own, totals only.
+    QString total = op->isError() ? (op->isCancelRequested() ? QStringLiteral("Canceled") : QStringLiteral("Failed")) : QStringLiteral("Total");
+    for (const QPair< EthernetGadgetOperation::Stage, qint64 > &timing : op->stageTimings()) {
+        QString stageName = EthernetGadgetOperation::stageName(timing.first);
+        if (!op->isError()) {
+            m_latencyStatistics.record(series + stageName, timing.second);
+        }
+        fields << "USB_GADGET_STAGE_" + stageName.toUpper().toLatin1() + "_USEC=" + QByteArray::number(timing.second);
+    }
+    m_latencyStatistics.record(series + total, op->elapsed());
+
+    if (TraceBuffer::isEnabled()) {
+        TraceBuffer::complete(TraceBuffer::operationTrack(op->options().udc), "operation", series + total,
+                              TraceBuffer::now() - op->elapsed(), op->elapsed(), op->isError() ? op->errorName() : QString());
+    }
+
+    sendJournalFields(fields);
+}
+
+void USBGadgetManagerService::recordStartupMilestone(const QString &milestone)
 {
+    qint64 usecs = m_startupTimer.nsecsElapsed() / 1000;
+    m_latencyStatistics.record(QStringLiteral("Startup/") + milestone, usecs);
+
+    QList< QByteArray > fields;
+    fields << QStringLiteral("MESSAGE=USB Gadget Manager startup: %1 after %2 ms").arg(milestone).arg(usecs / 1000).toUtf8()
+           << "USB_GADGET_STARTUP_MILESTONE=" + milestone.toLatin1()
+           << "USB_GADGET_STARTUP_USEC=" + QByteArray::number(usecs);
+    sendJournalFields(fields);
+}
+
+void USBGadgetManagerService::recordFirstReply()
+{
+    if (m_main) {
+        m_main->recordFirstReply();
+        return;
+    } else if (m_firstReplySent) {
+        return;
+    }
+
+    m_firstReplySent = true;
+    recordStartupMilestone(QStringLiteral("FirstReply"));
+}
+
+void USBGadgetManagerService::recordMethodReturn()
+{
+    if (calledFromDBus() && !message().isDelayedReply()) {
+        recordFirstReply();
+    }
+}
+
+void USBGadgetManagerService::sendJournalFields(const QList< QByteArray > &fields)
+{
+    QVector< struct iovec > iov;
+    iov.reserve(fields.size());
+    for (const QByteArray &field : fields) {
+        struct iovec entry;
+        entry.iov_base = const_cast<char*>(field.constData());
+        entry.iov_len = field.size();
+        iov.append(entry);
+    }
+    sd_journal_sendv(iov.constData(), iov.size());
+}
+
+QVariantMap USBGadgetManagerService::GetLatencyStatistics()
+{
+    DBusMethodSpan span(this, QStringLiteral("GetLatencyStatistics"));
+
+    return m_latencyStatistics.toVariantMap();
+}
+
+QVariantMap USBGadgetManagerService::GetLinkStatistics()
+{
+    DBusMethodSpan span(this, QStringLiteral("GetLinkStatistics"));
+
+    return m_linkStatistics->toVariantMap();
+}
+
+void USBGadgetManagerService::SetTracing(bool enabled)
+{
+    DBusMethodSpan span(this, QStringLiteral("SetTracing"));
+
+    TraceBuffer::setEnabled(enabled);
+    rearmIdleTimer();
+}
+
+QString USBGadgetManagerService::DumpTrace()
+{
+    DBusMethodSpan span(this, QStringLiteral("DumpTrace"));
+
+    return QString::fromUtf8(TraceBuffer::toChromeTrace());
+}
+
+QDBusUnixFileDescriptor USBGadgetManagerService::OpenDataPipe(QDBusUnixFileDescriptor &out)
+{
+    DBusMethodSpan span(this, QStringLiteral("OpenDataPipe"));
+
     if (!calledFromDBus()) {
         qWarning() << "Something's wrong with callers!";
-        return;
+        return QDBusUnixFileDescriptor();
     }
 
-    // Do we have a lock?
+    // Do we have a lock? Endpoints carry the host's traffic: they're the lock owner's, if there's one.
     if (!m_systemWideLockOwner.isEmpty() && m_systemWideLockOwner != message().service()) {
         sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
-                       QStringLiteral("You have requested activation, but %1 is holding the system lock. "
-                                      "You cannot activate or deactivate while somebody else is holding the lock.").arg(m_systemWideLockOwner));
+                       QStringLiteral("You have requested the data pipe, but %1 is holding the system lock.").arg(m_systemWideLockOwner));
+        return QDBusUnixFileDescriptor();
+    }
+
+    int inFd;
+    int outFd;
+    QString errorMessage;
+    if (m_activeMode != static_cast<uint>(GadgetModes::DataPipe)) {
+        errorMessage = QStringLiteral("DataPipe is not the active mode.");
+    } else if (!m_dataPipeHolder.isEmpty()) {
+        errorMessage = QStringLiteral("The data pipe endpoints were handed to %1 already.").arg(m_dataPipeHolder);
+    } else if (m_dataPipe->isSending()) {
+        errorMessage = QStringLiteral("The data pipe is sending a file to the host.");
+    }
+    if (!errorMessage.isEmpty() || !m_dataPipe->openEndpoints(&inFd, &outFd, &errorMessage)) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()), errorMessage);
+        return QDBusUnixFileDescriptor();
+    }
+
+    m_dataPipeHolder = message().service();
+    m_dataPipeHolderWatcher->setWatchedServices(QStringList() << m_dataPipeHolder);
+
+    // The descriptors go to the caller, and we're done with them.
+    QDBusUnixFileDescriptor in;
+    in.giveFileDescriptor(inFd);
+    out.giveFileDescriptor(outFd);
+    return in;
+}
+
+void USBGadgetManagerService::SendToHost(const QDBusUnixFileDescriptor &source)
+{
+    DBusMethodSpan span(this, QStringLiteral("SendToHost"));
+
+    if (!calledFromDBus()) {
+        qWarning() << "Something's wrong with callers!";
         return;
     }
 
-    // Is there anything active?
-    if (m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+    // Do we have a lock?
+    if (!m_systemWideLockOwner.isEmpty() && m_systemWideLockOwner != message().service()) {
         sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
-                       QStringLiteral("You have requested activation, but there's already an active mode on the USB Gadget. "
-                                      "Call Deactivate first, then retry."));
+                       QStringLiteral("You have requested to send to the host, but %1 is holding the system lock.").arg(m_systemWideLockOwner));
         return;
     }
 
-    // Is it available at runtime?
-    if (!(mode & m_availableModes)) {
+    if (m_activeMode != static_cast<uint>(GadgetModes::DataPipe)) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()), QStringLiteral("DataPipe is not the active mode."));
+        return;
+    } else if (!m_dataPipeHolder.isEmpty()) {
+        // Our writes and theirs would interleave on the IN endpoint.
         sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
-                       QStringLiteral("The requested mode is not available on this device."));
+                       QStringLiteral("The data pipe endpoints were handed to %1: it does the sending.").arg(m_dataPipeHolder));
+        return;
+    } else if (!source.isValid()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), QStringLiteral("The file descriptor is not valid."));
+        return;
+    } else if (!m_dataPipe->isEnabled()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                       QStringLiteral("The host has not enabled the data pipe yet: wait for dataPipeEnabled."));
         return;
     }
 
-    Hemera::Operation *op = nullptr;
+    // The pipe takes its own copy of the descriptor, and the reply waits until the host has it all.
+    QString errorMessage;
+    RequestScheduler::Reply reply = delayReply();
+    if (!m_dataPipe->send(source.fileDescriptor(), reply, &errorMessage)) {
+        reply(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
+    }
+}
 
-    switch (static_cast<Hemera::USBGadgetManager::Mode>(mode)) {
-        case Hemera::USBGadgetManager::Mode::EthernetP2P:
-            op = new ActivateEthernetGadget(Hemera::USBGadgetManager::Mode::EthernetP2P, this);
+bool USBGadgetManagerService::parseOptions(uint mode, const QVariantMap &arguments, EthernetGadgetOperation::Options *options,
+                                           QString *errorMessage) const
+{
+    // Which gadget backend?
+    bool ok;
+    options->backend = EthernetGadgetOperation::backendFromName(
+            arguments.value(QStringLiteral("backend"), QString::fromLatin1(qgetenv("GRAVITY_USB_GADGET_BACKEND"))).toString(), &ok);
+    if (!ok) {
+        *errorMessage = QStringLiteral("The requested gadget backend is unknown. Use either legacy or configfs.");
+        return false;
+    }
+    // Disks and data pipes are ConfigFS only: the environment's default doesn't count against them.
+    if (mode == static_cast<uint>(GadgetModes::MassStorage) || mode == static_cast<uint>(GadgetModes::DataPipe)) {
+        if (arguments.contains(QStringLiteral("backend")) && options->backend != EthernetGadgetOperation::Backend::ConfigFS) {
+            *errorMessage = QStringLiteral("%1 runs on the configfs backend only.").arg(GadgetModes::name(mode));
+            return false;
+        }
+        options->backend = EthernetGadgetOperation::Backend::ConfigFS;
+    }
+    if (mode == static_cast<uint>(GadgetModes::DataPipe)) {
+        options->dataPipe = m_dataPipe;
+    }
+    options->udc = arguments.value(QStringLiteral("udc")).toString();
+
+    // Who configures the network? The build picks, the environment and then callers can override.
+    QString network = QString::fromLatin1(qgetenv("GRAVITY_USB_GADGET_NETWORK"));
+    if (network.isEmpty()) {
+        network = QStringLiteral(GRAVITY_USB_GADGET_MANAGER_DEFAULT_NETWORK);
+    }
+    options->network = EthernetGadgetOperation::networkFromName(arguments.value(QStringLiteral("network"), network).toString(), &ok);
+    if (!ok) {
+        *errorMessage = QStringLiteral("The requested network configuration is unknown. Use either connman or rtnetlink.");
+        return false;
+    }
+
+    // Which USB function? NCM mode is what the name says.
+    if (arguments.contains(QStringLiteral("function"))) {
+        options->function = EthernetGadgetOperation::functionFromName(arguments.value(QStringLiteral("function")).toString(), &ok);
+        if (!ok) {
+            *errorMessage = QStringLiteral("The requested USB function is unknown. Use either ecm, ncm or rndis.");
+            return false;
+        } else if (mode == static_cast<uint>(GadgetModes::EthernetNCM) && options->function != EthernetGadgetOperation::Function::NCM) {
+            *errorMessage = QStringLiteral("EthernetNCM mode runs on the NCM function only.");
+            return false;
+        }
+    } else if (mode == static_cast<uint>(GadgetModes::EthernetNCM)) {
+        options->function = EthernetGadgetOperation::Function::NCM;
+    }
+
+    // Link tuning.
+    if (arguments.contains(QStringLiteral("qmult"))) {
+        options->qmult = arguments.value(QStringLiteral("qmult")).toUInt(&ok);
+        if (!ok || options->qmult == 0) {
+            *errorMessage = QStringLiteral("qmult must be a positive integer.");
+            return false;
+        }
+    }
+    if (arguments.contains(QStringLiteral("mtu"))) {
+        options->mtu = arguments.value(QStringLiteral("mtu")).toUInt(&ok);
+        if (!ok || options->mtu < minimumMTU() || options->mtu > maximumMTU()) {
+            *errorMessage = QStringLiteral("mtu must be between %1 and %2.").arg(minimumMTU()).arg(maximumMTU());
+            return false;
+        }
+    }
+
+    // Which disk, and how the host gets to see it.
+    options->image = arguments.value(QStringLiteral("file")).toString();
+    options->imageSource = arguments.value(QStringLiteral("directory")).toString();
+    if ((!options->image.isEmpty() && QDir::isRelativePath(options->image)) ||
+        (!options->imageSource.isEmpty() && QDir::isRelativePath(options->imageSource))) {
+        *errorMessage = QStringLiteral("file and directory must be absolute paths.");
+        return false;
+    } else if (!options->imageSource.isEmpty() && options->image.isEmpty()) {
+        *errorMessage = QStringLiteral("An image built from a directory needs a file to go to.");
+        return false;
+    } else if (mode == static_cast<uint>(GadgetModes::MassStorage) && !ActivateMassStorageGadget::resolveImagePaths(options, errorMessage)) {
+        return false;
+    }
+    if (arguments.contains(QStringLiteral("imageSize"))) {
+        options->imageSize = arguments.value(QStringLiteral("imageSize")).toULongLong(&ok);
+        if (!ok) {
+            *errorMessage = QStringLiteral("imageSize must be a size in bytes.");
+            return false;
+        }
+    }
+    options->readOnly = arguments.value(QStringLiteral("readOnly"), false).toBool();
+    options->removable = arguments.value(QStringLiteral("removable"), true).toBool();
+    options->noFUA = arguments.value(QStringLiteral("nofua"), false).toBool();
+
+    // Which DHCP server, for P2P?
+    QString dhcpServer = arguments.value(QStringLiteral("dhcpServer"), QString::fromLatin1(qgetenv("GRAVITY_USB_GADGET_DHCP_SERVER"))).toString();
+    if (dhcpServer == QStringLiteral("embedded")) {
+        options->dhcpServer = m_dhcpServer;
+    } else if (!dhcpServer.isEmpty() && dhcpServer != QStringLiteral("dnsmasq")) {
+        *errorMessage = QStringLiteral("The requested DHCP server is unknown. Use either dnsmasq or embedded.");
+        return false;
+    }
+
+    // Legacy modules, connman's gadget technology and dnsmasq's unit are one per system: they belong to the main UDC.
+    if (m_main) {
+        if (arguments.contains(QStringLiteral("backend")) && options->backend != EthernetGadgetOperation::Backend::ConfigFS) {
+            *errorMessage = QStringLiteral("Additional USB Device Controllers run on the configfs backend only.");
+            return false;
+        } else if (arguments.contains(QStringLiteral("network")) && options->network != EthernetGadgetOperation::Network::RtNetlink) {
+            *errorMessage = QStringLiteral("Additional USB Device Controllers configure their network through rtnetlink only.");
+            return false;
+        } else if (arguments.contains(QStringLiteral("dhcpServer")) && dhcpServer != QStringLiteral("embedded")) {
+            *errorMessage = QStringLiteral("Additional USB Device Controllers serve P2P leases through the embedded DHCP server only.");
+            return false;
+        } else if (!options->udc.isEmpty() && options->udc != m_udc) {
+            *errorMessage = QStringLiteral("This object drives %1 only. Call GetControllers to find the one driving %2.").arg(m_udc, options->udc);
+            return false;
+        }
+
+        options->backend = EthernetGadgetOperation::Backend::ConfigFS;
+        options->network = EthernetGadgetOperation::Network::RtNetlink;
+        options->dhcpServer = m_dhcpServer;
+        options->udc = m_udc;
+        options->gadget = QStringLiteral("hemera_") + controllerName(m_udc);
+        options->controller = m_controller;
+    } else if (m_controllers.contains(options->udc)) {
+        *errorMessage = QStringLiteral("%1 is driven by %2.").arg(options->udc, m_controllers.value(options->udc)->objectPath());
+        return false;
+    }
+
+    return true;
+}
+
+EthernetGadgetOperation *USBGadgetManagerService::createOperation(const RequestScheduler::Request &request, QString *errorMessage)
+{
+    EthernetGadgetOperation *op = nullptr;
+    uint mode = request.mode;
+
+    switch (request.type) {
+        case RequestScheduler::Type::Activate:
+            switch (static_cast<Hemera::USBGadgetManager::Mode>(mode)) {
+                case Hemera::USBGadgetManager::Mode::EthernetP2P:
+                case Hemera::USBGadgetManager::Mode::EthernetTethering:
+                case GadgetModes::EthernetNCM:
+                    op = new ReconcileEthernetGadget(static_cast<Hemera::USBGadgetManager::Mode>(mode), ReconcileEthernetGadget::Target::Active,
+                                                     request.options, this);
+                    break;
+                case GadgetModes::MassStorage:
+                    op = new ActivateMassStorageGadget(request.options, this);
+                    break;
+                case GadgetModes::DataPipe:
+                    op = new ActivateDataPipeGadget(request.options, this);
+                    break;
+                default:
+                    *errorMessage = QStringLiteral("The mode you requested is either not implemented or not available.");
+                    return nullptr;
+            }
+
+            trackOperation(QStringLiteral("Activate"), op);
+            connect(op, &Hemera::Operation::finished, this, [this, op, mode] {
+                if (!op->isError()) {
+                    m_activeOptions = op->options();
+                    m_activeInterfaceName = op->interfaceName();
+                    m_activeP2PAddress = op->p2pAddress();
+                    m_activeMode = mode;
+                    Q_EMIT activeModeChanged();
+                }
+            });
             break;
-        case Hemera::USBGadgetManager::Mode::EthernetTethering:
-            op = new ActivateEthernetGadget(Hemera::USBGadgetManager::Mode::EthernetTethering, this);
+        case RequestScheduler::Type::Deactivate: {
+            // A rollback has to clean up after an activation which never made it, the others after the active mode.
+            EthernetGadgetOperation::Options options = m_activeOptions;
+            if (m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                mode = m_activeMode;
+            } else if (request.rollback) {
+                options = request.options;
+            } else {
+                *errorMessage = QStringLiteral("You have requested deactivation, but there's no active modes on the USB Gadget.");
+                return nullptr;
+            }
+
+            switch (static_cast<Hemera::USBGadgetManager::Mode>(mode)) {
+                case Hemera::USBGadgetManager::Mode::EthernetP2P:
+                case Hemera::USBGadgetManager::Mode::EthernetTethering:
+                case GadgetModes::EthernetNCM:
+                    op = new ReconcileEthernetGadget(static_cast<Hemera::USBGadgetManager::Mode>(mode), ReconcileEthernetGadget::Target::Inactive,
+                                                     options, this);
+                    break;
+                case GadgetModes::MassStorage:
+                    op = new DeactivateMassStorageGadget(options, this);
+                    break;
+                case GadgetModes::DataPipe:
+                    op = new DeactivateDataPipeGadget(options, this);
+                    break;
+                default:
+                    *errorMessage = QStringLiteral("The mode you requested is either not implemented or not available.");
+                    return nullptr;
+            }
+
+            trackOperation(QStringLiteral("Deactivate"), op);
+            connect(op, &Hemera::Operation::finished, this, [this, op] {
+                if (!op->isError()) {
+                    // The gadget is down, whoever brought it up.
+                    m_hotplugPrepared = false;
+                }
+                if (!op->isError() && m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                    m_activeInterfaceName.clear();
+                    m_activeP2PAddress.clear();
+                    m_activeMode = static_cast<uint>(Hemera::USBGadgetManager::Mode::None);
+                    Q_EMIT activeModeChanged();
+                }
+            });
+            break;
+        }
+        case RequestScheduler::Type::SwitchMode:
+            if (m_activeMode == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                *errorMessage = QStringLiteral("There's no active mode to switch from: the previous request failed.");
+                return nullptr;
+            } else if (mode == m_activeMode && request.options == m_activeOptions) {
+                // Already there.
+                return nullptr;
+            }
+
+            switch (static_cast<Hemera::USBGadgetManager::Mode>(mode)) {
+                case Hemera::USBGadgetManager::Mode::EthernetP2P:
+                case Hemera::USBGadgetManager::Mode::EthernetTethering:
+                case GadgetModes::EthernetNCM:
+                    // Reconciling towards the new mode takes down whatever belongs to the old one, and keeps the rest.
+                    op = new ReconcileEthernetGadget(static_cast<Hemera::USBGadgetManager::Mode>(mode), ReconcileEthernetGadget::Target::Active,
+                                                     request.options, this);
+                    break;
+                default:
+                    *errorMessage = QStringLiteral("The mode you requested is either not implemented or not available.");
+                    return nullptr;
+            }
+
+            trackOperation(QStringLiteral("SwitchMode"), op);
+            connect(op, &Hemera::Operation::finished, this, [this, op, mode] {
+                // On failure, the old mode is still what Deactivate has to clean up.
+                if (!op->isError()) {
+                    m_activeOptions = op->options();
+                    m_activeInterfaceName = op->interfaceName();
+                    m_activeP2PAddress = op->p2pAddress();
+                    m_activeMode = mode;
+                    Q_EMIT activeModeChanged();
+                }
+            });
+            break;
+        case RequestScheduler::Type::Prepare:
+            if (m_activeMode != static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+                // An active mode has its gadget up already.
+                return nullptr;
+            }
+
+            op = new ReconcileEthernetGadget(static_cast<Hemera::USBGadgetManager::Mode>(mode), ReconcileEthernetGadget::Target::Prepared,
+                                             request.options, this);
+            trackOperation(QStringLiteral("Prepare"), op);
+            connect(op, &Hemera::Operation::finished, this, [this, op] {
+                if (!op->isError()) {
+                    m_hotplugPrepared = true;
+                }
+            });
             break;
-        default:
-            sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                           QStringLiteral("The mode you requested is either not implemented or not available."));
-            return;
     }
 
-    // It's ok if we're here, delay reply.
+    return op;
+}
+
+RequestScheduler::Reply USBGadgetManagerService::delayReply()
+{
     setDelayedReply(true);
 
     QDBusMessage originMessage = message();
     QDBusConnection originConnection = connection();
 
-    connect(op, &Hemera::Operation::finished, [this, op, originConnection, originMessage, mode] {
-        if (op->isError()) {
-            originConnection.send(originMessage.createErrorReply(op->errorName(), op->errorMessage()));
+    return [this, originConnection, originMessage] (const QString &errorName, const QString &errorMessage) {
+        recordFirstReply();
+        if (TraceBuffer::isEnabled()) {
+            TraceBuffer::instant(TraceBuffer::ServiceTrack, "reply", originMessage.member(), errorName);
+        }
+        if (!errorName.isEmpty()) {
+            originConnection.send(originMessage.createErrorReply(errorName, errorMessage));
         } else {
             originConnection.send(originMessage.createReply());
-
-            m_activeMode = mode;
-            Q_EMIT activeModeChanged();
         }
-    });
+    };
+}
+
+void USBGadgetManagerService::Activate(uint mode, const QVariantMap& arguments)
+{
+    DBusMethodSpan span(this, QStringLiteral("Activate"));
+
+    if (!calledFromDBus()) {
+        qWarning() << "Something's wrong with callers!";
+        return;
+    }
+
+    // Do we have a lock?
+    if (!m_systemWideLockOwner.isEmpty() && m_systemWideLockOwner != message().service()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                       QStringLiteral("You have requested activation, but %1 is holding the system lock. "
+                                      "You cannot activate or deactivate while somebody else is holding the lock.").arg(m_systemWideLockOwner));
+        return;
+    }
+
+    EthernetGadgetOperation::Options options;
+    QString errorMessage;
+    if (!parseOptions(mode, arguments, &options, &errorMessage)) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), errorMessage);
+        return;
+    } else if (mode == static_cast<uint>(GadgetModes::MassStorage) && options.image.isEmpty()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                       QStringLiteral("MassStorage needs a disk image: pass its path as file, and a directory to build it from if needed."));
+        return;
+    }
+
+    // Can it work at all? Better to say why now than after a few timeouts.
+    if (GadgetModes::isEthernet(static_cast<Hemera::USBGadgetManager::Mode>(mode)) && options.network == EthernetGadgetOperation::Network::Connman) {
+        m_capabilities->bindNetworkManager();
+    }
+    errorMessage = m_capabilities->unavailabilityReason(mode, options);
+    if (!errorMessage.isEmpty()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()), errorMessage);
+        return;
+    }
+
+    // The scheduler takes it from here, and replies when it's done.
+    m_scheduler->schedule(RequestScheduler::Type::Activate, mode, options, delayReply());
+    rearmIdleTimer();
 }
 
 void USBGadgetManagerService::Deactivate()
 {
+    DBusMethodSpan span(this, QStringLiteral("Deactivate"));
+
     if (!calledFromDBus()) {
         qWarning() << "Something's wrong with callers!";
         return;
@@ -139,49 +1168,133 @@ void USBGadgetManagerService::Deactivate()
         return;
     }
 
-    // Is there anything active?
-    if (m_activeMode == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+    m_scheduler->schedule(RequestScheduler::Type::Deactivate, m_scheduler->projectedMode(), m_activeOptions, delayReply());
+    rearmIdleTimer();
+}
+
+void USBGadgetManagerService::CancelOperation()
+{
+    DBusMethodSpan span(this, QStringLiteral("CancelOperation"));
+
+    if (!calledFromDBus()) {
+        qWarning() << "Something's wrong with callers!";
+        return;
+    }
+
+    // Do we have a lock?
+    if (!m_systemWideLockOwner.isEmpty() && m_systemWideLockOwner != message().service()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                       QStringLiteral("%1 is holding the system lock: only it can cancel operations.").arg(m_systemWideLockOwner));
+        return;
+    }
+
+    // Its own callers get the error, we're done as soon as it's asked for.
+    if (!m_scheduler->cancel()) {
         sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
-                       QStringLiteral("You have requested deactivation, but there's no active modes on the USB Gadget."));
+                       QStringLiteral("There is no running operation to cancel."));
+    }
+}
+
+void USBGadgetManagerService::SwitchMode(uint mode, const QVariantMap &arguments)
+{
+    DBusMethodSpan span(this, QStringLiteral("SwitchMode"));
+
+    if (!calledFromDBus()) {
+        qWarning() << "Something's wrong with callers!";
         return;
     }
 
-    // Ok now.
-    Hemera::Operation *op = nullptr;
+    // Nothing to switch from: that's a plain activation.
+    if (m_scheduler->projectedMode() == static_cast<uint>(Hemera::USBGadgetManager::Mode::None)) {
+        Activate(mode, arguments);
+        return;
+    }
 
-    switch (static_cast<Hemera::USBGadgetManager::Mode>(m_activeMode)) {
-        case Hemera::USBGadgetManager::Mode::EthernetP2P:
-            op = new DeactivateEthernetGadget(Hemera::USBGadgetManager::Mode::EthernetP2P, this);
-            break;
-        case Hemera::USBGadgetManager::Mode::EthernetTethering:
-            op = new DeactivateEthernetGadget(Hemera::USBGadgetManager::Mode::EthernetTethering, this);
-            break;
-        default:
-            sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                           QStringLiteral("The mode you requested is either not implemented or not available."));
+    // Do we have a lock?
+    if (!m_systemWideLockOwner.isEmpty() && m_systemWideLockOwner != message().service()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()),
+                       QStringLiteral("You have requested a mode switch, but %1 is holding the system lock. "
+                                      "You cannot activate or deactivate while somebody else is holding the lock.").arg(m_systemWideLockOwner));
+        return;
+    }
+
+    // Disks, pipes and networks have nothing in common to keep.
+    for (uint side : { mode, m_scheduler->projectedMode() }) {
+        if (side == static_cast<uint>(GadgetModes::MassStorage) || side == static_cast<uint>(GadgetModes::DataPipe)) {
+            sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                           QStringLiteral("%1 can't be switched to or from. Call Deactivate first, then Activate.").arg(GadgetModes::name(side)));
             return;
+        }
     }
 
-    // It's ok if we're here, delay reply.
-    setDelayedReply(true);
+    // Arguments mean what they mean to Activate, and those left out keep their values. What they're checked against is
+    // what the gadget will be running once everything scheduled before went through.
+    EthernetGadgetOperation::Options current = m_scheduler->projectedOptions(m_activeOptions);
+    EthernetGadgetOperation::Options options;
+    QString errorMessage;
+    if (!parseOptions(mode, arguments, &options, &errorMessage)) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), errorMessage);
+        return;
+    }
+    if (!arguments.contains(QStringLiteral("backend"))) {
+        options.backend = current.backend;
+    }
+    if (!arguments.contains(QStringLiteral("network"))) {
+        options.network = current.network;
+    }
+    if (!arguments.contains(QStringLiteral("function")) && mode != static_cast<uint>(GadgetModes::EthernetNCM)) {
+        options.function = current.function;
+    }
+    if (!arguments.contains(QStringLiteral("udc"))) {
+        options.udc = current.udc;
+    }
+    if (!arguments.contains(QStringLiteral("dhcpServer"))) {
+        options.dhcpServer = current.dhcpServer;
+    }
+    if (!arguments.contains(QStringLiteral("qmult"))) {
+        options.qmult = current.qmult;
+    }
+    if (!arguments.contains(QStringLiteral("mtu"))) {
+        options.mtu = current.mtu;
+    }
 
-    QDBusMessage originMessage = message();
-    QDBusConnection originConnection = connection();
+    // Switching keeps the gadget, and whatever runs on it: link tuning is all that can change.
+    QString unchangeable;
+    if (options.backend != current.backend) {
+        unchangeable = QStringLiteral("the gadget backend");
+    } else if (options.network != current.network) {
+        unchangeable = QStringLiteral("what configures the network");
+    } else if (options.function != current.function) {
+        unchangeable = QStringLiteral("the USB function");
+    } else if (options.udc != current.udc) {
+        unchangeable = QStringLiteral("the USB Device Controller");
+    } else if (options.dhcpServer != current.dhcpServer) {
+        unchangeable = QStringLiteral("the DHCP server");
+    }
+    if (!unchangeable.isEmpty()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                       QStringLiteral("A mode switch can't change %1. Call Deactivate first, then Activate.").arg(unchangeable));
+        return;
+    }
 
-    connect(op, &Hemera::Operation::finished, [this, op, originConnection, originMessage] {
-        if (op->isError()) {
-            originConnection.send(originMessage.createErrorReply(op->errorName(), op->errorMessage()));
-        } else {
-            originConnection.send(originMessage.createReply());
+    // Can it work at all?
+    if (options.network == EthernetGadgetOperation::Network::Connman) {
+        m_capabilities->bindNetworkManager();
+    }
+    QString reason = m_capabilities->unavailabilityReason(mode, options);
+    if (!reason.isEmpty()) {
+        sendErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notAllowed()), reason);
+        return;
+    }
 
-            m_activeMode = static_cast<uint>(Hemera::USBGadgetManager::Mode::None);
-            Q_EMIT activeModeChanged();
-        }
-    });
+    m_scheduler->schedule(RequestScheduler::Type::SwitchMode, mode, options, delayReply());
+    rearmIdleTimer();
 }
 
 void USBGadgetManagerService::AcquireSystemWideLock(const QString& reason)
 {
+    DBusMethodSpan span(this, QStringLiteral("AcquireSystemWideLock"));
+
     if (!calledFromDBus()) {
         qWarning() << "Something's wrong with callers!";
         return;
@@ -205,14 +1318,17 @@ void USBGadgetManagerService::AcquireSystemWideLock(const QString& reason)
     // Ok then.
     m_systemWideLockOwner = newOwner;
     m_systemWideLockReason = reason;
-    Q_EMIT systemWideLockChanged();
 
     // Watch out for bus changes now doe.
+    m_lockOwnerWatcher->addWatchedService(m_systemWideLockOwner);
 
+    Q_EMIT systemWideLockChanged();
 }
 
 void USBGadgetManagerService::ReleaseSystemWideLock()
 {
+    DBusMethodSpan span(this, QStringLiteral("ReleaseSystemWideLock"));
+
     if (!calledFromDBus()) {
         qWarning() << "Something's wrong with callers!";
         return;
@@ -234,6 +1350,8 @@ void USBGadgetManagerService::ReleaseSystemWideLock()
     }
 
     // Ok then.
+    m_lockOwnerWatcher->removeWatchedService(m_systemWideLockOwner);
     m_systemWideLockOwner.clear();
+    m_systemWideLockReason.clear();
     Q_EMIT systemWideLockChanged();
 }
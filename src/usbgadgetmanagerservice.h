@@ -3,12 +3,27 @@
 
 #include <HemeraCore/AsyncInitDBusObject>
 
+#include "ethernetgadgetoperations.h"
+#include "latencystatistics.h"
+#include "requestscheduler.h"
+
 #include <QtCore/QStringList>
 #include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
 
 #include <QtDBus/QDBusContext>
+#include <QtDBus/QDBusUnixFileDescriptor>
 
+class QDBusServiceWatcher;
 class QTimer;
+
+class DHCPServer;
+class DataPipe;
+class GadgetCapabilities;
+class LinkStatistics;
+class USBCableMonitor;
+
 class USBGadgetManagerService : public Hemera::AsyncInitDBusObject
 {
     Q_OBJECT
@@ -23,23 +38,38 @@ class USBGadgetManagerService : public Hemera::AsyncInitDBusObject
     Q_PROPERTY(QString systemWideLockReason   READ systemWideLockReason      NOTIFY systemWideLockChanged)
 
 public:
-    explicit USBGadgetManagerService();
+    /// @p startupTimer should be started as early as possible: startup milestones are measured from there.
+    explicit USBGadgetManagerService(const QElapsedTimer &startupTimer = QElapsedTimer());
     virtual ~USBGadgetManagerService();
 
     void Activate(uint mode, const QVariantMap &arguments);
     void Deactivate();
+    void SwitchMode(uint mode, const QVariantMap &arguments);
+    void CancelOperation();
 
     void AcquireSystemWideLock(const QString &reason);
     void ReleaseSystemWideLock();
 
+    QVariantMap GetState();
+    QVariantMap GetOperation();
+    QVariantMap GetLatencyStatistics();
+    QVariantMap GetLinkStatistics();
+    QVariantMap GetControllers();
+
+    void SetTracing(bool enabled);
+    QString DumpTrace();
+
+    QDBusUnixFileDescriptor OpenDataPipe(QDBusUnixFileDescriptor &out);
+    void SendToHost(const QDBusUnixFileDescriptor &source);
+
     inline bool isSystemWideLockActive() const { return !m_systemWideLockOwner.isEmpty(); }
     inline QString systemWideLockOwner() const { return m_systemWideLockOwner; }
     inline QString systemWideLockReason() const { return m_systemWideLockReason; }
 
     inline uint activeMode() const { return m_activeMode; }
-    inline uint availableModes() const { return m_availableModes; }
+    uint availableModes() const;
     inline bool canDetectCableHotplugging() const { return m_canDetectCableHotplugging; }
-    inline uint usbCableStatus() const { return m_activeMode; }
+    inline uint usbCableStatus() const { return m_usbCableStatus; }
 
 protected:
     virtual void initImpl() override final;
@@ -48,17 +78,89 @@ Q_SIGNALS:
     void activeModeChanged();
     void systemWideLockChanged();
     void usbCableStatusChanged();
+    void StateChanged(const QVariantMap &changed);
+    void OperationProgress(uint mode, const QString &stage, uint percent);
+    void LinkStatisticsChanged(const QVariantMap &statistics);
+
+private Q_SLOTS:
+    void onCableStatusChanged();
+    void saveState();
+    void rearmIdleTimer();
+    void scheduleStateChanged();
+    void emitStateChanged();
 
 private:
+    friend class DBusMethodSpan;
+
+    /// An additional controller, driving @p udc. @p main owns it.
+    USBGadgetManagerService(USBGadgetManagerService *main, const QString &udc, uint controller);
+
+    void initController();
+    void updateControllers();
+    bool isBusy() const;
+    /// The cable on our UDC, as far as it tells. The main object falls back on what the system tells.
+    uint cableStatus() const;
+    /// The hotplug policy, if one is configured and can be applied. Otherwise empty, with the reason in @p errorMessage if there's one.
+    QByteArray hotplugPolicy(uint *mode, EthernetGadgetOperation::Options *options, QString *errorMessage) const;
+    /// Whether the hotplug policy would still act on a cable showing up.
+    bool isHotplugPending() const;
+    QString objectPath() const;
+    QVariantMap controllers() const;
+    /// @p udc, as fit for an object path, a ConfigFS gadget or a file name.
+    static QString controllerName(const QString &udc);
+
+    bool parseOptions(uint mode, const QVariantMap &arguments, EthernetGadgetOperation::Options *options, QString *errorMessage) const;
+    EthernetGadgetOperation *createOperation(const RequestScheduler::Request &request, QString *errorMessage);
+    RequestScheduler::Reply delayReply();
+    void restoreState();
+    QVariantMap state() const;
+    void trackOperation(const QString &operation, EthernetGadgetOperation *op);
+    void recordOperation(const QString &operation, EthernetGadgetOperation *op);
+    QString latencyStatisticsPath() const;
+    void recordStartupMilestone(const QString &milestone);
+    void recordFirstReply();
+    /// As a D-Bus method returns: unless it delayed its reply, that's when it's sent.
+    void recordMethodReturn();
+    static void sendJournalFields(const QList< QByteArray > &fields);
+
+    /// Null for the main object, which takes the first UDC and owns the others.
+    USBGadgetManagerService *m_main;
+    QString m_udc;
+    uint m_controller;
+    QHash< QString, USBGadgetManagerService* > m_controllers;
+
     QTimer *killerTimer;
+    QTimer *m_stateChangedTimer;
+    QDBusServiceWatcher *m_lockOwnerWatcher;
+    QDBusServiceWatcher *m_dataPipeHolderWatcher;
 
     QString m_systemWideLockOwner;
     QString m_systemWideLockReason;
+    /// Who got the data pipe endpoints, until it leaves the bus or the mode goes down.
+    QString m_dataPipeHolder;
 
     uint m_activeMode;
-    uint m_availableModes;
+    EthernetGadgetOperation::Options m_activeOptions;
+    QString m_activeInterfaceName;
+    QHostAddress m_activeP2PAddress;
     bool m_canDetectCableHotplugging;
     uint m_usbCableStatus;
+    /// The hotplug policy brought the gadget up, and nothing took it down since.
+    bool m_hotplugPrepared;
+    QVariantMap m_publishedState;
+
+    DHCPServer *m_dhcpServer;
+    DataPipe *m_dataPipe;
+    USBCableMonitor *m_cableMonitor;
+    GadgetCapabilities *m_capabilities;
+    RequestScheduler *m_scheduler;
+    LinkStatistics *m_linkStatistics;
+
+    QElapsedTimer m_startupTimer;
+    bool m_firstReplySent;
+    bool m_connmanReadyRecorded;
+
+    LatencyStatistics m_latencyStatistics;
 };
 
 #endif // USBGADGETMANAGERSERVICE_H